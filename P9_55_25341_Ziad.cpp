@@ -4,15 +4,228 @@
 #include <ctime>
 #include <vector>
 #include <string>
+#ifndef GYM_HEADLESS
 #include <al.h>
 #include <alc.h>
+#endif
 #include <iostream>
 #include <fstream>
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <queue>
+#include <deque>
+#include <algorithm>
+#include <cstring>
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <linux/input.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#endif
+#ifndef GYM_HEADLESS
 #include <glut.h>
+#ifndef _WIN32
+extern "C" void (*glXGetProcAddressARB(const GLubyte* procName))(void);
+#endif
+#else
+// The dedicated server build has no window or sound; the simulation only needs GLUT's key codes
+#define GLUT_KEY_F5 5
+#define GLUT_KEY_F9 9
+#define GLUT_KEY_LEFT 100
+#define GLUT_KEY_UP 101
+#define GLUT_KEY_RIGHT 102
+#define GLUT_KEY_DOWN 103
+#endif
+
+
+// Event tracing across the GLUT, sound loader and any other thread we own.
+// Each thread appends to its own fixed-size buffer, so recording an event is one
+// clock read and a few stores without locks; the oldest events are overwritten.
+// Traces are written as Chrome trace JSON, which Perfetto opens directly.
+const unsigned int TRACE_BUFFER_EVENTS = 1 << 15;  // Per thread, must be a power of two
+
+enum TraceEventType { TRACE_SLICE, TRACE_INSTANT, TRACE_COUNTER };
+
+struct TraceEvent {
+	const char* name;      // Not copied, must outlive the trace (use string literals)
+	long long startNs;
+	union {
+		long long durationNs;  // TRACE_SLICE
+		double value;          // TRACE_COUNTER
+	};
+	int type;
+};
+
+struct TraceBuffer {
+	const char* threadName;
+	int tid;
+	std::atomic<unsigned int> head;
+	TraceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+std::mutex traceRegistryMutex;           // Only taken when a thread registers and on flush
+std::vector<TraceBuffer*> traceBuffers;  // Never freed so threads that exited can still be flushed
+thread_local TraceBuffer* traceLocalBuffer = NULL;
+
+inline long long traceNow() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+long long traceEpochNs = traceNow();
+
+TraceBuffer* traceNewBuffer(const char* name) {
+	TraceBuffer* buffer = new TraceBuffer();
+	buffer->threadName = name;
+	buffer->head.store(0, std::memory_order_relaxed);
+	std::lock_guard<std::mutex> lock(traceRegistryMutex);
+	buffer->tid = (int)traceBuffers.size() + 1;
+	traceBuffers.push_back(buffer);
+	return buffer;
+}
+
+TraceBuffer* traceThreadBuffer() {
+	if (!traceLocalBuffer) traceLocalBuffer = traceNewBuffer("thread");
+	return traceLocalBuffer;
+}
+
+// A track for work that doesn't run on one of our threads, like the GPU's.
+// Only one thread may record on it.
+TraceBuffer* traceTrack(const char* name) {
+	return traceNewBuffer(name);
+}
+
+// Name shown for the calling thread's track, should be a string literal
+void traceSetThreadName(const char* name) {
+	traceThreadBuffer()->threadName = name;
+}
+
+inline TraceEvent& traceNextEvent(TraceBuffer* buffer, unsigned int& index) {
+	index = buffer->head.load(std::memory_order_relaxed);
+	return buffer->events[index & (TRACE_BUFFER_EVENTS - 1)];
+}
+
+inline void traceSlice(TraceBuffer* buffer, const char* name, long long startNs, long long endNs) {
+	unsigned int index;
+	TraceEvent& event = traceNextEvent(buffer, index);
+	event.name = name;
+	event.startNs = startNs;
+	event.durationNs = endNs - startNs;
+	event.type = TRACE_SLICE;
+	buffer->head.store(index + 1, std::memory_order_release);
+}
+
+inline void traceSlice(const char* name, long long startNs, long long endNs) {
+	traceSlice(traceThreadBuffer(), name, startNs, endNs);
+}
+
+inline void traceInstant(const char* name) {
+	TraceBuffer* buffer = traceThreadBuffer();
+	unsigned int index;
+	TraceEvent& event = traceNextEvent(buffer, index);
+	event.name = name;
+	event.startNs = traceNow();
+	event.durationNs = 0;
+	event.type = TRACE_INSTANT;
+	buffer->head.store(index + 1, std::memory_order_release);
+}
+
+inline void traceCounter(const char* name, double value) {
+	TraceBuffer* buffer = traceThreadBuffer();
+	unsigned int index;
+	TraceEvent& event = traceNextEvent(buffer, index);
+	event.name = name;
+	event.startNs = traceNow();
+	event.value = value;
+	event.type = TRACE_COUNTER;
+	buffer->head.store(index + 1, std::memory_order_release);
+}
+
+// Records a slice covering its lifetime
+class TraceScope {
+public:
+	TraceScope(const char* name) : name(name), startNs(traceNow()) {}
+	~TraceScope() {
+		traceSlice(name, startNs, traceNow());
+	}
+private:
+	const char* name;
+	long long startNs;
+};
+
+// Write every thread's buffered events; safe to call while other threads keep tracing
+bool writeTrace(const char* filename) {
+	std::ofstream file(filename);
+	if (!file) {
+		std::cerr << "Failed to open trace file: " << filename << std::endl;
+		return false;
+	}
 
+	std::lock_guard<std::mutex> lock(traceRegistryMutex);
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first = true;
+	std::vector<TraceEvent> events;
+	for (size_t b = 0; b < traceBuffers.size(); b++) {
+		TraceBuffer* buffer = traceBuffers[b];
+		file << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->tid
+			<< ",\"args\":{\"name\":\"" << buffer->threadName << "\"}}";
+		first = false;
+
+		unsigned int end = buffer->head.load(std::memory_order_acquire);
+		unsigned int begin = end > TRACE_BUFFER_EVENTS ? end - TRACE_BUFFER_EVENTS : 0;
+		events.clear();
+		for (unsigned int i = begin; i < end; i++) {
+			events.push_back(buffer->events[i & (TRACE_BUFFER_EVENTS - 1)]);
+		}
+		// Drop whatever the owning thread overwrote while we were copying
+		unsigned int after = buffer->head.load(std::memory_order_acquire);
+		size_t skip = after > TRACE_BUFFER_EVENTS && after - TRACE_BUFFER_EVENTS > begin ? after - TRACE_BUFFER_EVENTS - begin : 0;
+
+		for (size_t i = skip; i < events.size(); i++) {
+			const TraceEvent& event = events[i];
+			file << ",\n{\"name\":\"" << event.name << "\",\"pid\":1,\"tid\":" << buffer->tid
+				<< ",\"ts\":" << (event.startNs - traceEpochNs) / 1000.0;
+			if (event.type == TRACE_SLICE) {
+				file << ",\"ph\":\"X\",\"dur\":" << event.durationNs / 1000.0 << "}";
+			}
+			else if (event.type == TRACE_INSTANT) {
+				file << ",\"ph\":\"i\",\"s\":\"t\"}";
+			}
+			else {
+				file << ",\"ph\":\"C\",\"args\":{\"value\":" << event.value << "}}";
+			}
+		}
+	}
+	file << "\n]}\n";
+	std::cerr << "Trace written to " << filename << std::endl;
+	return true;
+}
+
+const char* traceFile = "session_trace.json";  // Where 'x' and -trace write
 
+void writeTraceAtExit() {
+	writeTrace(traceFile);
+}
+
+#ifndef GYM_HEADLESS
 // Function to initialize OpenAL
 ALCdevice* device;
 ALCcontext* context;
@@ -107,6 +320,7 @@ struct WAVHeader {
 
 // Function to load the WAV file and upload to OpenAL
 void loadWAVFile(const char* filename, ALuint& buffer) {
+	TraceScope trace(filename);
 	// Open the WAV file
 	std::ifstream file(filename, std::ios::binary);
 	if (!file) {
@@ -156,6 +370,8 @@ void loadWAVFile(const char* filename, ALuint& buffer) {
 
 
 void loadSoundInBackground() {
+	traceSetThreadName("sound loader");
+	TraceScope trace("loadSoundInBackground");
 	loadWAVFile("Stereo Madness.wav", bufferBackground);
 	loadWAVFile("Dark Souls.wav", bufferYouDied);
 	loadWAVFile("Super Mario Win.wav", bufferYouWin);
@@ -170,8 +386,13 @@ void loadSoundInBackground() {
 
 }
 // Function to play the "YOU DIED" sound
+bool backgroundMusicOn = false;  // So a restored state doesn't start the track over
+
 // Play the background music
 void playBackgroundMusic() {
+	if (backgroundMusicOn) return;
+	backgroundMusicOn = true;
+	traceInstant("playBackgroundMusic");
 	alSourcei(sourceBackground, AL_BUFFER, bufferBackground);
 	alSourcei(sourceBackground, AL_LOOPING, AL_TRUE); // Loop background music
 	alSourcePlay(sourceBackground);
@@ -179,56 +400,100 @@ void playBackgroundMusic() {
 
 // Stop the background music
 void stopBackgroundMusic() {
+	backgroundMusicOn = false;
 	alSourceStop(sourceBackground);
 }
 
 // Play the "You Died" sound
 void playYouDiedSound() {
+	traceInstant("playYouDiedSound");
 	alSourcei(sourceYouDied, AL_BUFFER, bufferYouDied);
 	alSourcePlay(sourceYouDied);
 }
 
 // Play the "You Win" sound
 void playYouWinSound() {
+	traceInstant("playYouWinSound");
 	alSourcei(sourceYouWin, AL_BUFFER, bufferYouWin);
 	alSourcePlay(sourceYouWin);
 }
 
 // Play the obstacle collision sound
 void playCollisionSound() {
+	traceInstant("playCollisionSound");
 	alSourcei(sourceCollision, AL_BUFFER, bufferCollision);
 	alSourcePlay(sourceCollision);
 }
 void playTreadmillSound() {
+	traceInstant("playTreadmillSound");
 	alSourcei(sourceTreadmill, AL_BUFFER, bufferTreadmill);
 	alSourcePlay(sourceTreadmill);
 }
 
 void playSmithSound() {
+	traceInstant("playSmithSound");
 	alSourcei(sourceSmith, AL_BUFFER, bufferSmith);
 	alSourcePlay(sourceSmith);
 }
 
 void playBenchPressSound() {
+	traceInstant("playBenchPressSound");
 	alSourcei(sourceBenchPress, AL_BUFFER, bufferBenchPress);
 	alSourcePlay(sourceBenchPress);
 }
 
 void playDumbbellRackSound() {
+	traceInstant("playDumbbellRackSound");
 	alSourcei(sourceDumbbellRack, AL_BUFFER, bufferDumbbellRack);
 	alSourcePlay(sourceDumbbellRack);
 }
 
 void playChinUpSound() {
+	traceInstant("playChinUpSound");
 	alSourcei(sourceChinUp, AL_BUFFER, bufferChinUp);
 	alSourcePlay(sourceChinUp);
 }
 
 void playDeadliftSound() {
+	traceInstant("playDeadliftSound");
 	alSourcei(sourceDeadlift, AL_BUFFER, bufferDeadlift);
 	alSourcePlay(sourceDeadlift);
 }
 
+// Cut an exercise sound short when the player gets off the machine
+void stopTreadmillSound() {
+	alSourceStop(sourceTreadmill);
+}
+
+void stopBenchPressSound() {
+	alSourceStop(sourceBenchPress);
+}
+
+void stopDumbbellRackSound() {
+	alSourceStop(sourceDumbbellRack);
+}
+
+void stopChinUpSound() {
+	alSourceStop(sourceChinUp);
+}
+
+void stopDeadliftSound() {
+	alSourceStop(sourceDeadlift);
+}
+
+// Number of sources the OpenAL mixer is currently playing
+int countPlayingVoices() {
+	ALuint sources[] = { sourceBackground, sourceYouDied, sourceYouWin, sourceCollision, sourceTreadmill,
+		sourceSmith, sourceBenchPress, sourceDumbbellRack, sourceChinUp, sourceDeadlift };
+	int playing = 0;
+	for (int i = 0; i < (int)(sizeof(sources) / sizeof(sources[0])); i++) {
+		ALint state = AL_STOPPED;
+		alGetSourcei(sources[i], AL_SOURCE_STATE, &state);
+		if (state == AL_PLAYING) playing++;
+	}
+	return playing;
+}
+
 // Cleanup OpenAL
 void cleanupOpenAL() {
 	alDeleteSources(1, &sourceBackground);
@@ -259,6 +524,27 @@ void cleanupOpenAL() {
 	alcDestroyContext(context);
 	alcCloseDevice(device);
 }
+#else
+// The dedicated server is silent; the simulation still cues its sounds
+void playBackgroundMusic() {}
+void stopBackgroundMusic() {}
+void playYouDiedSound() {}
+void playYouWinSound() {}
+void playTreadmillSound() {}
+void playSmithSound() {}
+void playBenchPressSound() {}
+void playDumbbellRackSound() {}
+void playChinUpSound() {}
+void playDeadliftSound() {}
+void stopTreadmillSound() {}
+void stopBenchPressSound() {}
+void stopDumbbellRackSound() {}
+void stopChinUpSound() {}
+void stopDeadliftSound() {}
+int countPlayingVoices() {
+	return 0;
+}
+#endif
 
 
 #define GLUT_KEY_ESCAPE 27
@@ -267,6 +553,71 @@ void cleanupOpenAL() {
 enum GameState { ACTIVE, WIN, LOSE };
 GameState gameState = ACTIVE;
 
+// The machines in the order the used and collision flags are saved in
+enum GymMachine { MACHINE_CHIN_UP, MACHINE_BENCH_PRESS, MACHINE_TREADMILL, MACHINE_DUMBBELL_RACK, MACHINE_SMITH, MACHINE_DEADLIFT, MACHINE_COUNT };
+
+// Game events. The simulation posts what changed while it runs a tick and the bus
+// hands the whole batch to the subscribers (sound, camera, HUD, score) at the end of
+// it, so they act on changes instead of checking the state every frame. The queue
+// and the handler table are fixed arrays: posting never allocates.
+enum GymEventType {
+	EVENT_ENTER_MACHINE_ZONE,
+	EVENT_LEAVE_MACHINE_ZONE,
+	EVENT_START_EXERCISE,
+	EVENT_STOP_EXERCISE,
+	EVENT_GAME_WON,
+	EVENT_GAME_LOST,
+	EVENT_TYPES
+};
+
+struct GymEvent {
+	GymEventType type;
+	int machine;  // GymMachine, -1 for the end of the game
+	float value;  // Start: 1 on the machine's first use
+};
+
+typedef void (*GymEventHandler)(const GymEvent& event);
+
+class EventBus {
+public:
+	static const int CAPACITY = 64;     // Events per tick
+	static const int MAX_HANDLERS = 8;  // Per event type
+
+	void subscribe(GymEventType type, GymEventHandler handler) {
+		if (handlerCount[type] < MAX_HANDLERS) handlers[type][handlerCount[type]++] = handler;
+	}
+
+	void post(GymEventType type, int machine = -1, float value = 0.0f) {
+		if (count == CAPACITY) {
+			dropped++;
+			return;
+		}
+		GymEvent& event = events[count++];
+		event.type = type;
+		event.machine = machine;
+		event.value = value;
+	}
+
+	// Handlers may post more; those go out in the same batch
+	void dispatch() {
+		for (int i = 0; i < count; i++) {
+			const GymEvent event = events[i];
+			for (int h = 0; h < handlerCount[event.type]; h++) handlers[event.type][h](event);
+		}
+		count = 0;
+	}
+
+	unsigned int dropped = 0;  // Posted while the queue was full
+
+private:
+	GymEvent events[CAPACITY];
+	int count = 0;
+	GymEventHandler handlers[EVENT_TYPES][MAX_HANDLERS];
+	int handlerCount[EVENT_TYPES] = {};
+};
+
+EventBus gymEvents;  // Simulation thread only
+
 class Vector3f {
 public:
 	float x, y, z;
@@ -346,14 +697,67 @@ public:
 		up = Vector3f(0.0f, 1.0f, 0.0f);
 	}
 
+#ifndef GYM_HEADLESS
 	void look() {
 		gluLookAt(eye.x, eye.y, eye.z, center.x, center.y, center.z, up.x, up.y, up.z);
 	}
+#endif
 };
 
 
 Camera camera;
 
+// Which cameras are drawn each frame; the broadcast camera shows the overhead view
+enum ViewLayout { LAYOUT_SINGLE, LAYOUT_PICTURE_IN_PICTURE, LAYOUT_SPLIT, LAYOUT_COUNT };
+ViewLayout viewLayout = LAYOUT_SINGLE;
+Camera broadcastCamera;
+
+void setViewLayout(ViewLayout layout) {
+	viewLayout = layout;
+	if (layout != LAYOUT_SINGLE) {
+		broadcastCamera.setOverheadView();
+	}
+}
+
+// Skeletal rig for the player. Joint poses are a rotation and an offset relative
+// to the parent joint; the skin matrices take the bind-pose mesh to the posed one.
+enum PlayerJoint { JOINT_ROOT, JOINT_TORSO, JOINT_HEAD, JOINT_LEFT_ARM, JOINT_RIGHT_ARM, JOINT_LEFT_LEG, JOINT_RIGHT_LEG, JOINT_COUNT };
+const int jointParents[JOINT_COUNT] = { -1, JOINT_ROOT, JOINT_ROOT, JOINT_ROOT, JOINT_ROOT, JOINT_ROOT, JOINT_ROOT };
+const float jointBindPositions[JOINT_COUNT][3] = {  // Model space, all bind rotations are identity
+	{ 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.3f, 0.0f },
+	{ -0.2f, 0.0f, 0.0f }, { 0.2f, 0.0f, 0.0f }, { -0.1f, -0.3f, 0.0f }, { 0.1f, -0.3f, 0.0f },
+};
+
+struct JointPose {
+	float rotation[4];     // Unit quaternion x, y, z, w
+	float translation[3];
+};
+
+// Everything the renderer reads from the game, copied by the simulation thread at
+// the end of each tick. The draw functions only ever look at this copy.
+struct RenderSnapshot {
+	GameState gameState;
+	float timeRemaining;
+	float rewindOffset;  // Seconds behind the newest tick while scrubbing, else 0
+	Camera camera;
+	char prompt[48];     // hudPrompt
+	unsigned int tick;   // simulationTicks when it was taken
+
+	// Player
+	float posX, PosY, posZ;
+	JointPose playerPose[JOINT_COUNT];  // Local joint poses, the root placed in the world
+	std::vector<JointPose> crowdPoses;  // JOINT_COUNT per crowd agent, like playerPose
+
+	// Machines and room
+	float barPosY;
+	float scaleFactor, color[3];
+	float barHeight, deadliftRotationAngle;
+	float dumbbellColor[3];
+	float WallColor[3];
+};
+
+RenderSnapshot frame;  // Render thread only, refreshed at the start of every Display()
+
 
 struct BoundingBox {
 	float minX, maxX;
@@ -362,1672 +766,7080 @@ struct BoundingBox {
 };
 
 
-
-
-void drawWall(double thickness, double width, double height) {
-	glPushMatrix();
-	glScaled(width, thickness, height); // Scale the wall size
-	glutSolidCube(1);
-	glPopMatrix();
+#ifndef GYM_HEADLESS
+// Look up a GL entry point that the GLUT headers (GL 1.1) don't declare
+void* getGLProc(const char* name) {
+#ifdef _WIN32
+	return (void*)wglGetProcAddress(name);
+#else
+	return (void*)glXGetProcAddressARB((const GLubyte*)name);
+#endif
 }
 
-void drawTableLeg(double thick, double len) {
-	glPushMatrix();
-	glTranslated(0, len / 2, 0);
-	glScaled(thick, len, thick);
-	glutSolidCube(1.0);
-	glPopMatrix();
-}
-void drawJackPart() {
-	glPushMatrix();
-	glScaled(0.2, 0.2, 1.0);
-	glutSolidSphere(1, 15, 15);
-	glPopMatrix();
-	glPushMatrix();
-	glTranslated(0, 0, 1.2);
-	glutSolidSphere(0.2, 15, 15);
-	glTranslated(0, 0, -2.4);
-	glutSolidSphere(0.2, 15, 15);
-	glPopMatrix();
-}
-void drawJack() {
-	glPushMatrix();
-	drawJackPart();
-	glRotated(90.0, 0, 1, 0);
-	drawJackPart();
-	glRotated(90.0, 1, 0, 0);
-	drawJackPart();
-	glPopMatrix();
-}
-void drawTable(double topWid, double topThick, double legThick, double legLen) {
-	glPushMatrix();
-	glTranslated(0, legLen, 0);
-	glScaled(topWid, topThick, topWid);
-	glutSolidCube(1.0);
-	glPopMatrix();
+// GL_ARB_timer_query, loaded at runtime
+#ifndef GL_QUERY_RESULT
+#define GL_QUERY_RESULT 0x8866
+#endif
+#ifndef GL_QUERY_RESULT_AVAILABLE
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#endif
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+
+typedef void (APIENTRY* GenQueriesProc)(GLsizei n, GLuint* ids);
+typedef void (APIENTRY* BeginQueryProc)(GLenum target, GLuint id);
+typedef void (APIENTRY* EndQueryProc)(GLenum target);
+typedef void (APIENTRY* GetQueryObjectuivProc)(GLuint id, GLenum pname, GLuint* params);
+typedef void (APIENTRY* GetQueryObjectui64vProc)(GLuint id, GLenum pname, unsigned long long* params);
+
+GenQueriesProc pglGenQueries = NULL;
+BeginQueryProc pglBeginQuery = NULL;
+EndQueryProc pglEndQuery = NULL;
+GetQueryObjectuivProc pglGetQueryObjectuiv = NULL;
+GetQueryObjectui64vProc pglGetQueryObjectui64v = NULL;
+
+
+#endif
+// Fixed-size history that one thread writes and any thread reads without locks.
+// Each slot carries a sequence number (odd while being written) so readers can
+// detect and drop a record that was overwritten under them.
+template <typename T, int N>
+class HistoryRing {
+public:
+	HistoryRing() : head(0) {
+		for (int i = 0; i < N; i++) slots[i].seq.store(0, std::memory_order_relaxed);
+	}
 
-	double dist = 0.95 * topWid / 2.0 - legThick / 2.0;
-	glPushMatrix();
-	glTranslated(dist, 0, dist);
-	drawTableLeg(legThick, legLen);
-	glTranslated(0, 0, -2 * dist);
-	drawTableLeg(legThick, legLen);
-	glTranslated(-2 * dist, 0, 2 * dist);
-	drawTableLeg(legThick, legLen);
-	glTranslated(0, 0, -2 * dist);
-	drawTableLeg(legThick, legLen);
-	glPopMatrix();
-}
+	void push(const T& value) {
+		unsigned int h = head.load(std::memory_order_relaxed);
+		Slot& slot = slots[h % N];
+		unsigned int seq = slot.seq.load(std::memory_order_relaxed);
+		slot.seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(&slot.value, &value, sizeof(T));
+		slot.seq.store(seq + 2, std::memory_order_release);
+		head.store(h + 1, std::memory_order_release);
+	}
 
-void setupLights() {
-	GLfloat ambient[] = { 0.7f, 0.7f, 0.7, 1.0f };
-	GLfloat diffuse[] = { 0.6f, 0.6f, 0.6, 1.0f };
-	GLfloat specular[] = { 1.0f, 1.0f, 1.0, 1.0f };
-	GLfloat shininess[] = { 50 };
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
-	glMaterialfv(GL_FRONT, GL_DIFFUSE, diffuse);
-	glMaterialfv(GL_FRONT, GL_SPECULAR, specular);
-	glMaterialfv(GL_FRONT, GL_SHININESS, shininess);
+	// age 0 is the newest record
+	bool read(unsigned int age, T& out) const {
+		unsigned int h = head.load(std::memory_order_acquire);
+		if (age >= h || age >= (unsigned int)N) return false;
+		const Slot& slot = slots[(h - 1 - age) % N];
+		unsigned int before = slot.seq.load(std::memory_order_acquire);
+		if (before & 1) return false;
+		memcpy(&out, &slot.value, sizeof(T));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return slot.seq.load(std::memory_order_relaxed) == before;
+	}
 
-	GLfloat lightIntensity[] = { 0.7f, 0.7f, 1, 1.0f };
-	GLfloat lightPosition[] = { -7.0f, 6.0f, 3.0f, 0.0f };
-	glLightfv(GL_LIGHT0, GL_POSITION, lightIntensity);
-	glLightfv(GL_LIGHT0, GL_DIFFUSE, lightIntensity);
-}
-void setupCamera() {
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	gluPerspective(60, 640 / 480, 0.001, 100);
+	unsigned int size() const {
+		unsigned int h = head.load(std::memory_order_acquire);
+		return h < (unsigned int)N ? h : N;
+	}
 
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
-	camera.look();
-}
+private:
+	struct Slot {
+		std::atomic<unsigned int> seq;
+		T value;
+	};
+	Slot slots[N];
+	std::atomic<unsigned int> head;
+};
 
-void drawWindowFrame(float width, float height, float depth) {
-	glColor3f(0.2f, 0.2f, 0.2f); // Dark gray color for the "TV frame"
+// Bounded queue between exactly one producer thread and one consumer thread.
+// N must be a power of two so the free-running indices wrap cleanly.
+template <typename T, int N>
+class SpscQueue {
+public:
+	SpscQueue() : head(0), tail(0) {}
+
+	// Returns false and drops the value when the queue is full
+	bool push(const T& value) {
+		unsigned int t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == (unsigned int)N) return false;
+		items[t % N] = value;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
 
-	// Draw a solid, filled rectangular block
-	glPushMatrix();
-	glScaled(width, height, depth);  // Scale to the specified width, height, and depth
-	glutSolidCube(1);                // Draw a solid cube scaled to form a rectangular box
-	glPopMatrix();
-}
+	bool pop(T& value) {
+		unsigned int h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire)) return false;
+		value = items[h % N];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
 
+private:
+	T items[N];
+	std::atomic<unsigned int> head, tail;
+};
 
+// Three copies of a value handed from one writer thread to one reader thread.
+// The writer fills back() and publishes it by swapping it with the middle slot;
+// the reader swaps the middle slot with its own only when something new arrived.
+// Neither side ever waits, and the reader always gets the newest complete copy.
+template <typename T>
+class TripleBuffer {
+public:
+	TripleBuffer() : writeIndex(0), readIndex(1), middle(2) {}
 
-float prevPosX = 0.0f, prevPosZ = 0.0f;
-float posX = -0.5f, posZ = 1.5f;
-float PosY = 0.1f;
-float legAngle = 0.0f, armAngle = 0.0f;
-float leftarmAngle = -armAngle;
+	T& back() {
+		return slots[writeIndex];
+	}
 
+	void publish() {
+		writeIndex = middle.exchange(writeIndex | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+	}
 
+	// Newest published value, or the same one as last time when nothing was published since
+	const T& latest() {
+		if (middle.load(std::memory_order_relaxed) & FRESH) {
+			readIndex = middle.exchange(readIndex, std::memory_order_acq_rel) & INDEX_MASK;
+		}
+		return slots[readIndex];
+	}
 
-bool isAnimatingBenchPress = false;
-float benchPressAnimationTime = 0.0f;
-float benchPressDuration = 3.0f;    // Total time for the animation in seconds
+private:
+	enum { INDEX_MASK = 3, FRESH = 4 };
+	T slots[3];
+	int writeIndex, readIndex;  // Each only touched by its own thread
+	std::atomic<int> middle;
+};
 
-float startPosXBench = posX;
-float startPosZBench = posZ;
-float barLiftAmount = 0.15f;        // Amount the bar moves up and down
-float barPosY = 0.6f;               // Starting Y position of the bar
-bool isLiftingBar = false;          // Track lifting state for bar
 
+#ifndef GYM_HEADLESS
+// Named passes of a frame, timed on the CPU and with GL_TIME_ELAPSED queries on the GPU
+enum ProfilePass { PASS_UPDATE, PASS_SHADOWS, PASS_PLAYERS, PASS_MACHINES, PASS_WALLS, PASS_HUD, PASS_COUNT };
+const char* profilePassNames[PASS_COUNT] = { "update", "shadows", "players", "machines", "walls", "hud" };
 
+struct FrameProfile {
+	unsigned int frame;
+	double startUs[PASS_COUNT];   // CPU start of each pass since the profiler started
+	float cpuMs[PASS_COUNT];
+	float gpuMs[PASS_COUNT];      // -1 when no timer query result is available
+	int drawCalls[PASS_COUNT];
+};
 
-void drawBenchPressSeat() {
-	glPushMatrix();
-	glColor3f(0.3f, 0.3f, 0.3f);      // Dark gray color for seat
-	glTranslated(1.2, 0.3, 0.7);      // Move seat slightly up and outward
-	glScaled(0.8, 0.08, 0.25);        // Scale to make seat larger
-	glutSolidCube(1);
-	glPopMatrix();
-}
+const int PROFILE_HISTORY = 256;  // Frames kept for the overlay
+const int QUERY_FRAMES = 3;       // Frames a GPU query is given before its result is read
+const int PASS_SPANS = 4;         // Times a pass may be begun in one frame, once per view
 
-void drawSeatLeg1() {
-	glPushMatrix();
-	glColor3f(0.1f, 0.1f, 0.1f);      // Dark color for the leg
-	glTranslated(0.95, 0.15, 0.7);    // Adjust position of left leg
-	glScaled(0.1, 0.3, 0.1);          // Scale to make leg thicker and taller
-	glutSolidCube(1);
-	glPopMatrix();
-}
+class FrameProfiler {
+public:
+	bool overlayVisible = false;
+	HistoryRing<FrameProfile, PROFILE_HISTORY> history;
+
+	FrameProfiler() {
+		epoch = std::chrono::steady_clock::now();
+		memset(pending, 0, sizeof(pending));
+		memset(pendingValid, 0, sizeof(pendingValid));
+		memset(queries, 0, sizeof(queries));
+		memset(spans, 0, sizeof(spans));
+	}
 
-void drawSeatLeg2() {
-	glPushMatrix();
-	glColor3f(0.1f, 0.1f, 0.1f);      // Dark color for the leg
-	glTranslated(1.4, 0.15, 0.7);     // Adjust position of right leg
-	glScaled(0.1, 0.3, 0.1);          // Scale to make leg thicker and taller
-	glutSolidCube(1);
-	glPopMatrix();
-}
+	// Needs a current GL context; without timer queries only CPU times are recorded
+	void init() {
+		pglGenQueries = (GenQueriesProc)getGLProc("glGenQueries");
+		pglBeginQuery = (BeginQueryProc)getGLProc("glBeginQuery");
+		pglEndQuery = (EndQueryProc)getGLProc("glEndQuery");
+		pglGetQueryObjectuiv = (GetQueryObjectuivProc)getGLProc("glGetQueryObjectuiv");
+		pglGetQueryObjectui64v = (GetQueryObjectui64vProc)getGLProc("glGetQueryObjectui64v");
+		gpuTiming = pglGenQueries && pglBeginQuery && pglEndQuery && pglGetQueryObjectuiv && pglGetQueryObjectui64v
+			&& glutExtensionSupported("GL_ARB_timer_query");
+		if (gpuTiming) {
+			pglGenQueries(QUERY_FRAMES * PASS_COUNT * PASS_SPANS, &queries[0][0][0]);
+			gpuTrack = traceTrack("GPU passes");
+		}
+		else {
+			std::cerr << "GL_ARB_timer_query not available, profiling CPU only." << std::endl;
+		}
+	}
 
-void drawVerticalSupport1() {
-	glPushMatrix();
-	glColor3f(0.2f, 0.2f, 0.2f);      // Black color for support
-	glTranslated(0.9, 0.5, 1.0);      // Move right side support up and outward
-	glScaled(0.1, 0.7, 0.1);          // Scale to make support taller and thicker
-	glutSolidCube(1);
-	glPopMatrix();
-}
+	void beginFrame() {
+		frameIndex++;
+		slot = frameIndex % QUERY_FRAMES;
+		// The slot we are about to reuse holds the frame issued QUERY_FRAMES ago
+		if (pendingValid[slot]) {
+			resolve(slot);
+			history.push(pending[slot]);
+		}
+		FrameProfile& frame = pending[slot];
+		memset(&frame, 0, sizeof(frame));
+		frame.frame = frameIndex;
+		for (int i = 0; i < PASS_COUNT; i++) frame.gpuMs[i] = -1.0f;
+		memset(spans[slot], 0, sizeof(spans[slot]));
+		pendingValid[slot] = true;
+	}
 
-void drawVerticalSupport2() {
-	glPushMatrix();
-	glColor3f(0.2f, 0.2f, 0.2f);      // Black color for support
-	glTranslated(0.9, 0.5, 0.4);      // Move left side support up and outward
-	glScaled(0.1, 0.7, 0.1);          // Scale to make support taller and thicker
-	glutSolidCube(1);
-	glPopMatrix();
-}
+	void beginPass(ProfilePass pass) {
+		if (activePass >= 0) endPass((ProfilePass)activePass);
+		activePass = pass;
+		passStart = std::chrono::steady_clock::now();
+		int& span = spans[slot][pass];
+		if (span == 0) pending[slot].startUs[pass] = std::chrono::duration<double, std::micro>(passStart - epoch).count();
+		gpuSpan = gpuTiming && span < PASS_SPANS;
+		if (gpuSpan) pglBeginQuery(GL_TIME_ELAPSED, queries[slot][pass][span]);
+		span++;
+	}
 
-void drawBar() {
-	glPushMatrix();
-	glColor3f(1.0f, 1.0f, 1.0f);
-	glTranslated(0.9, barPosY, 0.7);  // Use `barPosY` for lifting animation
-	glRotated(90, 0.0, 1.0, 0.0);
-	glScaled(1.5, 0.08, 0.08);
-	glutSolidCube(1);
-	glPopMatrix();
-}
+	void endPass(ProfilePass pass) {
+		if (activePass != pass) return;
+		std::chrono::time_point<std::chrono::steady_clock> passEnd = std::chrono::steady_clock::now();
+		std::chrono::duration<float, std::milli> elapsed = passEnd - passStart;
+		pending[slot].cpuMs[pass] += elapsed.count();
+		traceSlice(profilePassNames[pass],
+			std::chrono::duration_cast<std::chrono::nanoseconds>(passStart.time_since_epoch()).count(),
+			std::chrono::duration_cast<std::chrono::nanoseconds>(passEnd.time_since_epoch()).count());
+		if (gpuSpan) pglEndQuery(GL_TIME_ELAPSED);
+		activePass = -1;
+	}
 
-void drawLeftWeight() {
-	glPushMatrix();
-	glColor3f(0.0f, 0.0f, 0.0f);      // Dark gray color for weights
-	glTranslated(0.9, barPosY, 1.25);     // Position left weight further out
-	glScaled(0.45, 0.5, 0.1);         // Scale to make weight larger and thicker
-	glutSolidCube(1.5);
-	glPopMatrix();
-}
+	void endFrame() {
+		if (activePass >= 0) endPass((ProfilePass)activePass);
+	}
 
-void drawRightWeight() {
-	glPushMatrix();
-	glColor3f(0.0f, 0.0f, 0.0f);      // Dark gray color for weights
-	glTranslated(0.9, barPosY, 0.15);     // Position right weight further out
-	glScaled(0.45, 0.5, 0.1);         // Scale to make weight larger and thicker
-	glutSolidCube(1.5);
-	glPopMatrix();
-}
+	void countDraw() {
+		if (activePass >= 0) pending[slot].drawCalls[activePass]++;
+	}
 
+	// Average of the most recent frames in the history
+	FrameProfile average(unsigned int frames) const {
+		FrameProfile avg;
+		memset(&avg, 0, sizeof(avg));
+		int gpuSamples[PASS_COUNT] = { 0 };
+		unsigned int count = 0;
+		FrameProfile record;
+		for (unsigned int age = 0; age < frames; age++) {
+			if (!history.read(age, record)) continue;
+			for (int i = 0; i < PASS_COUNT; i++) {
+				avg.cpuMs[i] += record.cpuMs[i];
+				avg.drawCalls[i] += record.drawCalls[i];
+				if (record.gpuMs[i] >= 0.0f) {
+					avg.gpuMs[i] += record.gpuMs[i];
+					gpuSamples[i]++;
+				}
+			}
+			count++;
+		}
+		for (int i = 0; i < PASS_COUNT; i++) {
+			if (count > 0) {
+				avg.cpuMs[i] /= count;
+				avg.drawCalls[i] /= count;
+			}
+			avg.gpuMs[i] = gpuSamples[i] > 0 ? avg.gpuMs[i] / gpuSamples[i] : -1.0f;
+		}
+		return avg;
+	}
 
+private:
+	std::chrono::time_point<std::chrono::steady_clock> epoch, passStart;
+	unsigned int frameIndex = 0;
+	int slot = 0;
+	int activePass = -1;
+	bool gpuTiming = false;
+	bool gpuSpan = false;  // The active pass has a query running
+	TraceBuffer* gpuTrack = NULL;  // GPU times go in the event trace, placed at the CPU start of the pass
+	GLuint queries[QUERY_FRAMES][PASS_COUNT][PASS_SPANS];
+	int spans[QUERY_FRAMES][PASS_COUNT];  // Times each pass was begun in the frame
+	FrameProfile pending[QUERY_FRAMES];
+	bool pendingValid[QUERY_FRAMES];
+
+	void resolve(int s) {
+		if (!gpuTiming) return;
+		for (int i = 0; i < PASS_COUNT; i++) {
+			if (spans[s][i] == 0 || spans[s][i] > PASS_SPANS) continue;  // Not run, or not all of it timed
+			unsigned long long total = 0;
+			int span = 0;
+			for (; span < spans[s][i]; span++) {
+				GLuint available = 0;
+				pglGetQueryObjectuiv(queries[s][i][span], GL_QUERY_RESULT_AVAILABLE, &available);
+				if (!available) break;  // Don't stall the pipeline, drop this sample
+				unsigned long long ns = 0;
+				pglGetQueryObjectui64v(queries[s][i][span], GL_QUERY_RESULT, &ns);
+				total += ns;
+			}
+			if (span < spans[s][i]) continue;
+			pending[s].gpuMs[i] = total / 1000000.0f;
+			long long startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(epoch.time_since_epoch()).count()
+				+ (long long)(pending[s].startUs[i] * 1000.0);
+			traceSlice(gpuTrack, profilePassNames[i], startNs, startNs + (long long)total);
+		}
+	}
+};
 
+FrameProfiler profiler;
 
+// Times a pass for as long as it is in scope
+class ProfileScope {
+public:
+	ProfileScope(ProfilePass pass) : pass(pass) {
+		profiler.beginPass(pass);
+	}
+	~ProfileScope() {
+		profiler.endPass(pass);
+	}
+private:
+	ProfilePass pass;
+};
 
-bool isAnimatingSmith = false;      // Track if animatio nis active
-float scaleFactor = 1.0f;      // Initial scale factor
-float color[3] = { 0.0f, 0.0f, 0.0f }; // Current color (initially black)
+// Bitmap fonts baked into one alpha texture so a whole string is drawn as a
+// single batch of textured quads instead of one glBitmap call per character.
+enum TextFont { FONT_HUD, FONT_TITLE, FONT_FIXED, FONT_COUNT };
 
-// Animation parameters
-float targetScale = 1.5f;      // Maximum scale factor
-float originalColor[3] = { 0.0f, 0.0f, 0.0f }; // Original color (black)
-float maxColor[3] = { 1.0f, 1.0f, 1.0f };      // Color at maximum scale (red)
-int animationStep = 0;         // Tracks current stage in animation
-int animationSpeed = 80;       // Controls speed of animation steps
-int holdDuration = 30;         // Frames to hold at max scale and color
+const int FIRST_GLYPH = 32;   // ' '
+const int GLYPH_COUNT = 95;   // Printable ASCII up to '~'
+const int GLYPH_PAD = 2;      // Room for glyphs that start left of the pen
 
+struct GlyphInfo {
+	float u0, v0, u1, v1;
+	int x, y;         // Bottom left of the glyph cell in atlas pixels
+	int advance;
+};
 
+struct AtlasFont {
+	void* glutFont;
+	int cellHeight;   // Line height in pixels
+	int descent;      // Baseline offset from the bottom of a cell
+	int cellWidth;
+	int bandY;        // First atlas row used by this font
+	GlyphInfo glyphs[GLYPH_COUNT];
+};
 
+class FontAtlas {
+public:
+	static const int WIDTH = 512;
+	static const int HEIGHT = 512;
+	bool ready = false;
+	GLuint texture = 0;
+	std::vector<unsigned char> pixels;  // Glyph coverage, row 0 at the bottom
+	AtlasFont fonts[FONT_COUNT];
+
+	FontAtlas() {
+		fonts[FONT_HUD].glutFont = GLUT_BITMAP_HELVETICA_18;
+		fonts[FONT_HUD].cellHeight = 24;
+		fonts[FONT_HUD].descent = 5;
+		fonts[FONT_TITLE].glutFont = GLUT_BITMAP_TIMES_ROMAN_24;
+		fonts[FONT_TITLE].cellHeight = 32;
+		fonts[FONT_TITLE].descent = 7;
+		fonts[FONT_FIXED].glutFont = GLUT_BITMAP_8_BY_13;
+		fonts[FONT_FIXED].cellHeight = 15;
+		fonts[FONT_FIXED].descent = 3;
+	}
 
+	// Rasterize every glyph with GLUT once, read the pixels back and upload them.
+	// Uses the framebuffer as scratch space, so call it before the frame is cleared.
+	void build() {
+		TraceScope trace("FontAtlas::build");
+		pixels.assign(WIDTH * HEIGHT, 0);
+
+		GLfloat clearColor[4];
+		glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+		int windowWidth = glutGet(GLUT_WINDOW_WIDTH);
+		int windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
+
+		glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_VIEWPORT_BIT);
+		glDisable(GL_LIGHTING);
+		glDisable(GL_DEPTH_TEST);
+		glDisable(GL_TEXTURE_2D);
+		glViewport(0, 0, windowWidth, windowHeight);
+		glMatrixMode(GL_PROJECTION);
+		glPushMatrix();
+		glLoadIdentity();
+		gluOrtho2D(0, windowWidth, 0, windowHeight);
+		glMatrixMode(GL_MODELVIEW);
+		glPushMatrix();
+		glLoadIdentity();
+		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+		glColor3f(1.0f, 1.0f, 1.0f);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+		int bandY = 0;
+		std::vector<unsigned char> band;
+		for (int f = 0; f < FONT_COUNT; f++) {
+			AtlasFont& font = fonts[f];
+			int widest = 0;
+			for (int i = 0; i < GLYPH_COUNT; i++) {
+				int advance = glutBitmapWidth(font.glutFont, FIRST_GLYPH + i);
+				if (advance > widest) widest = advance;
+			}
+			font.cellWidth = widest + 2 * GLYPH_PAD;
+			font.bandY = bandY;
+			int columns = WIDTH / font.cellWidth;
+			int rows = (GLYPH_COUNT + columns - 1) / columns;
+			int bandWidth = columns * font.cellWidth;
+			int bandHeight = rows * font.cellHeight;
+			if (bandY + bandHeight > HEIGHT || bandWidth > windowWidth || bandHeight > windowHeight) {
+				std::cerr << "Font atlas does not fit, text will be missing." << std::endl;
+				break;
+			}
 
-// Draw the base support
-void drawBaseSupport() {
-	glPushMatrix();
-	glColor3f(color[0], color[1], color[2]);      // Use current animation color
-	glScaled(1.5 * scaleFactor, 0.1 * scaleFactor, 0.1 * scaleFactor); // Apply scale factor
-	glutSolidCube(1);
-	glPopMatrix();
-}
+			glClear(GL_COLOR_BUFFER_BIT);
+			for (int i = 0; i < GLYPH_COUNT; i++) {
+				int x = (i % columns) * font.cellWidth;
+				int y = (i / columns) * font.cellHeight;
+				glRasterPos2i(x + GLYPH_PAD, y + font.descent);
+				glutBitmapCharacter(font.glutFont, FIRST_GLYPH + i);
+
+				GlyphInfo& glyph = font.glyphs[i];
+				glyph.x = x;
+				glyph.y = bandY + y;
+				glyph.u0 = (float)x / WIDTH;
+				glyph.v0 = (float)(bandY + y) / HEIGHT;
+				glyph.u1 = (float)(x + font.cellWidth) / WIDTH;
+				glyph.v1 = (float)(bandY + y + font.cellHeight) / HEIGHT;
+				glyph.advance = glutBitmapWidth(font.glutFont, FIRST_GLYPH + i);
+			}
+			band.resize(bandWidth * bandHeight);
+			glReadPixels(0, 0, bandWidth, bandHeight, GL_RED, GL_UNSIGNED_BYTE, &band[0]);
+			for (int row = 0; row < bandHeight; row++) {
+				memcpy(&pixels[(bandY + row) * WIDTH], &band[row * bandWidth], bandWidth);
+			}
+			bandY += bandHeight;
+		}
 
-// Draw the left vertical frame
-void drawLeftVerticalFrame() {
-	glPushMatrix();
-	glColor3f(color[0], color[1], color[2]);
-	glTranslated(-0.7 * scaleFactor, 0.5 * scaleFactor, 0); // Apply scale factor to translation
-	glScaled(0.1 * scaleFactor, 1.5 * scaleFactor, 0.1 * scaleFactor); // Apply scale factor to scaling
-	glutSolidCube(1);
-	glPopMatrix();
-}
+		glPopMatrix();
+		glMatrixMode(GL_PROJECTION);
+		glPopMatrix();
+		glMatrixMode(GL_MODELVIEW);
+		glPopAttrib();
+		glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+
+		if (texture == 0) glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, WIDTH, HEIGHT, 0, GL_ALPHA, GL_UNSIGNED_BYTE, &pixels[0]);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		ready = true;
+	}
 
-// Draw the right vertical frame
-void drawRightVerticalFrame() {
-	glPushMatrix();
-	glColor3f(color[0], color[1], color[2]);
-	glTranslated(0.7 * scaleFactor, 0.5 * scaleFactor, 0); // Apply scale factor to translation
-	glScaled(0.1 * scaleFactor, 1.5 * scaleFactor, 0.1 * scaleFactor); // Apply scale factor to scaling
-	glutSolidCube(1);
-	glPopMatrix();
-}
+	const GlyphInfo* glyph(TextFont font, char c) const {
+		int index = (unsigned char)c - FIRST_GLYPH;
+		if (index < 0 || index >= GLYPH_COUNT) return NULL;
+		return &fonts[font].glyphs[index];
+	}
+};
 
-// Draw the left frame support (diagonal)
-void drawLeftFrameSupport() {
-	glPushMatrix();
-	glColor3f(color[0], color[1], color[2]);
-	glTranslated(-0.7 * scaleFactor, 0.25 * scaleFactor, -0.35 * scaleFactor); // Apply scale factor to translation
-	glRotated(45, 1.0, 0.0, 0.0);
-	glScaled(0.1 * scaleFactor, 1.0 * scaleFactor, 0.1 * scaleFactor); // Apply scale factor to scaling
-	glutSolidCube(1);
-	glPopMatrix();
-}
+FontAtlas fontAtlas;
 
-// Draw the right frame support (diagonal)
-void drawRightFrameSupport() {
-	glPushMatrix();
-	glColor3f(color[0], color[1], color[2]);
-	glTranslated(0.7 * scaleFactor, 0.25 * scaleFactor, -0.35 * scaleFactor); // Apply scale factor to translation
-	glRotated(45, 1.0, 0.0, 0.0);
-	glScaled(0.1 * scaleFactor, 1.0 * scaleFactor, 0.1 * scaleFactor); // Apply scale factor to scaling
-	glutSolidCube(1);
-	glPopMatrix();
-}
+// A copy of the string drawn with a pixel offset and its own color, e.g. for outlines
+struct TextLayer {
+	float dx, dy;
+	float r, g, b;
+};
 
-// Draw the bottom support beam (horizontal, connecting left and right frames)
-void drawBottomSupport() {
-	glPushMatrix();
-	glColor3f(color[0], color[1], color[2]);
-	glTranslated(0, 0.05 * scaleFactor, -0.55 * scaleFactor); // Apply scale factor to translation
-	glScaled(1.3 * scaleFactor, 0.1 * scaleFactor, 0.1 * scaleFactor); // Apply scale factor to scaling
-	glutSolidCube(1);
-	glPopMatrix();
-}
+struct TextVertex {
+	float x, y;
+	float u, v;
+	unsigned char color[4];
+};
 
-// Draw the top horizontal bar
-void drawTopBar() {
-	glPushMatrix();
-	glColor3f(color[0], color[1], color[2]);
-	glTranslated(0, 1.2 * scaleFactor, 0); // Apply scale factor to translation
-	glScaled(1.5 * scaleFactor, 0.1 * scaleFactor, 0.1 * scaleFactor); // Apply scale factor to scaling
-	glutSolidCube(1);
-	glPopMatrix();
-}
+// Screen-space text whose quads are only rebuilt when the text, font or layers change
+class TextLabel {
+public:
+	void set(TextFont newFont, const char* newText, const TextLayer* newLayers, int layerCount) {
+		if (newFont == font && text == newText && layerCount == (int)layers.size()
+			&& (layerCount == 0 || memcmp(&layers[0], newLayers, layerCount * sizeof(TextLayer)) == 0)) {
+			return;
+		}
+		font = newFont;
+		text = newText;
+		layers.assign(newLayers, newLayers + layerCount);
+		layout();
+	}
 
-// Draw the barbell
-void drawBarbell() {
-	glPushMatrix();
-	glColor3f(0.75f * color[0], 0.75f * color[1], 0.75f * color[2]); // Silver color with scaling effect
-	glTranslated(0, 0.8 * scaleFactor, 0); // Apply scale factor to translation
-	glScaled(1.9 * scaleFactor, 0.05 * scaleFactor, 0.05 * scaleFactor); // Apply scale factor to scaling
-	glutSolidCube(1);
-	glPopMatrix();
-}
+	void set(TextFont newFont, const char* newText, float r, float g, float b) {
+		TextLayer layer = { 0.0f, 0.0f, r, g, b };
+		set(newFont, newText, &layer, 1);
+	}
 
-// Draw the left counterweight
-void drawLeftCounterweight() {
+	// Draw with the first line's baseline starting at window pixel (x, y); expects beginScreenText()
+	void draw(float x, float y) const {
+		if (vertices.empty()) return;
+		glPushMatrix();
+		glTranslatef(floor(x + 0.5f), floor(y + 0.5f), 0.0f);
+		glVertexPointer(2, GL_FLOAT, sizeof(TextVertex), &vertices[0].x);
+		glTexCoordPointer(2, GL_FLOAT, sizeof(TextVertex), &vertices[0].u);
+		glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(TextVertex), vertices[0].color);
+		profiler.countDraw();
+		glDrawArrays(GL_QUADS, 0, (GLsizei)vertices.size());
+		glPopMatrix();
+	}
+
+private:
+	TextFont font = FONT_HUD;
+	std::string text;
+	std::vector<TextLayer> layers;
+	std::vector<TextVertex> vertices;
+
+	void layout() {
+		vertices.clear();
+		const AtlasFont& atlasFont = fontAtlas.fonts[font];
+		for (size_t l = 0; l < layers.size(); l++) {
+			const TextLayer& layer = layers[l];
+			unsigned char color[4] = { (unsigned char)(layer.r * 255), (unsigned char)(layer.g * 255), (unsigned char)(layer.b * 255), 255 };
+			float penX = layer.dx, penY = layer.dy;
+			for (size_t i = 0; i < text.size(); i++) {
+				if (text[i] == '\n') {
+					penX = layer.dx;
+					penY -= atlasFont.cellHeight;
+					continue;
+				}
+				const GlyphInfo* glyph = fontAtlas.glyph(font, text[i]);
+				if (!glyph) continue;
+				float x0 = penX - GLYPH_PAD, x1 = x0 + atlasFont.cellWidth;
+				float y0 = penY - atlasFont.descent, y1 = y0 + atlasFont.cellHeight;
+				TextVertex quad[4] = {
+					{ x0, y0, glyph->u0, glyph->v0 },
+					{ x1, y0, glyph->u1, glyph->v0 },
+					{ x1, y1, glyph->u1, glyph->v1 },
+					{ x0, y1, glyph->u0, glyph->v1 },
+				};
+				for (int v = 0; v < 4; v++) {
+					memcpy(quad[v].color, color, 4);
+					vertices.push_back(quad[v]);
+				}
+				penX += glyph->advance;
+			}
+		}
+	}
+};
+
+// Switch to window-pixel coordinates with the font atlas bound
+void beginScreenText() {
+	int width = glutGet(GLUT_WINDOW_WIDTH);
+	int height = glutGet(GLUT_WINDOW_HEIGHT);
+	glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_COLOR_BUFFER_BIT | GL_TEXTURE_BIT);
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+	glDisable(GL_LIGHTING);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_TEXTURE_2D);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glBindTexture(GL_TEXTURE_2D, fontAtlas.texture);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glMatrixMode(GL_PROJECTION);
 	glPushMatrix();
-	glColor3f(0.3f * color[0], 0.3f * color[1], 0.3f * color[2]); // Darker color with scaling effect
-	glTranslated(-0.6 * scaleFactor, 0.75 * scaleFactor, 0); // Apply scale factor to translation
-	glScaled(0.1 * scaleFactor, 0.4 * scaleFactor, 0.1 * scaleFactor); // Apply scale factor to scaling
-	glutSolidCube(1);
-	glPopMatrix();
+	glLoadIdentity();
+	gluOrtho2D(0, width, 0, height);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
 }
 
-// Draw the right counterweight
-void drawRightCounterweight() {
-	glPushMatrix();
-	glColor3f(0.3f * color[0], 0.3f * color[1], 0.3f * color[2]); // Darker color with scaling effect
-	glTranslated(0.6 * scaleFactor, 0.75 * scaleFactor, 0); // Apply scale factor to translation
-	glScaled(0.1 * scaleFactor, 0.4 * scaleFactor, 0.1 * scaleFactor); // Apply scale factor to scaling
-	glutSolidCube(1);
+void endScreenText() {
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
 	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopClientAttrib();
+	glPopAttrib();
 }
 
+// Screen-space widgets rasterized on the CPU from the glyph atlas into one
+// window-sized texture. Only the rectangles of widgets whose text or position
+// changed are re-rasterized and uploaded; every frame the layer is composited
+// over the 3D scene with a single quad.
+struct HudRect {
+	int x0, y0, x1, y1;  // Half-open, in window pixels
 
+	bool empty() const { return x0 >= x1 || y0 >= y1; }
 
-float barHeight = -0.2f;
+	void merge(const HudRect& other) {
+		if (other.empty()) return;
+		if (empty()) {
+			*this = other;
+			return;
+		}
+		if (other.x0 < x0) x0 = other.x0;
+		if (other.y0 < y0) y0 = other.y0;
+		if (other.x1 > x1) x1 = other.x1;
+		if (other.y1 > y1) y1 = other.y1;
+	}
 
+	HudRect clipped(const HudRect& bounds) const {
+		HudRect r = { x0 > bounds.x0 ? x0 : bounds.x0, y0 > bounds.y0 ? y0 : bounds.y0,
+			x1 < bounds.x1 ? x1 : bounds.x1, y1 < bounds.y1 ? y1 : bounds.y1 };
+		return r;
+	}
+};
 
-void drawDeadliftBar() {
-	glPushMatrix();
-	glColor3f(0.75f, 0.75f, 0.75f);  // Silver color for the bar
-	glTranslated(0.0, 0.5, 0.0);     // Position bar above the ground
-	glScaled(1.5, 0.05, 0.05);       // Scale to make it a long, thin bar
-	glutSolidCube(1);
-	glPopMatrix();
-}
+class HudLayer {
+public:
+	int addWidget(TextFont font, const TextLayer* layers, int layerCount) {
+		Widget widget;
+		widget.font = font;
+		widget.layers.assign(layers, layers + layerCount);
+		widget.x = widget.y = 0;
+		widget.visible = false;
+		widget.bounds = emptyRect();
+		widgets.push_back(widget);
+		return (int)widgets.size() - 1;
+	}
 
-// Function to draw a dumbbell weight
-void drawDumbbell(float radius, float thickness) {
-	glColor3f(0.1f, 0.1f, 0.1f);  // Dark color for weights
+	void setText(int id, const char* text) {
+		Widget& widget = widgets[id];
+		if (widget.text == text) return;
+		widget.text = text;
+		invalidate(widget);
+	}
 
-	// Draw left side of the weight
-	glPushMatrix();
-	glTranslated(-0.75, 0.5, 0.0);  // Position weight on the left end of the bar
-	glScaled(thickness, radius, radius);  // Scale to make a thin, large disc shape
-	glutSolidCube(1);  // Draw weigh4
-	glPopMatrix();
+	// Baseline of the first line, in window pixels
+	void setPosition(int id, float x, float y) {
+		Widget& widget = widgets[id];
+		int px = (int)floor(x + 0.5f), py = (int)floor(y + 0.5f);
+		if (widget.visible && px == widget.x && py == widget.y) return;
+		widget.x = px;
+		widget.y = py;
+		widget.visible = true;
+		invalidate(widget);
+	}
 
-	// Draw right side of the weight
-	glPushMatrix();
-	glTranslated(0.75, 0.5, 0.0);  // Position weight on the right end of the bar
-	glScaled(thickness, radius, radius);  // Scale to match the left side
-	glutSolidCube(1);  // Draw weight
-	glPopMatrix();
-}
+	void hide(int id) {
+		Widget& widget = widgets[id];
+		if (!widget.visible) return;
+		widget.visible = false;
+		invalidate(widget);
+	}
 
-void drawBase() {
-	glPushMatrix();
-	glColor3f(0.3f, 0.3f, 0.3f);  // Dark gray color for the base
-	glScaled(1.2, 0.1, 0.6);      // Scale for the base frame
-	glutSolidCube(1);
-	glPopMatrix();
-}
+	// Bring the texture up to date and draw it over the current frame
+	void composite() {
+		int windowWidth = glutGet(GLUT_WINDOW_WIDTH);
+		int windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
+		if (windowWidth != width || windowHeight != height) {
+			resize(windowWidth, windowHeight);
+		}
+		if (!dirty.empty()) {
+			rasterize();
+		}
 
-// Function to draw the running belt
-void drawBelt() {
-	glPushMatrix();
-	glColor3f(0.2f, 0.2f, 0.2f);  // Black color for the running belt
-	glTranslated(0.0, 0.05, 0.0); // Position slightly above the base
-	glScaled(1.1, 0.02, 0.5);     // Scale for the belt
-	glutSolidCube(1);
-	glPopMatrix();
-}
+		beginScreenText();
+		glDisableClientState(GL_COLOR_ARRAY);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);  // The layer is premultiplied
+		glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+		float u = (float)width / textureWidth, v = (float)height / textureHeight;
+		profiler.countDraw();
+		glBegin(GL_QUADS);
+		glTexCoord2f(0.0f, 0.0f); glVertex2i(0, 0);
+		glTexCoord2f(u, 0.0f); glVertex2i(width, 0);
+		glTexCoord2f(u, v); glVertex2i(width, height);
+		glTexCoord2f(0.0f, v); glVertex2i(0, height);
+		glEnd();
+		endScreenText();
+	}
 
-// Function to draw side rails
-void drawSideRails() {
-	// Left side rail
-	glPushMatrix();
-	glColor3f(0.6f, 0.6f, 0.6f);  // Light gray color for the side rails
-	glRotated(90, 0.0, 1.0, 0.0);
-	glTranslated(-0.25, 0.05, 0.2); // Position on the left side
-	glScaled(0.1, 0.05, 1.0);     // Scale to make it a long, thin rail
-	glutSolidCube(1);
-	glPopMatrix();
+private:
+	struct Widget {
+		TextFont font;
+		std::vector<TextLayer> layers;
+		std::string text;
+		int x, y;
+		bool visible;
+		HudRect bounds;  // Where it was last rasterized
+	};
+
+	std::vector<Widget> widgets;
+	std::vector<unsigned char> pixels;  // Premultiplied RGBA, row 0 at the bottom
+	GLuint texture = 0;
+	int width = 0, height = 0;
+	int textureWidth = 0, textureHeight = 0;
+	HudRect dirty = emptyRect();
+
+	static HudRect emptyRect() {
+		HudRect r = { 0, 0, 0, 0 };
+		return r;
+	}
 
-	// Right side rail
-	glPushMatrix();
-	glColor3f(0.6f, 0.6f, 0.6f);  // Light gray color for the side rails
-	glRotated(90, 0.0, 1.0, 0.0);
-	glTranslated(0.25, 0.05, 0.2);  // Position on the right side
-	glScaled(0.1, 0.05, 1.0);     // Scale to make it a long, thin rail
-	glutSolidCube(1);
-	glPopMatrix();
-}
+	void invalidate(Widget& widget) {
+		dirty.merge(widget.bounds);
+		widget.bounds = widget.visible ? measure(widget) : emptyRect();
+		dirty.merge(widget.bounds);
+	}
 
-// Function to draw handles
-void drawHandles() {
-	// Left handle
-	glPushMatrix();
-	glColor3f(0.6f, 0.6f, 0.6f);  // Light gray for handles
-	glTranslated(0.65, 0.4, -0.25); // Position on the left side, above the side rail
-	glScaled(0.05, 1.0, 0.05);    // Scale to make it tall and thin
-	glutSolidCube(1);
-	glPopMatrix();
+	HudRect measure(const Widget& widget) const {
+		const AtlasFont& font = fontAtlas.fonts[widget.font];
+		int lineWidth = 0, widest = 0, lines = 1;
+		for (size_t i = 0; i < widget.text.size(); i++) {
+			if (widget.text[i] == '\n') {
+				lines++;
+				lineWidth = 0;
+				continue;
+			}
+			const GlyphInfo* glyph = fontAtlas.glyph(widget.font, widget.text[i]);
+			if (glyph) lineWidth += glyph->advance;
+			if (lineWidth > widest) widest = lineWidth;
+		}
+		HudRect r = { widget.x - GLYPH_PAD, widget.y - font.descent - (lines - 1) * font.cellHeight,
+			widget.x + widest + font.cellWidth, widget.y - font.descent + font.cellHeight };
+		for (size_t l = 0; l < widget.layers.size(); l++) {
+			HudRect shifted = { r.x0 + (int)floor(widget.layers[l].dx), r.y0 + (int)floor(widget.layers[l].dy),
+				r.x1 + (int)ceil(widget.layers[l].dx), r.y1 + (int)ceil(widget.layers[l].dy) };
+			r.merge(shifted);
+		}
+		return r;
+	}
 
-	// Right handle
-	glPushMatrix();
-	glColor3f(0.6f, 0.6f, 0.6f);  // Light gray for handles
-	glTranslated(0.65, 0.4, 0.25);  // Position on the right side, above the side rail
-	glScaled(0.05, 1.0, 0.05);    // Scale to make it tall and thin
-	glutSolidCube(1);
-	glPopMatrix();
-}
+	void resize(int newWidth, int newHeight) {
+		width = newWidth;
+		height = newHeight;
+		textureWidth = textureHeight = 1;
+		while (textureWidth < width) textureWidth *= 2;   // GL 1.1 needs power-of-two textures
+		while (textureHeight < height) textureHeight *= 2;
+		pixels.assign(textureWidth * textureHeight * 4, 0);
+
+		if (texture == 0) glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, textureWidth, textureHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		HudRect all = { 0, 0, width, height };
+		dirty = all;
+	}
 
+	void rasterize() {
+		HudRect window = { 0, 0, width, height };
+		HudRect area = dirty.clipped(window);
+		dirty = emptyRect();
+		if (area.empty()) return;
 
-void drawHandleArms() {
-	// Left arm
-	glPushMatrix();
-	glColor3f(0.6f, 0.6f, 0.6f);  // Light gray for arms
-	glTranslated(0.5, 0.7, -0.25); // Position on the left side, slightly in front of the handle
-	glRotated(90, 0.0, 1.0, 0.0); // Rotate slightly inward
-	glScaled(0.05, 0.05, 0.3);     // Scale to make it a short, thin arm
-	glutSolidCube(1);
-	glPopMatrix();
+		for (int y = area.y0; y < area.y1; y++) {
+			memset(&pixels[(y * textureWidth + area.x0) * 4], 0, (area.x1 - area.x0) * 4);
+		}
+		for (size_t w = 0; w < widgets.size(); w++) {
+			const Widget& widget = widgets[w];
+			if (!widget.visible || widget.bounds.clipped(area).empty()) continue;
+			for (size_t l = 0; l < widget.layers.size(); l++) {
+				drawLayer(widget, widget.layers[l], area);
+			}
+		}
 
-	// Right arm
-	glPushMatrix();
-	glColor3f(0.6f, 0.6f, 0.6f);  // Light gray for arms
-	glTranslated(0.5, 0.7, 0.25);  // Position on the right side, slightly in front of the handle
-	glRotated(90, 0.0, 1.0, 0.0);  // Rotate slightly inward
-	glScaled(0.05, 0.05, 0.3);     // Scale to make it a short, thin arm
-	glutSolidCube(1);
-	glPopMatrix();
-}
-// Function to draw the console
-void drawConsole() {
-	glPushMatrix();
-	glColor3f(0.2f, 0.2f, 0.2f);  // Dark gray for the console
-	glTranslated(0.6, 0.8, 0.0);  // Position above the handles
-	glRotated(90, 0.0, 1.0, 0.0); // Tilt the console slightly
-	glScaled(0.5, 0.2, 0.1);      // Scale for console size
-	glutSolidCube(1);
-	glPopMatrix();
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, textureWidth);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS, area.x0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS, area.y0);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, area.x0, area.y0, area.x1 - area.x0, area.y1 - area.y0,
+			GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	// Composite one layer of a widget's glyphs over the buffer, limited to the clip rect
+	void drawLayer(const Widget& widget, const TextLayer& layer, const HudRect& clip) {
+		const AtlasFont& font = fontAtlas.fonts[widget.font];
+		int r = (int)(layer.r * 255), g = (int)(layer.g * 255), b = (int)(layer.b * 255);
+		int penX = widget.x + (int)floor(layer.dx + 0.5f);
+		int penY = widget.y + (int)floor(layer.dy + 0.5f);
+		int startX = penX;
+		for (size_t i = 0; i < widget.text.size(); i++) {
+			if (widget.text[i] == '\n') {
+				penX = startX;
+				penY -= font.cellHeight;
+				continue;
+			}
+			const GlyphInfo* glyph = fontAtlas.glyph(widget.font, widget.text[i]);
+			if (!glyph) continue;
+			HudRect cell = { penX - GLYPH_PAD, penY - font.descent, penX - GLYPH_PAD + font.cellWidth, penY - font.descent + font.cellHeight };
+			HudRect visible = cell.clipped(clip);
+			for (int y = visible.y0; y < visible.y1; y++) {
+				const unsigned char* coverage = &fontAtlas.pixels[(glyph->y + y - cell.y0) * FontAtlas::WIDTH + glyph->x];
+				unsigned char* dst = &pixels[(y * textureWidth) * 4];
+				for (int x = visible.x0; x < visible.x1; x++) {
+					int a = coverage[x - cell.x0];
+					if (a == 0) continue;
+					unsigned char* p = dst + x * 4;
+					int inv = 255 - a;
+					p[0] = (unsigned char)((r * a + p[0] * inv) / 255);
+					p[1] = (unsigned char)((g * a + p[1] * inv) / 255);
+					p[2] = (unsigned char)((b * a + p[2] * inv) / 255);
+					p[3] = (unsigned char)(a + p[3] * inv / 255);
+				}
+			}
+			penX += glyph->advance;
+		}
+	}
+};
+
+HudLayer hud;
+
+// Window position of a world point under the current camera, like glRasterPos would use
+bool projectToWindow(double x, double y, double z, float& windowX, float& windowY) {
+	GLdouble modelview[16], projection[16];
+	GLint viewport[4];
+	glGetDoublev(GL_MODELVIEW_MATRIX, modelview);
+	glGetDoublev(GL_PROJECTION_MATRIX, projection);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	GLdouble wx, wy, wz;
+	if (!gluProject(x, y, z, modelview, projection, viewport, &wx, &wy, &wz)) return false;
+	if (wz < 0.0 || wz > 1.0) return false;  // Clipped, glRasterPos would be invalid too
+	windowX = (float)wx;
+	windowY = (float)wy;
+	return true;
 }
-// Draw the horizontal stabilizers (front and back)
 
+// Draw the per-pass profiler table in the top left corner of the window
+void displayProfilerOverlay() {
+	if (!profiler.overlayVisible) return;
+
+	FrameProfile avg = profiler.average(60);
+	char lines[PASS_COUNT + 2][64];
+	float totalCpu = 0.0f, totalGpu = 0.0f;
+	int totalDraws = 0;
+	sprintf(lines[0], "%-9s %8s %8s %6s", "pass", "cpu ms", "gpu ms", "draws");
+	for (int i = 0; i < PASS_COUNT; i++) {
+		if (avg.gpuMs[i] >= 0.0f) {
+			sprintf(lines[i + 1], "%-9s %8.3f %8.3f %6d", profilePassNames[i], avg.cpuMs[i], avg.gpuMs[i], avg.drawCalls[i]);
+			totalGpu += avg.gpuMs[i];
+		}
+		else {
+			sprintf(lines[i + 1], "%-9s %8.3f %8s %6d", profilePassNames[i], avg.cpuMs[i], "-", avg.drawCalls[i]);
+		}
+		totalCpu += avg.cpuMs[i];
+		totalDraws += avg.drawCalls[i];
+	}
+	sprintf(lines[PASS_COUNT + 1], "%-9s %8.3f %8.3f %6d", "total", totalCpu, totalGpu, totalDraws);
 
-// Display function to draw the entire Smith machine
+	std::string table;
+	for (int i = 0; i < PASS_COUNT + 2; i++) {
+		table += lines[i];
+		table += '\n';
+	}
+	static TextLabel overlayLabel;
+	overlayLabel.set(FONT_FIXED, table.c_str(), 1.0f, 1.0f, 0.0f);
 
-void drawShelf(float width, float depth) {
-	glPushMatrix();
-	glColor3f(0.5f, 0.5f, 0.5f);  // Light gray color for the shelf
-	glScaled(width, 0.05f, depth); // Scale the shelf dimensions
-	glutSolidCube(1);
-	glPopMatrix();
+	beginScreenText();
+	overlayLabel.draw(10.0f, glutGet(GLUT_WINDOW_HEIGHT) - 20.0f);
+	endScreenText();
 }
 
-// Function to draw a single dumbbell holder on the shelf
-void drawDumbbellHolder(float width, float height, float depth) {
-	glPushMatrix();
-	glColor3f(0.3f, 0.3f, 0.3f);  // Dark gray color for the holder
-	glScaled(width, height, depth); // Scale the holder dimensions
-	glutSolidCube(1);
-	glPopMatrix();
+#endif
+void quatFromAxisAngle(float degrees, float x, float y, float z, float* q) {
+	float length = sqrt(x * x + y * y + z * z);
+	float half = degrees * 3.14159265f / 360.0f;
+	float s = length > 0.0f ? sin(half) / length : 0.0f;
+	q[0] = x * s;
+	q[1] = y * s;
+	q[2] = z * s;
+	q[3] = cos(half);
 }
 
-// Function to draw vertical supports for the rack
-void drawVerticalSupport(float height) {
-	glPushMatrix();
-	glColor3f(0.4f, 0.4f, 0.4f);  // Gray color for the vertical supports
-	glScaled(0.05f, height, 0.05f); // Scale the support dimensions
-	glutSolidCube(1);
-	glPopMatrix();
+void quatMultiply(const float* a, const float* b, float* out) {
+	float r[4] = {
+		a[3] * b[0] + a[0] * b[3] + a[1] * b[2] - a[2] * b[1],
+		a[3] * b[1] - a[0] * b[2] + a[1] * b[3] + a[2] * b[0],
+		a[3] * b[2] + a[0] * b[1] - a[1] * b[0] + a[2] * b[3],
+		a[3] * b[3] - a[0] * b[0] - a[1] * b[1] - a[2] * b[2],
+	};
+	memcpy(out, r, sizeof(r));
 }
 
+// Column-major like GL
+void matrixFromPose(const JointPose& pose, float* m) {
+	float x = pose.rotation[0], y = pose.rotation[1], z = pose.rotation[2], w = pose.rotation[3];
+	m[0] = 1 - 2 * (y * y + z * z); m[4] = 2 * (x * y - z * w);     m[8] = 2 * (x * z + y * w);      m[12] = pose.translation[0];
+	m[1] = 2 * (x * y + z * w);     m[5] = 1 - 2 * (x * x + z * z); m[9] = 2 * (y * z - x * w);      m[13] = pose.translation[1];
+	m[2] = 2 * (x * z - y * w);     m[6] = 2 * (y * z + x * w);     m[10] = 1 - 2 * (x * x + y * y); m[14] = pose.translation[2];
+	m[3] = 0;                       m[7] = 0;                       m[11] = 0;                       m[15] = 1;
+}
 
+void matrixMultiply(const float* a, const float* b, float* out) {
+	float r[16];
+	for (int col = 0; col < 4; col++) {
+		for (int row = 0; row < 4; row++) {
+			r[col * 4 + row] = a[row] * b[col * 4] + a[4 + row] * b[col * 4 + 1] + a[8 + row] * b[col * 4 + 2] + a[12 + row] * b[col * 4 + 3];
+		}
+	}
+	memcpy(out, r, sizeof(r));
+}
 
+// Skin matrix per joint from local poses; parents always come before their children
+void computeSkinMatrices(const JointPose* pose, float (*skin)[16]) {
+	float world[JOINT_COUNT][16];
+	for (int j = 0; j < JOINT_COUNT; j++) {
+		float local[16];
+		matrixFromPose(pose[j], local);
+		if (jointParents[j] < 0) memcpy(world[j], local, sizeof(local));
+		else matrixMultiply(world[jointParents[j]], local, world[j]);
+		// The inverse bind matrix is a pure translation by -bind position
+		memcpy(skin[j], world[j], sizeof(world[j]));
+		for (int row = 0; row < 3; row++) {
+			skin[j][12 + row] -= world[j][row] * jointBindPositions[j][0] + world[j][4 + row] * jointBindPositions[j][1] + world[j][8 + row] * jointBindPositions[j][2];
+		}
+	}
+}
 
+#ifndef GYM_HEADLESS
+#ifndef GL_VERTEX_SHADER
+#define GL_VERTEX_SHADER 0x8B31
+#define GL_COMPILE_STATUS 0x8B81
+#define GL_LINK_STATUS 0x8B82
+#endif
+
+typedef GLuint(APIENTRY* CreateShaderProc)(GLenum type);
+typedef void (APIENTRY* ShaderSourceProc)(GLuint shader, GLsizei count, const char* const* strings, const GLint* lengths);
+typedef void (APIENTRY* CompileShaderProc)(GLuint shader);
+typedef void (APIENTRY* GetShaderivProc)(GLuint shader, GLenum pname, GLint* params);
+typedef void (APIENTRY* GetShaderInfoLogProc)(GLuint shader, GLsizei size, GLsizei* length, char* log);
+typedef GLuint(APIENTRY* CreateProgramProc)();
+typedef void (APIENTRY* AttachShaderProc)(GLuint program, GLuint shader);
+typedef void (APIENTRY* BindAttribLocationProc)(GLuint program, GLuint index, const char* name);
+typedef void (APIENTRY* LinkProgramProc)(GLuint program);
+typedef void (APIENTRY* GetProgramivProc)(GLuint program, GLenum pname, GLint* params);
+typedef void (APIENTRY* UseProgramProc)(GLuint program);
+typedef GLint(APIENTRY* GetUniformLocationProc)(GLuint program, const char* name);
+typedef void (APIENTRY* UniformMatrix4fvProc)(GLint location, GLsizei count, GLboolean transpose, const GLfloat* value);
+typedef void (APIENTRY* VertexAttribPointerProc)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* pointer);
+typedef void (APIENTRY* VertexAttribArrayProc)(GLuint index);
+
+CreateShaderProc pglCreateShader = NULL;
+ShaderSourceProc pglShaderSource = NULL;
+CompileShaderProc pglCompileShader = NULL;
+GetShaderivProc pglGetShaderiv = NULL;
+GetShaderInfoLogProc pglGetShaderInfoLog = NULL;
+CreateProgramProc pglCreateProgram = NULL;
+AttachShaderProc pglAttachShader = NULL;
+BindAttribLocationProc pglBindAttribLocation = NULL;
+LinkProgramProc pglLinkProgram = NULL;
+GetProgramivProc pglGetProgramiv = NULL;
+UseProgramProc pglUseProgram = NULL;
+GetUniformLocationProc pglGetUniformLocation = NULL;
+UniformMatrix4fvProc pglUniformMatrix4fv = NULL;
+VertexAttribPointerProc pglVertexAttribPointer = NULL;
+VertexAttribArrayProc pglEnableVertexAttribArray = NULL;
+VertexAttribArrayProc pglDisableVertexAttribArray = NULL;
+
+// Only a vertex stage: fragments still go through the fixed-function texture
+// combiners, so skinned meshes receive shadows like everything else. Lighting
+// and the eye-linear shadow coordinates are computed the way the fixed pipeline
+// would for light 0 with GL_COLOR_MATERIAL.
+const char* skinningShaderSource =
+	"#version 120\n"
+	"uniform mat4 joints[7];\n"
+	"attribute float joint;\n"
+	"void main() {\n"
+	"	mat4 skin = joints[int(joint)];\n"
+	"	vec4 position = skin * gl_Vertex;\n"
+	"	vec4 eye = gl_ModelViewMatrix * position;\n"
+	"	vec3 normal = normalize(gl_NormalMatrix * (mat3(skin[0].xyz, skin[1].xyz, skin[2].xyz) * gl_Normal));\n"
+	"	gl_Position = gl_ModelViewProjectionMatrix * position;\n"
+	"	float diffuse = max(dot(normal, normalize(gl_LightSource[0].position.xyz)), 0.0);\n"
+	"	float specular = diffuse > 0.0 ? pow(max(dot(normal, normalize(gl_LightSource[0].halfVector.xyz)), 0.0), gl_FrontMaterial.shininess) : 0.0;\n"
+	"	vec3 lit = gl_Color.rgb * (gl_LightModel.ambient.rgb + gl_LightSource[0].ambient.rgb + gl_LightSource[0].diffuse.rgb * diffuse)\n"
+	"		+ gl_FrontLightProduct[0].specular.rgb * specular;\n"
+	"	gl_FrontColor = vec4(lit, gl_Color.a);\n"
+	"	gl_BackColor = gl_FrontColor;\n"
+	"	for (int i = 0; i < 3; i++) {\n"
+	"		gl_TexCoord[i] = gl_TextureMatrix[i] * vec4(dot(eye, gl_EyePlaneS[i]), dot(eye, gl_EyePlaneT[i]), dot(eye, gl_EyePlaneR[i]), dot(eye, gl_EyePlaneQ[i]));\n"
+	"	}\n"
+	"}\n";
+
+const GLuint SKIN_JOINT_ATTRIBUTE = 1;
+
+struct SkinVertex {
+	float position[3];
+	float normal[3];
+	float color[3];
+	float joint;
+};
 
-// Dumbbell color array to hold changing color values
-float dumbbellColor[3] = { 0.1f, 0.1f, 0.1f };
+// One mesh for the whole body, each vertex rigidly bound to one joint. It is
+// drawn with a single glDrawArrays, skinned in the vertex shader when GLSL is
+// available and on the CPU otherwise.
+class SkinnedMesh {
+public:
+	std::vector<SkinVertex> vertices;  // Bind pose, model space
+
+	void init() {
+		addBox(JOINT_HEAD, 0.0f, 0.0f, 0.0f, 0.2f, 0.2f, 0.2f, 1.0f, 0.85f, 0.7f);
+		addBox(JOINT_TORSO, -0.075f, 0.0f, 0.0f, 0.15f, 0.4f, 0.2f, 0.0f, 0.0f, 0.0f);
+		addBox(JOINT_TORSO, 0.075f, 0.0f, 0.0f, 0.15f, 0.4f, 0.2f, 1.0f, 1.0f, 1.0f);
+		addBox(JOINT_LEFT_ARM, 0.0f, 0.0f, 0.0f, 0.15f, 0.3f, 0.15f, 1.0f, 0.85f, 0.7f);
+		addBox(JOINT_RIGHT_ARM, 0.0f, 0.0f, 0.0f, 0.15f, 0.3f, 0.15f, 1.0f, 0.85f, 0.7f);
+		addBox(JOINT_LEFT_LEG, 0.0f, 0.0f, 0.0f, 0.15f, 0.4f, 0.15f, 0.0f, 0.0f, 0.8f);
+		addBox(JOINT_RIGHT_LEG, 0.0f, 0.0f, 0.0f, 0.15f, 0.4f, 0.15f, 0.0f, 0.0f, 0.8f);
+		skinned.resize(vertices.size());
+
+		if (!compileProgram()) {
+			std::cerr << "GLSL skinning not supported, skinning on the CPU." << std::endl;
+		}
+	}
 
+	// skin holds JOINT_COUNT column-major matrices; render thread only
+	void draw(const float* skin) const {
+		profiler.countDraw();
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_NORMAL_ARRAY);
+		glEnableClientState(GL_COLOR_ARRAY);
+		if (program) {
+			pglUseProgram(program);
+			pglUniformMatrix4fv(jointsUniform, JOINT_COUNT, GL_FALSE, skin);
+			setPointers(&vertices[0]);
+			pglVertexAttribPointer(SKIN_JOINT_ATTRIBUTE, 1, GL_FLOAT, GL_FALSE, sizeof(SkinVertex), &vertices[0].joint);
+			pglEnableVertexAttribArray(SKIN_JOINT_ATTRIBUTE);
+			glDrawArrays(GL_QUADS, 0, (GLsizei)vertices.size());
+			pglDisableVertexAttribArray(SKIN_JOINT_ATTRIBUTE);
+			pglUseProgram(0);
+		}
+		else {
+			for (size_t i = 0; i < vertices.size(); i++) {
+				const float* m = skin + 16 * (int)vertices[i].joint;
+				const float* p = vertices[i].position;
+				const float* n = vertices[i].normal;
+				SkinVertex& out = skinned[i];
+				for (int row = 0; row < 3; row++) {
+					out.position[row] = m[row] * p[0] + m[4 + row] * p[1] + m[8 + row] * p[2] + m[12 + row];
+					out.normal[row] = m[row] * n[0] + m[4 + row] * n[1] + m[8 + row] * n[2];
+					out.color[row] = vertices[i].color[row];
+				}
+			}
+			setPointers(&skinned[0]);
+			glDrawArrays(GL_QUADS, 0, (GLsizei)skinned.size());
+		}
+		glDisableClientState(GL_VERTEX_ARRAY);
+		glDisableClientState(GL_NORMAL_ARRAY);
+		glDisableClientState(GL_COLOR_ARRAY);
+	}
 
-void drawDumbbell() {
-	// Dumbbell handle
-	glPushMatrix();
-	glColor3f(1.0f, 1.0f, 1.0f);  // Silver color for handle
-	glScaled(0.6, 0.07, 0.07);    // Larger handle size
-	glutSolidCube(1);
-	glPopMatrix();
+private:
+	GLuint program = 0;
+	GLint jointsUniform = -1;
+	mutable std::vector<SkinVertex> skinned;  // CPU skinning scratch
+
+	// Same corners, faces and normals as glutSolidCube
+	void addBox(int joint, float x, float y, float z, float sx, float sy, float sz, float r, float g, float b) {
+		static const float normals[6][3] = { { -1, 0, 0 }, { 0, 1, 0 }, { 1, 0, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+		static const int faces[6][4] = { { 0, 1, 2, 3 }, { 3, 2, 6, 7 }, { 7, 6, 5, 4 }, { 4, 5, 1, 0 }, { 5, 6, 2, 1 }, { 7, 4, 0, 3 } };
+		const float* bind = jointBindPositions[joint];
+		for (int f = 0; f < 6; f++) {
+			for (int k = 0; k < 4; k++) {
+				int corner = faces[f][k];
+				SkinVertex v;
+				v.position[0] = bind[0] + x + (corner & 4 ? 0.5f : -0.5f) * sx;
+				v.position[1] = bind[1] + y + (corner == 2 || corner == 3 || corner == 6 || corner == 7 ? 0.5f : -0.5f) * sy;
+				v.position[2] = bind[2] + z + (corner == 1 || corner == 2 || corner == 5 || corner == 6 ? 0.5f : -0.5f) * sz;
+				memcpy(v.normal, normals[f], sizeof(v.normal));
+				v.color[0] = r;
+				v.color[1] = g;
+				v.color[2] = b;
+				v.joint = (float)joint;
+				vertices.push_back(v);
+			}
+		}
+	}
 
-	// Left weight
-	glPushMatrix();
-	glColor3f(dumbbellColor[0], dumbbellColor[1], dumbbellColor[2]);  // Use animated color for weights
-	glTranslated(-0.35, 0, 0);    // Adjust position for larger weight size
-	glScaled(1.3, 1.0, 1.0);      // Scale sphere horizontally for larger weights
-	glutSolidSphere(0.1, 20, 20); // Larger spherical weight
-	glPopMatrix();
+	static void setPointers(const SkinVertex* data) {
+		glVertexPointer(3, GL_FLOAT, sizeof(SkinVertex), data->position);
+		glNormalPointer(GL_FLOAT, sizeof(SkinVertex), data->normal);
+		glColorPointer(3, GL_FLOAT, sizeof(SkinVertex), data->color);
+	}
 
-	// Right weight
-	glPushMatrix();
-	glColor3f(dumbbellColor[0], dumbbellColor[1], dumbbellColor[2]);  // Use animated color for weights
-	glTranslated(0.35, 0, 0);     // Adjust position for larger weight size
-	glScaled(1.3, 1.0, 1.0);      // Scale sphere horizontally for larger weights
-	glutSolidSphere(0.1, 20, 20); // Larger spherical weight
-	glPopMatrix();
-}
+	bool compileProgram() {
+		pglCreateShader = (CreateShaderProc)getGLProc("glCreateShader");
+		pglShaderSource = (ShaderSourceProc)getGLProc("glShaderSource");
+		pglCompileShader = (CompileShaderProc)getGLProc("glCompileShader");
+		pglGetShaderiv = (GetShaderivProc)getGLProc("glGetShaderiv");
+		pglGetShaderInfoLog = (GetShaderInfoLogProc)getGLProc("glGetShaderInfoLog");
+		pglCreateProgram = (CreateProgramProc)getGLProc("glCreateProgram");
+		pglAttachShader = (AttachShaderProc)getGLProc("glAttachShader");
+		pglBindAttribLocation = (BindAttribLocationProc)getGLProc("glBindAttribLocation");
+		pglLinkProgram = (LinkProgramProc)getGLProc("glLinkProgram");
+		pglGetProgramiv = (GetProgramivProc)getGLProc("glGetProgramiv");
+		pglUseProgram = (UseProgramProc)getGLProc("glUseProgram");
+		pglGetUniformLocation = (GetUniformLocationProc)getGLProc("glGetUniformLocation");
+		pglUniformMatrix4fv = (UniformMatrix4fvProc)getGLProc("glUniformMatrix4fv");
+		pglVertexAttribPointer = (VertexAttribPointerProc)getGLProc("glVertexAttribPointer");
+		pglEnableVertexAttribArray = (VertexAttribArrayProc)getGLProc("glEnableVertexAttribArray");
+		pglDisableVertexAttribArray = (VertexAttribArrayProc)getGLProc("glDisableVertexAttribArray");
+		if (!pglCreateShader || !pglShaderSource || !pglCompileShader || !pglGetShaderiv || !pglGetShaderInfoLog
+			|| !pglCreateProgram || !pglAttachShader || !pglBindAttribLocation || !pglLinkProgram || !pglGetProgramiv
+			|| !pglUseProgram || !pglGetUniformLocation || !pglUniformMatrix4fv || !pglVertexAttribPointer
+			|| !pglEnableVertexAttribArray || !pglDisableVertexAttribArray) {
+			return false;
+		}
 
-// Function to draw the entire dumbbell rack
-void drawDumbbellRack() {
-	float shelfWidth = 1.5f;
-	float shelfDepth = 0.4f;
-	float shelfHeight = 0.3f;
+		GLuint shader = pglCreateShader(GL_VERTEX_SHADER);
+		pglShaderSource(shader, 1, &skinningShaderSource, NULL);
+		pglCompileShader(shader);
+		GLint ok = 0;
+		pglGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+		if (!ok) {
+			char log[1024];
+			pglGetShaderInfoLog(shader, sizeof(log), NULL, log);
+			std::cerr << "Skinning shader: " << log << std::endl;
+			return false;
+		}
+		GLuint linked = pglCreateProgram();
+		pglAttachShader(linked, shader);
+		pglBindAttribLocation(linked, SKIN_JOINT_ATTRIBUTE, "joint");
+		pglLinkProgram(linked);
+		pglGetProgramiv(linked, GL_LINK_STATUS, &ok);
+		if (!ok) return false;
+		program = linked;
+		jointsUniform = pglGetUniformLocation(program, "joints");
+		return true;
+	}
+};
 
-	// Draw bottom shelf
-	glPushMatrix();
-	glTranslated(0, 0.15f, 0); // Position the bottom shelf close to the ground
-	drawShelf(shelfWidth, shelfDepth);
-	glPopMatrix();
+SkinnedMesh playerMesh;
 
-	// Draw top shelf
-	glPushMatrix();
-	glTranslated(0, 0.5f, 0); // Position the top shelf higher
-	drawShelf(shelfWidth, shelfDepth);
-	glPopMatrix();
+#endif
+// Keyframe animation clips. Every clip holds whole-skeleton poses at a fixed
+// rate; the root joint is relative to the entity, whose position and heading
+// come from the game. On disk the keys are quantized to 16 bits per component.
+enum AnimationClipId { CLIP_IDLE, CLIP_WALK, CLIP_CHIN_UP, CLIP_BENCH_PRESS, CLIP_TREADMILL, CLIP_DEADLIFT, CLIP_COUNT };
+const char* animationClipNames[CLIP_COUNT] = { "idle", "walk", "chin up", "bench press", "treadmill", "deadlift" };
 
-	// Draw vertical supports
-	glPushMatrix();
-	glTranslated(-shelfWidth / 2 + 0.05f, 0.35f, -shelfDepth / 2 + 0.05f);
-	drawVerticalSupport(0.7f);
-	glPopMatrix();
+struct QuantizedJoint {
+	short rotation[4];     // Quaternion * 32767, w >= 0
+	short translation[3];  // Fraction of the clip's translationRange * 32767
+};
 
-	glPushMatrix();
-	glTranslated(shelfWidth / 2 - 0.05f, 0.35f, -shelfDepth / 2 + 0.05f);
-	drawVerticalSupport(0.7f);
-	glPopMatrix();
+struct AnimationClip {
+	char name[16];
+	float fps;
+	int loopStart;           // First frame of the looping part, -1 to hold the last frame
+	float translationRange;  // Largest absolute joint offset in the clip
+	std::vector<QuantizedJoint> keys;  // frames * JOINT_COUNT, as stored in the file
+	std::vector<JointPose> cache;      // keys decoded once, what sampling reads
 
-	glPushMatrix();
-	glTranslated(-shelfWidth / 2 + 0.05f, 0.35f, shelfDepth / 2 - 0.05f);
-	drawVerticalSupport(0.7f);
-	glPopMatrix();
+	int frameCount() const {
+		return (int)(keys.size() / JOINT_COUNT);
+	}
 
-	glPushMatrix();
-	glTranslated(shelfWidth / 2 - 0.05f, 0.35f, shelfDepth / 2 - 0.05f);
-	drawVerticalSupport(0.7f);
-	glPopMatrix();
+	void decode() {
+		cache.resize(keys.size());
+		for (size_t i = 0; i < keys.size(); i++) {
+			float length = 0.0f;
+			for (int c = 0; c < 4; c++) {
+				cache[i].rotation[c] = keys[i].rotation[c] / 32767.0f;
+				length += cache[i].rotation[c] * cache[i].rotation[c];
+			}
+			length = sqrt(length);
+			for (int c = 0; c < 4; c++) cache[i].rotation[c] /= length;
+			for (int c = 0; c < 3; c++) cache[i].translation[c] = keys[i].translation[c] / 32767.0f * translationRange;
+		}
+	}
 
-	// Draw dumbbell holders on the bottom shelf
-	for (int i = -2; i <= 2; i++) {
-		glPushMatrix();
-		glTranslated(i * 0.3f, 0.18f, 0); // Position holders along the shelf
-		drawDumbbellHolder(0.1f, 0.05f, 0.35f);
-		glTranslated(0, 0.05, 0.0);
-		glRotated(90, 0.0, 1.0, 0.0);
-		drawDumbbell();
-		glPopMatrix();
+	// Frames to blend between for a time since the clip started
+	void locate(float time, int& from, int& to, float& alpha) const {
+		int last = frameCount() - 1;
+		float frame = time * fps;
+		if (frame >= last) {
+			if (loopStart < 0 || loopStart >= last) {
+				from = to = last;
+				alpha = 0.0f;
+				return;
+			}
+			frame = loopStart + fmod(frame - loopStart, (float)(last - loopStart));
+		}
+		from = frame > 0.0f ? (int)frame : 0;
+		to = from < last ? from + 1 : last;
+		alpha = frame - from;
 	}
+};
 
-	// Draw dumbbell holders on the top shelf
-	for (int i = -2; i <= 2; i++) {
-		glPushMatrix();
-		glTranslated(i * 0.3f, 0.53f, 0); // Position holders along the shelf
-		drawDumbbellHolder(0.1f, 0.05f, 0.35f);
-		glTranslated(0, 0.05, 0);
-		glRotated(90, 0.0, 1.0, 0.0);
-		drawDumbbell();
-		glPopMatrix();
+std::vector<AnimationClip> animationClips;  // Indexed by AnimationClipId, extra clips from the file follow
+
+// Spherical interpolation along the shorter arc, normalized lerp when nearly parallel
+inline void interpolatePose(const JointPose& a, const JointPose& b, float t, JointPose& out) {
+	float d = a.rotation[0] * b.rotation[0] + a.rotation[1] * b.rotation[1] + a.rotation[2] * b.rotation[2] + a.rotation[3] * b.rotation[3];
+	float sign = d < 0.0f ? -1.0f : 1.0f;
+	d *= sign;
+	float wa, wb;
+	if (d > 0.9995f) {
+		wa = 1.0f - t;
+		wb = t * sign;
 	}
+	else {
+		float theta = acos(d);
+		float s = 1.0f / sin(theta);
+		wa = sin((1.0f - t) * theta) * s;
+		wb = sin(t * theta) * s * sign;
+	}
+	float length = 0.0f;
+	for (int c = 0; c < 4; c++) {
+		out.rotation[c] = wa * a.rotation[c] + wb * b.rotation[c];
+		length += out.rotation[c] * out.rotation[c];
+	}
+	length = 1.0f / sqrt(length);
+	for (int c = 0; c < 4; c++) out.rotation[c] *= length;
+	for (int c = 0; c < 3; c++) out.translation[c] = a.translation[c] + (b.translation[c] - a.translation[c]) * t;
 }
 
-void drawChinUpDipMachine() {
-	// Base1
-	glPushMatrix();
-	glColor3f(0.9f, 0.9f, 0.9f);  // Light gray for the frame
-	glScaled(0.1, 0.05, 0.5);    // Scale for the long base
-	glTranslated(-1.5, 0, -0.1);     // Position the base
-	glutSolidCube(1);
-	glPopMatrix();
-
-	// Base2
-	glPushMatrix();
-	glColor3f(0.9f, 0.9f, 0.9f);  // Light gray for the frame
-	glScaled(0.1, 0.05, 0.5);    // Scale for the long base
-	glTranslated(1.5, 0, -0.1);     // Position the base
-	glutSolidCube(1);
-	glPopMatrix();
-
-	// Vertical Supports (left and right)
-	glPushMatrix();
-	glColor3f(0.9f, 0.9f, 0.9f);  // Light gray for the supports
-	glTranslated(-0.15, 0.5, 0);  // Left vertical support position
-	glScaled(0.05, 1.0, 0.05);    // Scale for the support height
-	glutSolidCube(1);
-	glPopMatrix();
-
-	glPushMatrix();
-	glColor3f(0.9f, 0.9f, 0.9f);  // Light gray for the supports
-	glTranslated(0.15, 0.5, 0);   // Right vertical support position
-	glScaled(0.05, 1.0, 0.05);    // Scale for the support height
-	glutSolidCube(1);
-	glPopMatrix();
-
-	// Horizontal Bar at the Top (for chin-ups)
-	glPushMatrix();
-	glColor3f(0.9f, 0.9f, 0.9f);  // Light gray for the top bar
-	glTranslated(0, 1.0, 0);      // Position the top bar
-	glScaled(0.4, 0.05, 0.05);    // Scale for the bar width
-	glutSolidCube(1);
-	glPopMatrix();
-
-	// Chin-up Handles (angled)
-	glPushMatrix();
-	glColor3f(0.1f, 0.1f, 0.1f);  // Dark color for handles
-	glTranslated(-0.18, 1.0, 0.1);  // Left handle position
-	glRotated(45, 0, 1, 0);        // Angle the handle
-	glScaled(0.15, 0.05, 0.05);    // Scale for the handle
-	glutSolidCube(1);
-	glPopMatrix();
-
-	glPushMatrix();
-	glColor3f(0.1f, 0.1f, 0.1f);  // Dark color for handles
-	glTranslated(0.18, 1.0, 0.1);   // Right handle position
-	glRotated(-45, 0, 1, 0);       // Angle the handle
-	glScaled(0.15, 0.05, 0.05);    // Scale for the handle
-	glutSolidCube(1);
-	glPopMatrix();
-
+struct ClipInstance {
+	int clip;
+	float time;  // Seconds since the clip started
+};
 
+// Pose of many entities at once, JOINT_COUNT poses per instance. Keys are looked
+// up per instance first, then every joint is interpolated for all instances in
+// one flat loop over contiguous arrays.
+void evaluateClips(const ClipInstance* instances, int count, JointPose* poses) {
+	static thread_local std::vector<const JointPose*> from, to;
+	static thread_local std::vector<float> alpha;
+	from.resize(count);
+	to.resize(count);
+	alpha.resize(count);
+	for (int i = 0; i < count; i++) {
+		const AnimationClip& clip = animationClips[instances[i].clip];
+		int a, b;
+		clip.locate(instances[i].time, a, b, alpha[i]);
+		from[i] = &clip.cache[a * JOINT_COUNT];
+		to[i] = &clip.cache[b * JOINT_COUNT];
+	}
+	for (int j = 0; j < JOINT_COUNT; j++) {
+		for (int i = 0; i < count; i++) {
+			interpolatePose(from[i][j], to[i][j], alpha[i], poses[i * JOINT_COUNT + j]);
+		}
+	}
 }
 
-bool isWalking = false;
-int walkTimer = 0;          // Timer to control the animation duration
-const int walkDuration = 50;
+// Put a clip's root at the entity's position, turned to its heading around Y
+void placeRoot(JointPose& root, float x, float y, float z, float heading) {
+	JointPose place = { { 0.0f, 0.0f, 0.0f, 1.0f }, { x, y, z } };
+	quatFromAxisAngle(heading, 0.0f, 1.0f, 0.0f, place.rotation);
+	float m[16];
+	matrixFromPose(place, m);
+	float t[3];
+	for (int row = 0; row < 3; row++) {
+		t[row] = m[row] * root.translation[0] + m[4 + row] * root.translation[1] + m[8 + row] * root.translation[2] + m[12 + row];
+	}
+	memcpy(root.translation, t, sizeof(t));
+	quatMultiply(place.rotation, root.rotation, root.rotation);
+}
 
-float headPosY = 0.3f;
-float torsoPosY = 0.0f;
-float leftArmPosX = -0.2f, leftArmPosY = 0.0f, leftArmPosZ = 0.0f;
-float rightArmPosX = 0.2f, rightArmPosY = 0.0f, rightArmPosZ = 0.0f;
-float leftLegPosX = -0.1f, leftLegPosY = -0.3f;
-float rightLegPosX = 0.1f, rightLegPosY = -0.3f;
+// Seconds of cross-fade when a clip starts playing
+const float clipFadeIn[CLIP_COUNT] = { 0.35f, 0.15f, 0.3f, 0.3f, 0.2f, 0.4f };
 
+// Animation state machine of one entity. It is either moving about (idle or
+// walk, chosen every tick from its input) or doing an exercise, which only
+// ends when stopExercise() is called. Every change of clip cross-fades from
+// the old clip, still playing where the entity stood, to the new one.
+class AnimationController {
+public:
+	ClipInstance current = { CLIP_IDLE, 0.0f };
+	ClipInstance previous = { CLIP_IDLE, 0.0f };
+	float fadeTime = 0.0f, fadeDuration = 0.0f;  // No fade once fadeTime reaches fadeDuration
+	float placement[4] = { 0.0f, 0.0f, 0.0f, 0.0f };          // x, y, z, heading of the last evaluation
+	float previousPlacement[4] = { 0.0f, 0.0f, 0.0f, 0.0f };  // Frozen when the previous clip faded out
+	bool exercising = false;
+
+	// Idle or walk; ignored while an exercise is playing
+	void requestLocomotion(int clip) {
+		if (!exercising && current.clip != clip) transition(clip);
+	}
 
-// Rotation angles for animation
+	void playExercise(int clip) {
+		exercising = true;
+		transition(clip);
+	}
 
-float rotationAngle = 0.0f;  // Direction player is facing
+	void stopExercise() {
+		exercising = false;
+		transition(CLIP_IDLE);
+	}
 
-float rotationY = 1.0f;
-float rotationZ = 0.0f;
-float TorsoAngle = 0.0f;
+	bool fading() const {
+		return fadeTime < fadeDuration;
+	}
 
-float startPosX = posX;
-float startPosZ = posZ;
-float rotationBench = 0.0f;
+	void advance(float deltaTime) {
+		advance(deltaTime, deltaTime);
+	}
 
+	// The walk clip moves on by walkTime, the ground covered at the clip's own pace,
+	// so the feet keep up with the body at any speed
+	void advance(float deltaTime, float walkTime) {
+		current.time += current.clip == CLIP_WALK ? walkTime : deltaTime;
+		if (fading()) {
+			previous.time += previous.clip == CLIP_WALK ? walkTime : deltaTime;
+			fadeTime += deltaTime;
+		}
+	}
 
-void drawPlayer() {
-	glPushMatrix();
-	glTranslatef(posX, PosY, posZ);  // Apply general player position for chin-up animation
-	glRotatef(rotationAngle, 0.0f, rotationY, rotationZ);  // Face the direction of movement
-	glRotatef(rotationBench, 1.0, 0.0, 0.0);
+private:
+	void transition(int clip) {
+		previous = current;
+		memcpy(previousPlacement, placement, sizeof(placement));
+		current.clip = clip;
+		current.time = 0.0f;
+		fadeTime = 0.0f;
+		fadeDuration = clip < CLIP_COUNT ? clipFadeIn[clip] : 0.3f;
+	}
+};
 
-	// Head
-	glPushMatrix();
-	glColor3f(1.0f, 0.85f, 0.7f);  // Skin tone color
-	glTranslated(0.0, headPosY, 0.0); // Use headPosY for chin-up height adjustment
+// Poses of many controllers, each placed at its x, y, z and heading. Both clips
+// of every fading controller are sampled in batches, then all the blends are
+// done in a single pass over the fading joints.
+void evaluateAnimations(AnimationController* controllers, const float (*placements)[4], int count, JointPose* poses) {
+	static thread_local std::vector<ClipInstance> instances;
+	static thread_local std::vector<int> fading;
+	static thread_local std::vector<float> weights;
+	static thread_local std::vector<JointPose> fadingPoses;
+
+	instances.resize(count);
+	for (int i = 0; i < count; i++) instances[i] = controllers[i].current;
+	evaluateClips(&instances[0], count, poses);
+
+	fading.clear();
+	instances.clear();
+	weights.clear();
+	for (int i = 0; i < count; i++) {
+		AnimationController& controller = controllers[i];
+		memcpy(controller.placement, placements[i], sizeof(controller.placement));
+		placeRoot(poses[i * JOINT_COUNT + JOINT_ROOT], placements[i][0], placements[i][1], placements[i][2], placements[i][3]);
+		if (controller.fading()) {
+			float t = controller.fadeTime / controller.fadeDuration;
+			fading.push_back(i);
+			instances.push_back(controller.previous);
+			weights.push_back(t * t * (3.0f - 2.0f * t));  // Ease in and out
+		}
+	}
+	int fadingCount = (int)fading.size();
+	if (fadingCount == 0) return;
+
+	fadingPoses.resize(fadingCount * JOINT_COUNT);
+	evaluateClips(&instances[0], fadingCount, &fadingPoses[0]);
+	for (int f = 0; f < fadingCount; f++) {
+		const float* place = controllers[fading[f]].previousPlacement;
+		placeRoot(fadingPoses[f * JOINT_COUNT + JOINT_ROOT], place[0], place[1], place[2], place[3]);
+	}
+	for (int k = 0; k < fadingCount * JOINT_COUNT; k++) {
+		JointPose& pose = poses[fading[k / JOINT_COUNT] * JOINT_COUNT + k % JOINT_COUNT];
+		interpolatePose(fadingPoses[k], pose, weights[k / JOINT_COUNT], pose);
+	}
+}
 
-	glutSolidCube(0.2);  // Smaller head cube
-	glPopMatrix();
+// Sample a pose function into a clip. The looping part should span whole periods
+// of the motion so its last frame matches its first and playback wraps cleanly.
+AnimationClip bakeClip(const char* name, float duration, float loopStartTime, void (*pose)(float time, JointPose* pose)) {
+	AnimationClip clip;
+	memset(clip.name, 0, sizeof(clip.name));
+	strncpy(clip.name, name, sizeof(clip.name) - 1);
+	int frames = duration > 0.0f ? (int)(duration * 30.0f + 0.5f) + 1 : 1;
+	clip.fps = duration > 0.0f ? (frames - 1) / duration : 30.0f;
+	clip.loopStart = loopStartTime < 0.0f ? -1 : (int)(loopStartTime * clip.fps + 0.5f);
+
+	std::vector<JointPose> poses(frames * JOINT_COUNT);
+	clip.translationRange = 1e-6f;
+	for (int f = 0; f < frames; f++) {
+		pose(f / clip.fps, &poses[f * JOINT_COUNT]);
+		for (int j = 0; j < JOINT_COUNT; j++) {
+			for (int c = 0; c < 3; c++) {
+				float offset = fabs(poses[f * JOINT_COUNT + j].translation[c]);
+				if (offset > clip.translationRange) clip.translationRange = offset;
+			}
+		}
+	}
 
-	// Torso
-	glPushMatrix();
-	glColor3f(0.0f, 0.0f, 0.0f); // Black color
-	glTranslatef(-0.075f, torsoPosY, 0.0f); // Use torsoPosY for chin-up height adjustment
-	glRotatef(TorsoAngle, 0.0f, 1.0f, 0.0f);
+	clip.keys.resize(poses.size());
+	for (size_t i = 0; i < poses.size(); i++) {
+		float sign = poses[i].rotation[3] < 0.0f ? -1.0f : 1.0f;
+		for (int c = 0; c < 4; c++) clip.keys[i].rotation[c] = (short)floor(sign * poses[i].rotation[c] * 32767.0f + 0.5f);
+		for (int c = 0; c < 3; c++) clip.keys[i].translation[c] = (short)floor(poses[i].translation[c] / clip.translationRange * 32767.0f + 0.5f);
+	}
+	clip.decode();
+	return clip;
+}
 
-	glScalef(0.15f, 0.4f, 0.2f);       // Half the width of the full torso
-	glutSolidCube(1.0f);
-	glPopMatrix();
+// File layout, little-endian: "GYMC", uint16 version, uint16 joint count, uint16 clip
+// count, then per clip name[16], float fps, int16 loop start, uint16 frame count,
+// float translation range and frame count * joint count QuantizedJoint records.
+const unsigned short CLIP_FILE_VERSION = 1;
 
-	// Right half of the torso (white)
-	glPushMatrix();
-	glColor3f(1.0f, 1.0f, 1.0f); // White color
-	glTranslatef(0.075f, torsoPosY, 0.0f); // Use torsoPosY for chin-up height adjustment
-	glRotatef(TorsoAngle, 0.0f, 1.0f, 0.0f);
+bool writeAnimationClips(const char* filename) {
+	std::ofstream file(filename, std::ios::binary);
+	if (!file) {
+		std::cerr << "Failed to write animation clips: " << filename << std::endl;
+		return false;
+	}
+	unsigned short header[3] = { CLIP_FILE_VERSION, JOINT_COUNT, (unsigned short)animationClips.size() };
+	file.write("GYMC", 4);
+	file.write(reinterpret_cast<const char*>(header), sizeof(header));
+	for (size_t i = 0; i < animationClips.size(); i++) {
+		const AnimationClip& clip = animationClips[i];
+		short loopStart = (short)clip.loopStart;
+		unsigned short frames = (unsigned short)clip.frameCount();
+		file.write(clip.name, sizeof(clip.name));
+		file.write(reinterpret_cast<const char*>(&clip.fps), sizeof(clip.fps));
+		file.write(reinterpret_cast<const char*>(&loopStart), sizeof(loopStart));
+		file.write(reinterpret_cast<const char*>(&frames), sizeof(frames));
+		file.write(reinterpret_cast<const char*>(&clip.translationRange), sizeof(clip.translationRange));
+		file.write(reinterpret_cast<const char*>(&clip.keys[0]), clip.keys.size() * sizeof(QuantizedJoint));
+	}
+	return (bool)file;
+}
 
-	glScalef(0.15f, 0.4f, 0.2f);       // Half the width of the full torso
-	glutSolidCube(1.0f);
-	glPopMatrix();
+// Clips named like an AnimationClipId take that slot. Fails unless all of them are present.
+bool loadAnimationClips(const char* filename) {
+	TraceScope trace(filename);
+	std::ifstream file(filename, std::ios::binary);
+	if (!file) return false;
+	char magic[4];
+	unsigned short header[3];
+	file.read(magic, 4);
+	file.read(reinterpret_cast<char*>(header), sizeof(header));
+	if (!file || memcmp(magic, "GYMC", 4) != 0 || header[0] != CLIP_FILE_VERSION || header[1] != JOINT_COUNT) {
+		std::cerr << "Invalid animation clip file: " << filename << std::endl;
+		return false;
+	}
 
-	// Left Arm
-	glPushMatrix();
-	glColor3f(1.0f, 0.85f, 0.7f);  // Skin tone color
-	glTranslated(leftArmPosX, leftArmPosY, leftArmPosZ);  // Position for left arm
-	glRotatef(armAngle, 1.0f, 0.0f, 0.0f); // Rotate left arm up
-	glScaled(0.15, 0.3, 0.15);     // Reduced scale to make it smaller
-	glutSolidCube(1.0);
-	glPopMatrix();
+	std::vector<AnimationClip> clips(CLIP_COUNT);
+	int found = 0;
+	for (int i = 0; i < header[2]; i++) {
+		AnimationClip clip;
+		short loopStart;
+		unsigned short frames;
+		file.read(clip.name, sizeof(clip.name));
+		file.read(reinterpret_cast<char*>(&clip.fps), sizeof(clip.fps));
+		file.read(reinterpret_cast<char*>(&loopStart), sizeof(loopStart));
+		file.read(reinterpret_cast<char*>(&frames), sizeof(frames));
+		file.read(reinterpret_cast<char*>(&clip.translationRange), sizeof(clip.translationRange));
+		if (!file || frames == 0) {
+			std::cerr << "Truncated animation clip file: " << filename << std::endl;
+			return false;
+		}
+		clip.name[sizeof(clip.name) - 1] = '\0';
+		clip.loopStart = loopStart;
+		clip.keys.resize(frames * JOINT_COUNT);
+		file.read(reinterpret_cast<char*>(&clip.keys[0]), clip.keys.size() * sizeof(QuantizedJoint));
+		if (!file) {
+			std::cerr << "Truncated animation clip file: " << filename << std::endl;
+			return false;
+		}
+		clip.decode();
 
-	// Right Arm
-	glPushMatrix();
-	glColor3f(1.0f, 0.85f, 0.7f);  // Skin tone color
-	glTranslated(rightArmPosX, rightArmPosY, rightArmPosZ);  // Position for right arm
-	glRotatef(leftarmAngle, 1.0f, 0.0f, 0.0f); // Rotate right arm up
-	glScaled(0.15, 0.3, 0.15);     // Reduced scale to make it smaller
-	glutSolidCube(1.0);
-	glPopMatrix();
+		int slot = -1;
+		for (int id = 0; id < CLIP_COUNT; id++) {
+			if (strcmp(clip.name, animationClipNames[id]) == 0) slot = id;
+		}
+		if (slot < 0) {
+			clips.push_back(clip);
+		}
+		else {
+			if (clips[slot].keys.empty()) found++;
+			clips[slot] = clip;
+		}
+	}
+	if (found < CLIP_COUNT) {
+		std::cerr << "Animation clip file is missing clips: " << filename << std::endl;
+		return false;
+	}
+	animationClips.swap(clips);
+	return true;
+}
 
-	// Left Leg
-	glPushMatrix();
-	glColor3f(0.0f, 0.0f, 0.8f);   // Dark blue for legs (like pants)
-	glTranslated(leftLegPosX, leftLegPosY, 0.0f); // Position for left leg
-	glRotatef(legAngle, 1.0f, 0.0f, 0.0f);
-	glScaled(0.15, 0.4, 0.15);     // Reduced scale to make it smaller
-	glutSolidCube(1.0);
-	glPopMatrix();
+#ifndef GYM_HEADLESS
+// Scene geometry is recorded into API-agnostic command lists that the render
+// thread submits later, so the scene can be recorded on worker threads. The
+// gfx* calls below append to the list being recorded on the calling thread,
+// or go straight to GL when nothing is being recorded.
+enum RenderOp { OP_PUSH_MATRIX, OP_POP_MATRIX, OP_TRANSLATE, OP_ROTATE, OP_SCALE, OP_COLOR, OP_CUBE, OP_SPHERE, OP_SKINNED_MESH };
+
+struct RenderCommand {
+	int op;
+	float args[4];
+	const SkinnedMesh* mesh;  // OP_SKINNED_MESH, whose args[0] is the offset of its skin matrices
+};
 
-	// Right Leg
-	glPushMatrix();
-	glColor3f(0.0f, 0.0f, 0.8f);   // Dark blue for legs (like pants)
-	glTranslated(rightLegPosX, rightLegPosY, 0.0f); // Position for right leg
-	glRotatef(-legAngle, 1.0f, 0.0f, 0.0f);
-	glScaled(0.15, 0.4, 0.15);     // Reduced scale to make it smaller
-	glutSolidCube(1.0);
-	glPopMatrix();
+class CommandList {
+public:
+	std::vector<RenderCommand> commands;
+	std::vector<float> matrices;  // Skin matrices referenced by OP_SKINNED_MESH
 
-	glPopMatrix();
-}
+	void clear() {
+		commands.clear();
+		matrices.clear();
+	}
 
+	void add(int op, float a = 0.0f, float b = 0.0f, float c = 0.0f, float d = 0.0f) {
+		RenderCommand command = { op, { a, b, c, d }, NULL };
+		commands.push_back(command);
+	}
 
+	void addSkinnedMesh(const SkinnedMesh* mesh, const float (*skin)[16]) {
+		RenderCommand command = { OP_SKINNED_MESH, { (float)matrices.size(), 0.0f, 0.0f, 0.0f }, mesh };
+		matrices.insert(matrices.end(), &skin[0][0], &skin[0][0] + 16 * JOINT_COUNT);
+		commands.push_back(command);
+	}
 
+	// Replay on the thread that owns the GL context
+	void submit() const {
+		for (size_t i = 0; i < commands.size(); i++) {
+			const float* a = commands[i].args;
+			switch (commands[i].op) {
+			case OP_PUSH_MATRIX: glPushMatrix(); break;
+			case OP_POP_MATRIX: glPopMatrix(); break;
+			case OP_TRANSLATE: glTranslatef(a[0], a[1], a[2]); break;
+			case OP_ROTATE: glRotatef(a[0], a[1], a[2], a[3]); break;
+			case OP_SCALE: glScalef(a[0], a[1], a[2]); break;
+			case OP_COLOR: glColor3f(a[0], a[1], a[2]); break;
+			case OP_CUBE:
+				profiler.countDraw();
+				glutSolidCube(a[0]);
+				break;
+			case OP_SPHERE:
+				profiler.countDraw();
+				glutSolidSphere(a[0], (GLint)a[1], (GLint)a[2]);
+				break;
+			case OP_SKINNED_MESH:
+				commands[i].mesh->draw(&matrices[(size_t)a[0]]);
+				break;
+			}
+		}
+	}
+};
 
+thread_local CommandList* recordingList = NULL;
 
-// Bounding box for the ChinUpDipMachine based on the dimensions from drawChinUpDipMachine()
-BoundingBox getChinUpDipMachineBoundingBox() {
-	BoundingBox box;
-	box.minX = -3.20f;
-	box.maxX = -2.70f;
-	box.minY = 0.0f;
-	box.maxY = 1.05f;
-	box.minZ = -0.35f;
-	box.maxZ = 0.35f;
-	return box;
+void gfxPushMatrix() {
+	if (recordingList) recordingList->add(OP_PUSH_MATRIX);
+	else glPushMatrix();
 }
-BoundingBox getBenchPressBoundingBox() {
-	BoundingBox box;
-	box.minX = -3.20f;
-	box.maxX = -2.40f;
-	box.minY = 0.0f;
-	box.maxY = 1.05f;
-	box.minZ = -2.35f;
-	box.maxZ = -1.05f;
-	return box;
+
+void gfxPopMatrix() {
+	if (recordingList) recordingList->add(OP_POP_MATRIX);
+	else glPopMatrix();
 }
-BoundingBox getSmithBoundingBox() {
-	BoundingBox box;
-	box.minX = -1.40f;
-	box.maxX = 0.0f;
-	box.minY = 0.0f;
-	box.maxY = 1.05f;
-	box.minZ = -3.2f;
-	box.maxZ = -2.8f;
-	return box;
+
+void gfxTranslate(double x, double y, double z) {
+	if (recordingList) recordingList->add(OP_TRANSLATE, (float)x, (float)y, (float)z);
+	else glTranslated(x, y, z);
 }
 
-BoundingBox getTreadMillBoundingBox() {
-	BoundingBox box;
-	box.minX = 1.0f;
-	box.maxX = 3.0f;
-	box.minY = 0.0f;
-	box.maxY = 1.05f;
-	box.minZ = -3.2f;
-	box.maxZ = -1.1f;
-	return box;
+void gfxRotate(double angle, double x, double y, double z) {
+	if (recordingList) recordingList->add(OP_ROTATE, (float)angle, (float)x, (float)y, (float)z);
+	else glRotated(angle, x, y, z);
 }
 
-BoundingBox getDumbellRackBoundingBox() {
-	BoundingBox box;
-	box.minX = 1.5f;
-	box.maxX = 2.4f;
-	box.minY = 0.0f;
-	box.maxY = 1.05f;
-	box.minZ = -0.3f;
-	box.maxZ = 1.4f;
-	return box;
+void gfxScale(double x, double y, double z) {
+	if (recordingList) recordingList->add(OP_SCALE, (float)x, (float)y, (float)z);
+	else glScaled(x, y, z);
 }
 
-BoundingBox getDeadLiftBoundingBox() {
-	BoundingBox box;
-	box.minX = -1.5f;
-	box.maxX = 0.5f;
-	box.minY = 0.0f;
-	box.maxY = 1.05f;
-	box.minZ = -0.5f;
-	box.maxZ = 0.2f;
-	return box;
+void gfxColor(float r, float g, float b) {
+	if (recordingList) recordingList->add(OP_COLOR, r, g, b);
+	else glColor3f(r, g, b);
 }
 
-// Bounding box for the player based on their position and size
-BoundingBox getPlayerBoundingBox(float posX, float posY, float posZ) {
-	BoundingBox box;
-	float playerSize = 0.3f; // Adjust based on player size
-	box.minX = posX - playerSize / 2;
-	box.maxX = posX + playerSize / 2;
-	box.minY = posY;
-	box.maxY = posY + playerSize; // Adjust for player height
-	box.minZ = posZ - playerSize / 2;
-	box.maxZ = posZ + playerSize / 2;
-	return box;
+// Solid primitives go through here so each pass knows its draw-call count
+void solidCube(GLdouble size) {
+	if (recordingList) {
+		recordingList->add(OP_CUBE, (float)size);
+		return;
+	}
+	profiler.countDraw();
+	glutSolidCube(size);
 }
 
-bool checkCollisionChinUp = false;
-bool checkCollisionDeadLift = false;
-bool checkCollisionBenchPress = false;
-bool checkCollisionSmith = false;
-bool checkCollisionTreadMill = false;
-bool checkCollisionDumbellRack = false;
+void solidSphere(GLdouble radius, GLint slices, GLint stacks) {
+	if (recordingList) {
+		recordingList->add(OP_SPHERE, (float)radius, (float)slices, (float)stacks);
+		return;
+	}
+	profiler.countDraw();
+	glutSolidSphere(radius, slices, stacks);
+}
 
-bool checkCollision(const BoundingBox& box1, const BoundingBox& box2) {
-	return (box1.minX <= box2.maxX && box1.maxX >= box2.minX) &&
-		(box1.minY <= box2.maxY && box1.maxY >= box2.minY) &&
-		(box1.minZ <= box2.maxZ && box1.maxZ >= box2.minZ);
+void gfxSkinnedMesh(const SkinnedMesh& mesh, const float (*skin)[16]) {
+	if (recordingList) recordingList->addSkinnedMesh(&mesh, skin);
+	else mesh.draw(&skin[0][0]);
 }
 
-BoundingBox chinUpMachineBox = getChinUpDipMachineBoundingBox();
-BoundingBox BenchPressBox = getBenchPressBoundingBox();
-BoundingBox SmithBox = getSmithBoundingBox();
-BoundingBox TreadMillBox = getTreadMillBoundingBox();
-BoundingBox DumbellRackBox = getDumbellRackBoundingBox();
-BoundingBox DeadLiftBox = getDeadLiftBoundingBox();
+#endif
+const char* const renderWorkerNames[] = { "worker 1", "worker 2", "worker 3", "worker 4", "worker 5", "worker 6", "worker 7" };
+const char* const simulationWorkerNames[] = { "sim worker 1", "sim worker 2", "sim worker 3", "sim worker 4", "sim worker 5", "sim worker 6", "sim worker 7" };
 
-void handleSpecialKeyboard(int key, int x, int y) {
-	// Reset the timer when a key is pressed
-	walkTimer = walkDuration;
-	float prevPosX = posX;
-	float prevPosZ = posZ;
-	// Move player based on key pressed and set rotation angle
-	switch (key) {
-	case GLUT_KEY_RIGHT:
-		if (posX + 0.1f <= 2.2f) {  // Check boundary for the right wall
-			posX += 0.1f;
-			rotationAngle = 90.0f;
-		}
-		break;
-	case GLUT_KEY_LEFT:
-		if (posX - 0.1f >= -3.2f) {  // Check boundary for the left wall
-			posX -= 0.1f;
-			rotationAngle = -90.0f;
-		}
-		break;
-	case GLUT_KEY_UP:
-		if (posZ - 0.1f >= -3.2f) {  // Check boundary for the back wall
-			posZ -= 0.1f;
-			rotationAngle = 0.0f;
-		}
-		break;
-	case GLUT_KEY_DOWN:
-		if (posZ + 0.1f <= 1.9f) {  // Check boundary for the front opening
-			posZ += 0.1f;
-			rotationAngle = 180.0f;
+// Fixed set of threads that run the iterations of parallelFor() with the caller.
+// The indices are split evenly between the threads; each one works through its
+// own range from the front and, once that is empty, steals the back half of
+// another thread's range, so uneven iterations still keep every core busy.
+class WorkerPool {
+public:
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+			generation++;
 		}
-		break;
-	default:
-		break;
+		wake.notify_all();
+		for (size_t i = 0; i < threads.size(); i++) threads[i].join();
 	}
-	startPosX = posX;
-	startPosZ = posZ;
-	BoundingBox playerBox = getPlayerBoundingBox(posX, 0.0f, posZ);
 
-	if (checkCollision(playerBox, chinUpMachineBox)) {
-		// Collision detected; reset position
-		posX = prevPosX;
-		posZ = prevPosZ;
-		checkCollisionChinUp = true;
-		walkTimer = 0;
-	}
-	else {
-		checkCollisionChinUp = false;
-	}
-	if (checkCollision(playerBox, BenchPressBox)) {
-		// Collision detected; reset position
-		posX = prevPosX;
-		posZ = prevPosZ;
-		checkCollisionBenchPress = true;
-		walkTimer = 0;
-	}
-	else {
-		checkCollisionBenchPress = false;
-	}
-	if (checkCollision(playerBox, SmithBox)) {
-		// Collision detected; reset position
-		posX = prevPosX;
-		posZ = prevPosZ;
-		checkCollisionSmith = true;
-		walkTimer = 0;
+	static const int MAX_THREADS = 8;  // Including the caller
+
+	// names needs an entry per thread and must outlive the pool
+	void start(int count, const char* const* names) {
+		if (count > MAX_THREADS - 1) count = MAX_THREADS - 1;
+		threadNames = names;
+		for (int i = 0; i < count; i++) {
+			threads.push_back(std::thread(&WorkerPool::workerMain, this, i));
+		}
 	}
-	else {
-		checkCollisionSmith = false;
+
+	int size() const {
+		return (int)threads.size() + 1;
 	}
-	if (checkCollision(playerBox, TreadMillBox)) {
-		// Collision detected; reset position
-		posX = prevPosX;
-		posZ = prevPosZ;
-		checkCollisionTreadMill = true;
-		walkTimer = 0;
+
+	// Run job(0..count-1) across the pool and return once all of them finished
+	void parallelFor(int count, const std::function<void(int)>& function) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &function;
+			int participants = size();
+			for (int p = 0; p < participants; p++) {
+				ranges[p].bounds.store(packRange(count * p / participants, count * (p + 1) / participants));
+			}
+			busy = (int)threads.size();
+			generation++;
+		}
+		wake.notify_all();
+		runJobs(size() - 1);
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return busy == 0; });
+		job = NULL;
 	}
-	else {
-		checkCollisionTreadMill = false;
+
+private:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const char* const* threadNames = NULL;
+	const std::function<void(int)>* job = NULL;
+	int busy = 0;
+	unsigned int generation = 0;
+	bool quit = false;
+
+	// Remaining indices [begin, end) of one thread, begin in the low 32 bits.
+	// Padded to a cache line so the owner and thieves of different ranges don't collide.
+	struct WorkRange {
+		std::atomic<unsigned long long> bounds;
+		char padding[64 - sizeof(std::atomic<unsigned long long>)];
+	};
+	WorkRange ranges[MAX_THREADS];
+
+	static unsigned long long packRange(unsigned int begin, unsigned int end) {
+		return (unsigned long long)end << 32 | begin;
 	}
-	if (checkCollision(playerBox, DumbellRackBox)) {
-		// Collision detected; reset position
-		posX = prevPosX;
-		posZ = prevPosZ;
-		checkCollisionDumbellRack = true;
-		walkTimer = 0;
+
+	static bool takeFront(WorkRange& range, int& index) {
+		unsigned long long bounds = range.bounds.load(std::memory_order_relaxed);
+		while (true) {
+			unsigned int begin = (unsigned int)bounds, end = (unsigned int)(bounds >> 32);
+			if (begin >= end) return false;
+			if (range.bounds.compare_exchange_weak(bounds, packRange(begin + 1, end), std::memory_order_acq_rel)) {
+				index = (int)begin;
+				return true;
+			}
+		}
 	}
-	else {
-		checkCollisionDumbellRack = false;
+
+	// Move the back half of victim into thief, which must be empty
+	static bool stealBack(WorkRange& victim, WorkRange& thief) {
+		unsigned long long bounds = victim.bounds.load(std::memory_order_relaxed);
+		while (true) {
+			unsigned int begin = (unsigned int)bounds, end = (unsigned int)(bounds >> 32);
+			if (begin >= end) return false;
+			unsigned int middle = end - (end - begin + 1) / 2;
+			if (victim.bounds.compare_exchange_weak(bounds, packRange(begin, middle), std::memory_order_acq_rel)) {
+				thief.bounds.store(packRange(middle, end), std::memory_order_release);
+				return true;
+			}
+		}
 	}
-	if (checkCollision(playerBox, DeadLiftBox)) {
-		// Collision detected; reset position
-		checkCollisionDeadLift = true;
+
+	void runJobs(int self) {
+		int participants = size();
+		while (true) {
+			int index;
+			while (takeFront(ranges[self], index)) {
+				(*job)(index);
+			}
+			bool stole = false;
+			for (int k = 1; k < participants && !stole; k++) {
+				stole = stealBack(ranges[(self + k) % participants], ranges[self]);
+			}
+			if (!stole) return;
+		}
 	}
-	else {
-		checkCollisionDeadLift = false;
+
+	void workerMain(int index) {
+		traceSetThreadName(threadNames[index]);
+		unsigned int seen = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this, seen] { return generation != seen; });
+				seen = generation;
+				if (quit) return;
+			}
+			runJobs(index);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				busy--;
+			}
+			done.notify_one();
+		}
 	}
-	glutPostRedisplay(); // Redraw the screen
-}
+};
 
+WorkerPool renderWorkers;      // Used by the GLUT thread
+WorkerPool simulationWorkers;  // Used by the simulation thread
 
+#ifndef GYM_HEADLESS
+void drawWall(double thickness, double width, double height) {
+	gfxPushMatrix();
+	gfxScale(width, thickness, height); // Scale the wall size
+	solidCube(1);
+	gfxPopMatrix();
+}
 
-bool isAnimatingChinUp = false;
-float animationTime = 0.0f;    // Track the elapsed time in seconds
-float chinUpDuration = 2.0f;   // Total time for the full up-and-down motion in seconds
-float startPosY = 0.1f;        // Starting position of the player
-float endPosY = 0.4f;          // Target position for the highest point of the chin-up
+void drawTableLeg(double thick, double len) {
+	gfxPushMatrix();
+	gfxTranslate(0, len / 2, 0);
+	gfxScale(thick, len, thick);
+	solidCube(1.0);
+	gfxPopMatrix();
+}
+void drawJackPart() {
+	gfxPushMatrix();
+	gfxScale(0.2, 0.2, 1.0);
+	solidSphere(1, 15, 15);
+	gfxPopMatrix();
+	gfxPushMatrix();
+	gfxTranslate(0, 0, 1.2);
+	solidSphere(0.2, 15, 15);
+	gfxTranslate(0, 0, -2.4);
+	solidSphere(0.2, 15, 15);
+	gfxPopMatrix();
+}
+void drawJack() {
+	gfxPushMatrix();
+	drawJackPart();
+	gfxRotate(90.0, 0, 1, 0);
+	drawJackPart();
+	gfxRotate(90.0, 1, 0, 0);
+	drawJackPart();
+	gfxPopMatrix();
+}
+void drawTable(double topWid, double topThick, double legThick, double legLen) {
+	gfxPushMatrix();
+	gfxTranslate(0, legLen, 0);
+	gfxScale(topWid, topThick, topWid);
+	solidCube(1.0);
+	gfxPopMatrix();
 
+	double dist = 0.95 * topWid / 2.0 - legThick / 2.0;
+	gfxPushMatrix();
+	gfxTranslate(dist, 0, dist);
+	drawTableLeg(legThick, legLen);
+	gfxTranslate(0, 0, -2 * dist);
+	drawTableLeg(legThick, legLen);
+	gfxTranslate(-2 * dist, 0, 2 * dist);
+	drawTableLeg(legThick, legLen);
+	gfxTranslate(0, 0, -2 * dist);
+	drawTableLeg(legThick, legLen);
+	gfxPopMatrix();
+}
 
+// Directional light coming from up and to the left, shared with the shadow maps
+const GLfloat lightPosition[] = { -7.0f, 6.0f, 3.0f, 0.0f };
 
-void startChinUpAnimation() {
-	isAnimatingChinUp = true;
-	animationTime = 0.0f;  // Reset elapsed time
-	PosY = startPosY;      // Start at the initial position
-	armAngle = 135.0f;      // Initial arm angle for gripping position
-	rotationAngle = -90;
+void setupLights() {
+	GLfloat ambient[] = { 0.7f, 0.7f, 0.7, 1.0f };
+	GLfloat diffuse[] = { 0.6f, 0.6f, 0.6, 1.0f };
+	GLfloat specular[] = { 1.0f, 1.0f, 1.0, 1.0f };
+	GLfloat shininess[] = { 50 };
+	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, ambient);
+	glMaterialfv(GL_FRONT, GL_DIFFUSE, diffuse);
+	glMaterialfv(GL_FRONT, GL_SPECULAR, specular);
+	glMaterialfv(GL_FRONT, GL_SHININESS, shininess);
+
+	GLfloat lightIntensity[] = { 0.7f, 0.7f, 1, 1.0f };
+	glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
+	glLightfv(GL_LIGHT0, GL_DIFFUSE, lightIntensity);
 }
+void setupCamera(Camera& view, double aspect) {
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	gluPerspective(60, aspect, 0.001, 100);
 
-void updateChinUpAnimation(float deltaTime) {
-	if (isAnimatingChinUp) {
-		animationTime += deltaTime;  // Update the time elapsed
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+	view.look();
+}
+
+void setupCamera() {
+	setupCamera(frame.camera, 640 / 480);
+}
+
+void drawWindowFrame(float width, float height, float depth) {
+	gfxColor(0.2f, 0.2f, 0.2f); // Dark gray color for the "TV frame"
 
-		// Calculate progress as a fraction of the total duration (0.0 to 1.0)
-		float progress = fmod(animationTime, chinUpDuration) / chinUpDuration;
+	// Draw a solid, filled rectangular block
+	gfxPushMatrix();
+	gfxScale(width, height, depth);  // Scale to the specified width, height, and depth
+	solidCube(1);                // Draw a solid cube scaled to form a rectangular box
+	gfxPopMatrix();
+}
 
-		// Use sine to make a smooth up-and-down motion
-		float heightFactor = sin(progress * 3.14159f);  // Sine function for smooth up and down
-		PosY = startPosY + (endPosY - startPosY) * heightFactor;
 
-		// Arm bending based on position
 
-		// Adjust the Y positions of each part to match the chin-up height
-		headPosY = 0.3f + PosY;
-		torsoPosY = 0.0f + PosY;
-		leftArmPosY = rightArmPosY = 0.35f;
-		leftLegPosY = -0.3f + PosY;
-		rightLegPosY = -0.3f + PosY;
-		posX = -2.8f;
-		posZ = 0.0f;
-		// Stop the animation after a complete cycle (up and down)
-	}
+#endif
+float prevPosX = 0.0f, prevPosZ = 0.0f;
+float posX = -0.5f, posZ = 1.5f;
+float PosY = 0.1f;
+
+
+
+bool isAnimatingBenchPress = false;
+float benchPressAnimationTime = 0.0f;
+float benchPressDuration = 3.0f;    // Total time for the animation in seconds
+
+float startPosXBench = posX;
+float startPosZBench = posZ;
+float barLiftAmount = 0.15f;        // Amount the bar moves up and down
+float barPosY = 0.6f;               // Starting Y position of the bar
+bool isLiftingBar = false;          // Track lifting state for bar
+
+
+
+#ifndef GYM_HEADLESS
+void drawBenchPressSeat() {
+	gfxPushMatrix();
+	gfxColor(0.3f, 0.3f, 0.3f);      // Dark gray color for seat
+	gfxTranslate(1.2, 0.3, 0.7);      // Move seat slightly up and outward
+	gfxScale(0.8, 0.08, 0.25);        // Scale to make seat larger
+	solidCube(1);
+	gfxPopMatrix();
 }
-void startBenchPressAnimation() {
-	isAnimatingBenchPress = true;
-	benchPressAnimationTime = 0.0f;
-	armAngle = 180;               // Set initial arm position for gripping
-	leftarmAngle = 180;
-	rotationAngle = 90.0f;
 
-	rotationY = 1.0f;
-	rotationZ = 0.0f;
+void drawSeatLeg1() {
+	gfxPushMatrix();
+	gfxColor(0.1f, 0.1f, 0.1f);      // Dark color for the leg
+	gfxTranslate(0.95, 0.15, 0.7);    // Adjust position of left leg
+	gfxScale(0.1, 0.3, 0.1);          // Scale to make leg thicker and taller
+	solidCube(1);
+	gfxPopMatrix();
+}
 
+void drawSeatLeg2() {
+	gfxPushMatrix();
+	gfxColor(0.1f, 0.1f, 0.1f);      // Dark color for the leg
+	gfxTranslate(1.4, 0.15, 0.7);     // Adjust position of right leg
+	gfxScale(0.1, 0.3, 0.1);          // Scale to make leg thicker and taller
+	solidCube(1);
+	gfxPopMatrix();
 }
 
+void drawVerticalSupport1() {
+	gfxPushMatrix();
+	gfxColor(0.2f, 0.2f, 0.2f);      // Black color for support
+	gfxTranslate(0.9, 0.5, 1.0);      // Move right side support up and outward
+	gfxScale(0.1, 0.7, 0.1);          // Scale to make support taller and thicker
+	solidCube(1);
+	gfxPopMatrix();
+}
 
-void updateBenchPressAnimation(float deltaTime) {
-	if (isAnimatingBenchPress) {
-		benchPressAnimationTime += deltaTime;
+void drawVerticalSupport2() {
+	gfxPushMatrix();
+	gfxColor(0.2f, 0.2f, 0.2f);      // Black color for support
+	gfxTranslate(0.9, 0.5, 0.4);      // Move left side support up and outward
+	gfxScale(0.1, 0.7, 0.1);          // Scale to make support taller and thicker
+	solidCube(1);
+	gfxPopMatrix();
+}
 
-		// Phase 1: Move the player to a seated position on the bench
-		if (benchPressAnimationTime < benchPressDuration / 3) {
-			rotationBench = -90.0f;
-			posX = -2.7f;
-			posZ = -1.75f;
-			PosY = -0.1f;
-		}
-		else {
-			// Phase 2: Arm adjustment and lift bar up/down
-			rightArmPosY = 0.25f;
-			leftArmPosY = 0.25f;
-			leftArmPosZ = 0.1 + barLiftAmount * sin(benchPressAnimationTime * 3.14f);
-			rightArmPosZ = 0.1 + barLiftAmount * sin(benchPressAnimationTime * 3.14f);
-			armAngle = 90;
-			leftarmAngle = 90;
-
-			// Lift or lower bar with arms
-			barPosY = 0.7f + barLiftAmount * sin(benchPressAnimationTime * 3.14f);
-		}
-	}
+void drawBar() {
+	gfxPushMatrix();
+	gfxColor(1.0f, 1.0f, 1.0f);
+	gfxTranslate(0.9, frame.barPosY, 0.7);  // Use `barPosY` for lifting animation
+	gfxRotate(90, 0.0, 1.0, 0.0);
+	gfxScale(1.5, 0.08, 0.08);
+	solidCube(1);
+	gfxPopMatrix();
 }
-static int holdCounter = 0;
-void updateSmithAnimation(int value) {
-	if (!isAnimatingSmith) return;
 
-	switch (animationStep) {
-	case 0:  // Scaling up
-		scaleFactor += 0.05f;
-		for (int i = 0; i < 3; i++) {
-			color[i] = originalColor[i] + (maxColor[i] - originalColor[i]) * (scaleFactor - 1) / (targetScale - 1);
-		}
-		if (scaleFactor >= targetScale) {
-			scaleFactor = targetScale;
-			animationStep = 1;  // Move to hold phase
-		}
-		break;
+void drawLeftWeight() {
+	gfxPushMatrix();
+	gfxColor(0.0f, 0.0f, 0.0f);      // Dark gray color for weights
+	gfxTranslate(0.9, frame.barPosY, 1.25);     // Position left weight further out
+	gfxScale(0.45, 0.5, 0.1);         // Scale to make weight larger and thicker
+	solidCube(1.5);
+	gfxPopMatrix();
+}
 
-	case 1:  // Hold at maximum size and color
-		// Remain in this state indefinitely until 'P' key is pressed
-		break;
+void drawRightWeight() {
+	gfxPushMatrix();
+	gfxColor(0.0f, 0.0f, 0.0f);      // Dark gray color for weights
+	gfxTranslate(0.9, frame.barPosY, 0.15);     // Position right weight further out
+	gfxScale(0.45, 0.5, 0.1);         // Scale to make weight larger and thicker
+	solidCube(1.5);
+	gfxPopMatrix();
+}
 
-	case 2:  // Scaling down
-		scaleFactor -= 0.05f;
-		for (int i = 0; i < 3; i++) {
-			color[i] = maxColor[i] - (maxColor[i] - originalColor[i]) * (targetScale - scaleFactor) / (targetScale - 1);
-		}
-		if (scaleFactor <= 1.0f) {
-			scaleFactor = 1.0f;
-			animationStep = 3;  // Move to reset phase
-		}
-		break;
 
-	case 3:  // Reset to original color and stop animation
-		for (int i = 0; i < 3; i++) {
-			color[i] = originalColor[i];
-		}
-		isAnimatingSmith = false;
-		animationStep = 0;
-		break;
-	}
 
-	glutPostRedisplay();
-	if (isAnimatingSmith) {
-		glutTimerFunc(animationSpeed, updateSmithAnimation, 0);
-	}
-}
 
 
+#endif
+bool isAnimatingSmith = false;      // Track if animatio nis active
+float scaleFactor = 1.0f;      // Initial scale factor
+float color[3] = { 0.0f, 0.0f, 0.0f }; // Current color (initially black)
 
-bool isAnimatingTreadmill = false;
-float treadmillAnimationTime = 0.0f;       // Track elapsed time in seconds
-float treadmillRunDuration = 5.0f;        // Total time player runs on treadmill
-float legSwingSpeed = 15.0f;               // Speed of swinging motion for legs (higher value = faster motion)
-float startLegAngle = 0.0f;                // Initial leg angle
-float maxLegAngle = 45.0f;                 // Max leg angle for running motion
-float startArmAngle = 0.0f;                // Initial arm angle
-float maxArmAngle = 30.0f;                 // Max arm angle for running motion
-float startTorsoAngle = 0.0f;
-float maxTorsoAngle = 10.0f;
+// Animation parameters
+float targetScale = 1.5f;      // Maximum scale factor
+float originalColor[3] = { 0.0f, 0.0f, 0.0f }; // Original color (black)
+float maxColor[3] = { 1.0f, 1.0f, 1.0f };      // Color at maximum scale (red)
+int animationStep = 0;         // Tracks current stage in animation
+int animationSpeed = 80;       // Controls speed of animation steps
+int holdDuration = 30;         // Frames to hold at max scale and color
 
-// Start the treadmill animation
-void startTreadmillAnimation() {
-	isAnimatingTreadmill = true;
-	treadmillAnimationTime = 0.0f;  // Reset elapsed time
-	legAngle = startLegAngle;       // Start at initial leg angle
-	armAngle = startArmAngle;       // Start at initial arm angle
-	leftarmAngle = -startArmAngle;  // Opposite angle for left arm
-	posX = 1.7f;                    // Set position on treadmill
-	PosY = 0.1f;
-	posZ = -1.5f;
-	rotationAngle = 90.0f;         // Face the treadmill
-	TorsoAngle = startTorsoAngle;
+
+
+
+
+#ifndef GYM_HEADLESS
+// Draw the base support
+void drawBaseSupport() {
+	gfxPushMatrix();
+	gfxColor(frame.color[0], frame.color[1], frame.color[2]);      // Use current animation color
+	gfxScale(1.5 * frame.scaleFactor, 0.1 * frame.scaleFactor, 0.1 * frame.scaleFactor); // Apply scale factor
+	solidCube(1);
+	gfxPopMatrix();
 }
 
-// Update treadmill animation
-void updateTreadmillAnimation(float deltaTime) {
-	if (isAnimatingTreadmill) {
-		treadmillAnimationTime += deltaTime;  // Update elapsed time
+// Draw the left vertical frame
+void drawLeftVerticalFrame() {
+	gfxPushMatrix();
+	gfxColor(frame.color[0], frame.color[1], frame.color[2]);
+	gfxTranslate(-0.7 * frame.scaleFactor, 0.5 * frame.scaleFactor, 0); // Apply scale factor to translation
+	gfxScale(0.1 * frame.scaleFactor, 1.5 * frame.scaleFactor, 0.1 * frame.scaleFactor); // Apply scale factor to scaling
+	solidCube(1);
+	gfxPopMatrix();
+}
 
-		// Use a sine wave to create back-and-forth swinging motion for legs and arms
-		float progress = fmod(treadmillAnimationTime * legSwingSpeed, treadmillRunDuration) / treadmillRunDuration;
-		float angleFactor = sin(progress * 3.14159f * 2);
+// Draw the right vertical frame
+void drawRightVerticalFrame() {
+	gfxPushMatrix();
+	gfxColor(frame.color[0], frame.color[1], frame.color[2]);
+	gfxTranslate(0.7 * frame.scaleFactor, 0.5 * frame.scaleFactor, 0); // Apply scale factor to translation
+	gfxScale(0.1 * frame.scaleFactor, 1.5 * frame.scaleFactor, 0.1 * frame.scaleFactor); // Apply scale factor to scaling
+	solidCube(1);
+	gfxPopMatrix();
+}
 
-		// Update leg and arm angles based on the angle factor
-		legAngle = startLegAngle + maxLegAngle * angleFactor;
-		armAngle = startArmAngle + maxArmAngle * -angleFactor;
-		leftarmAngle = -(startArmAngle + maxArmAngle * -angleFactor);
-		TorsoAngle = startTorsoAngle + maxTorsoAngle * angleFactor;
-	}
+// Draw the left frame support (diagonal)
+void drawLeftFrameSupport() {
+	gfxPushMatrix();
+	gfxColor(frame.color[0], frame.color[1], frame.color[2]);
+	gfxTranslate(-0.7 * frame.scaleFactor, 0.25 * frame.scaleFactor, -0.35 * frame.scaleFactor); // Apply scale factor to translation
+	gfxRotate(45, 1.0, 0.0, 0.0);
+	gfxScale(0.1 * frame.scaleFactor, 1.0 * frame.scaleFactor, 0.1 * frame.scaleFactor); // Apply scale factor to scaling
+	solidCube(1);
+	gfxPopMatrix();
 }
 
-bool isColorChanging = false;  // Flag to toggle color-changing animation
-float colorChangeTime = 0.0f;  // Timer to track color change progress
+// Draw the right frame support (diagonal)
+void drawRightFrameSupport() {
+	gfxPushMatrix();
+	gfxColor(frame.color[0], frame.color[1], frame.color[2]);
+	gfxTranslate(0.7 * frame.scaleFactor, 0.25 * frame.scaleFactor, -0.35 * frame.scaleFactor); // Apply scale factor to translation
+	gfxRotate(45, 1.0, 0.0, 0.0);
+	gfxScale(0.1 * frame.scaleFactor, 1.0 * frame.scaleFactor, 0.1 * frame.scaleFactor); // Apply scale factor to scaling
+	solidCube(1);
+	gfxPopMatrix();
+}
 
+// Draw the bottom support beam (horizontal, connecting left and right frames)
+void drawBottomSupport() {
+	gfxPushMatrix();
+	gfxColor(frame.color[0], frame.color[1], frame.color[2]);
+	gfxTranslate(0, 0.05 * frame.scaleFactor, -0.55 * frame.scaleFactor); // Apply scale factor to translation
+	gfxScale(1.3 * frame.scaleFactor, 0.1 * frame.scaleFactor, 0.1 * frame.scaleFactor); // Apply scale factor to scaling
+	solidCube(1);
+	gfxPopMatrix();
+}
 
-void updateDumbbellColor(float deltaTime) {
-	if (isColorChanging) {
-		colorChangeTime += deltaTime;  // Increase the timer based on deltaTime
+// Draw the top horizontal bar
+void drawTopBar() {
+	gfxPushMatrix();
+	gfxColor(frame.color[0], frame.color[1], frame.color[2]);
+	gfxTranslate(0, 1.2 * frame.scaleFactor, 0); // Apply scale factor to translation
+	gfxScale(1.5 * frame.scaleFactor, 0.1 * frame.scaleFactor, 0.1 * frame.scaleFactor); // Apply scale factor to scaling
+	solidCube(1);
+	gfxPopMatrix();
+}
 
-		// Create oscillating RGB values with sine functions for smooth color transitions
-		dumbbellColor[0] = 0.1f + 0.5f * sin(colorChangeTime * 2.0f);
-		dumbbellColor[1] = 0.1f + 0.5f * sin(colorChangeTime * 2.5f);
-		dumbbellColor[2] = 0.1f + 0.5f * sin(colorChangeTime * 3.0f);
+// Draw the barbell
+void drawBarbell() {
+	gfxPushMatrix();
+	gfxColor(0.75f * frame.color[0], 0.75f * frame.color[1], 0.75f * frame.color[2]); // Silver color with scaling effect
+	gfxTranslate(0, 0.8 * frame.scaleFactor, 0); // Apply scale factor to translation
+	gfxScale(1.9 * frame.scaleFactor, 0.05 * frame.scaleFactor, 0.05 * frame.scaleFactor); // Apply scale factor to scaling
+	solidCube(1);
+	gfxPopMatrix();
+}
 
-	}
-	else {
-		dumbbellColor[0] = 0.1f;
-		dumbbellColor[1] = 0.1f;
-		dumbbellColor[2] = 0.1f;
-	}
+// Draw the left counterweight
+void drawLeftCounterweight() {
+	gfxPushMatrix();
+	gfxColor(0.3f * frame.color[0], 0.3f * frame.color[1], 0.3f * frame.color[2]); // Darker color with scaling effect
+	gfxTranslate(-0.6 * frame.scaleFactor, 0.75 * frame.scaleFactor, 0); // Apply scale factor to translation
+	gfxScale(0.1 * frame.scaleFactor, 0.4 * frame.scaleFactor, 0.1 * frame.scaleFactor); // Apply scale factor to scaling
+	solidCube(1);
+	gfxPopMatrix();
 }
 
+// Draw the right counterweight
+void drawRightCounterweight() {
+	gfxPushMatrix();
+	gfxColor(0.3f * frame.color[0], 0.3f * frame.color[1], 0.3f * frame.color[2]); // Darker color with scaling effect
+	gfxTranslate(0.6 * frame.scaleFactor, 0.75 * frame.scaleFactor, 0); // Apply scale factor to translation
+	gfxScale(0.1 * frame.scaleFactor, 0.4 * frame.scaleFactor, 0.1 * frame.scaleFactor); // Apply scale factor to scaling
+	solidCube(1);
+	gfxPopMatrix();
+}
 
 
-float deadliftRotationAngle = 0.0f;
-float dumbellRackRotationAngle = 0.0f;
 
-float holdingPhaseCameraAngle = 0.0f; // Angle for rotating camera
-const float holdingCameraSpeed = 0.3f; // Adjust speed of rotation as needed
+#endif
+float barHeight = -0.2f;
 
 
-bool isLifting = false;
-float deadliftAnimationTime = 0.0f;
+#ifndef GYM_HEADLESS
+void drawDeadliftBar() {
+	gfxPushMatrix();
+	gfxColor(0.75f, 0.75f, 0.75f);  // Silver color for the bar
+	gfxTranslate(0.0, 0.5, 0.0);     // Position bar above the ground
+	gfxScale(1.5, 0.05, 0.05);       // Scale to make it a long, thin bar
+	solidCube(1);
+	gfxPopMatrix();
+}
 
+// Function to draw a dumbbell weight
+void drawDumbbell(float radius, float thickness) {
+	gfxColor(0.1f, 0.1f, 0.1f);  // Dark color for weights
 
+	// Draw left side of the weight
+	gfxPushMatrix();
+	gfxTranslate(-0.75, 0.5, 0.0);  // Position weight on the left end of the bar
+	gfxScale(thickness, radius, radius);  // Scale to make a thin, large disc shape
+	solidCube(1);  // Draw weigh4
+	gfxPopMatrix();
 
-// Constants for timing each animation phase
-const float bendDownDuration = 5.0f; // seconds
-const float liftUpDuration = 5.0f;   // seconds
-const float holdUpDuration = 4.0f;     // seconds
+	// Draw right side of the weight
+	gfxPushMatrix();
+	gfxTranslate(0.75, 0.5, 0.0);  // Position weight on the right end of the bar
+	gfxScale(thickness, radius, radius);  // Scale to match the left side
+	solidCube(1);  // Draw weight
+	gfxPopMatrix();
+}
 
-void startDeadliftAnimation() {
-	isLifting = true;
-	deadliftAnimationTime = 0.0f;
-	armAngle = leftarmAngle = barHeight = 0.0f;
+void drawBase() {
+	gfxPushMatrix();
+	gfxColor(0.3f, 0.3f, 0.3f);  // Dark gray color for the base
+	gfxScale(1.2, 0.1, 0.6);      // Scale for the base frame
+	solidCube(1);
+	gfxPopMatrix();
 }
 
-void updateDeadliftAnimation(float deltaTime) {
-	if (isLifting) {
-		deadliftAnimationTime += deltaTime;
-		deadliftRotationAngle = 0.0f;
+// Function to draw the running belt
+void drawBelt() {
+	gfxPushMatrix();
+	gfxColor(0.2f, 0.2f, 0.2f);  // Black color for the running belt
+	gfxTranslate(0.0, 0.05, 0.0); // Position slightly above the base
+	gfxScale(1.1, 0.02, 0.5);     // Scale for the belt
+	solidCube(1);
+	gfxPopMatrix();
+}
 
-		if (deadliftAnimationTime <= bendDownDuration) {  // Bending down phase
-			alSourceStop(sourceBackground);
-			camera.setFrontCloseView();  // Set camera for close-up front view
-			float progress = deadliftAnimationTime / bendDownDuration;
-			posX = -0.5f;
-			posZ = -0.29f;
-			rotationAngle = 180;
-			armAngle = leftarmAngle = 90.0f * progress;
-			barHeight = 0.1f * progress;
-		}
-		else if (deadliftAnimationTime <= bendDownDuration + liftUpDuration) {  // Lifting up phase
-			camera.setSideLiftView();  // Set camera for side view during lift
-			float progress = (deadliftAnimationTime - bendDownDuration) / liftUpDuration;
-			armAngle = leftarmAngle = 90.0f + 90.0f * progress;
-			barHeight = 0.1f + 0.415f * progress;
-			leftArmPosY = rightArmPosY = 0.1f + 0.215f * progress;
-		}
-		else if (deadliftAnimationTime <= bendDownDuration + liftUpDuration + holdUpDuration) {  // Holding phase
-			holdingPhaseCameraAngle += holdingCameraSpeed * deltaTime;
+// Function to draw side rails
+void drawSideRails() {
+	// Left side rail
+	gfxPushMatrix();
+	gfxColor(0.6f, 0.6f, 0.6f);  // Light gray color for the side rails
+	gfxRotate(90, 0.0, 1.0, 0.0);
+	gfxTranslate(-0.25, 0.05, 0.2); // Position on the left side
+	gfxScale(0.1, 0.05, 1.0);     // Scale to make it a long, thin rail
+	solidCube(1);
+	gfxPopMatrix();
 
-			// Calculate the new camera position in a circular path around the player
-			float radius = 2.5f; // Radius of the camera circle
-			camera.eye.x = radius * cos(holdingPhaseCameraAngle) + 2.0f;  // X position
-			camera.eye.z = radius * sin(holdingPhaseCameraAngle) + 2.0f;  // Z position
-			camera.eye.y = 3.5f - radius * sin(holdingPhaseCameraAngle);
-			barHeight = 0.57f;
-		}
-		else {
-			isLifting = false;  // End animation
-			barHeight = -0.2f;
-			leftArmPosY = rightArmPosY = 0.0f;
-			camera.setFrontView();
-			gameState = WIN;
-			alSourceStop(sourceDeadlift);
-		}
-	}
+	// Right side rail
+	gfxPushMatrix();
+	gfxColor(0.6f, 0.6f, 0.6f);  // Light gray color for the side rails
+	gfxRotate(90, 0.0, 1.0, 0.0);
+	gfxTranslate(0.25, 0.05, 0.2);  // Position on the right side
+	gfxScale(0.1, 0.05, 1.0);     // Scale to make it a long, thin rail
+	solidCube(1);
+	gfxPopMatrix();
 }
 
+// Function to draw handles
+void drawHandles() {
+	// Left handle
+	gfxPushMatrix();
+	gfxColor(0.6f, 0.6f, 0.6f);  // Light gray for handles
+	gfxTranslate(0.65, 0.4, -0.25); // Position on the left side, above the side rail
+	gfxScale(0.05, 1.0, 0.05);    // Scale to make it tall and thin
+	solidCube(1);
+	gfxPopMatrix();
 
-bool DeadLiftUsed = false;
-bool BenchPressUsed = false;
-bool TreadMillUsed = false;
-bool ChinUpUsed = false;
-bool DumbellRackUsed = false;
-bool SmithUsed = false;
+	// Right handle
+	gfxPushMatrix();
+	gfxColor(0.6f, 0.6f, 0.6f);  // Light gray for handles
+	gfxTranslate(0.65, 0.4, 0.25);  // Position on the right side, above the side rail
+	gfxScale(0.05, 1.0, 0.05);    // Scale to make it tall and thin
+	solidCube(1);
+	gfxPopMatrix();
+}
 
 
-void handleKeyboard(unsigned char key, int x, int y) {
-	// Check if "E" is pressed and player is colliding with the chin-up machine
-	const float moveStep = 0.2f;
-	switch (key)
-	{
-	case 't':
-		camera.setTopView();
-		break;
-	case 'f':
-		camera.setFrontView();
+void drawHandleArms() {
+	// Left arm
+	gfxPushMatrix();
+	gfxColor(0.6f, 0.6f, 0.6f);  // Light gray for arms
+	gfxTranslate(0.5, 0.7, -0.25); // Position on the left side, slightly in front of the handle
+	gfxRotate(90, 0.0, 1.0, 0.0); // Rotate slightly inward
+	gfxScale(0.05, 0.05, 0.3);     // Scale to make it a short, thin arm
+	solidCube(1);
+	gfxPopMatrix();
+
+	// Right arm
+	gfxPushMatrix();
+	gfxColor(0.6f, 0.6f, 0.6f);  // Light gray for arms
+	gfxTranslate(0.5, 0.7, 0.25);  // Position on the right side, slightly in front of the handle
+	gfxRotate(90, 0.0, 1.0, 0.0);  // Rotate slightly inward
+	gfxScale(0.05, 0.05, 0.3);     // Scale to make it a short, thin arm
+	solidCube(1);
+	gfxPopMatrix();
+}
+// Function to draw the console
+void drawConsole() {
+	gfxPushMatrix();
+	gfxColor(0.2f, 0.2f, 0.2f);  // Dark gray for the console
+	gfxTranslate(0.6, 0.8, 0.0);  // Position above the handles
+	gfxRotate(90, 0.0, 1.0, 0.0); // Tilt the console slightly
+	gfxScale(0.5, 0.2, 0.1);      // Scale for console size
+	solidCube(1);
+	gfxPopMatrix();
+}
+// Draw the horizontal stabilizers (front and back)
+
+
+// Display function to draw the entire Smith machine
+
+void drawShelf(float width, float depth) {
+	gfxPushMatrix();
+	gfxColor(0.5f, 0.5f, 0.5f);  // Light gray color for the shelf
+	gfxScale(width, 0.05f, depth); // Scale the shelf dimensions
+	solidCube(1);
+	gfxPopMatrix();
+}
+
+// Function to draw a single dumbbell holder on the shelf
+void drawDumbbellHolder(float width, float height, float depth) {
+	gfxPushMatrix();
+	gfxColor(0.3f, 0.3f, 0.3f);  // Dark gray color for the holder
+	gfxScale(width, height, depth); // Scale the holder dimensions
+	solidCube(1);
+	gfxPopMatrix();
+}
+
+// Function to draw vertical supports for the rack
+void drawVerticalSupport(float height) {
+	gfxPushMatrix();
+	gfxColor(0.4f, 0.4f, 0.4f);  // Gray color for the vertical supports
+	gfxScale(0.05f, height, 0.05f); // Scale the support dimensions
+	solidCube(1);
+	gfxPopMatrix();
+}
+
+
+
+
+
+#endif
+// Dumbbell color array to hold changing color values
+float dumbbellColor[3] = { 0.1f, 0.1f, 0.1f };
+
+
+#ifndef GYM_HEADLESS
+void drawDumbbell() {
+	// Dumbbell handle
+	gfxPushMatrix();
+	gfxColor(1.0f, 1.0f, 1.0f);  // Silver color for handle
+	gfxScale(0.6, 0.07, 0.07);    // Larger handle size
+	solidCube(1);
+	gfxPopMatrix();
+
+	// Left weight
+	gfxPushMatrix();
+	gfxColor(frame.dumbbellColor[0], frame.dumbbellColor[1], frame.dumbbellColor[2]);  // Use animated color for weights
+	gfxTranslate(-0.35, 0, 0);    // Adjust position for larger weight size
+	gfxScale(1.3, 1.0, 1.0);      // Scale sphere horizontally for larger weights
+	solidSphere(0.1, 20, 20); // Larger spherical weight
+	gfxPopMatrix();
+
+	// Right weight
+	gfxPushMatrix();
+	gfxColor(frame.dumbbellColor[0], frame.dumbbellColor[1], frame.dumbbellColor[2]);  // Use animated color for weights
+	gfxTranslate(0.35, 0, 0);     // Adjust position for larger weight size
+	gfxScale(1.3, 1.0, 1.0);      // Scale sphere horizontally for larger weights
+	solidSphere(0.1, 20, 20); // Larger spherical weight
+	gfxPopMatrix();
+}
+
+// Function to draw the entire dumbbell rack
+void drawDumbbellRack() {
+	float shelfWidth = 1.5f;
+	float shelfDepth = 0.4f;
+	float shelfHeight = 0.3f;
+
+	// Draw bottom shelf
+	gfxPushMatrix();
+	gfxTranslate(0, 0.15f, 0); // Position the bottom shelf close to the ground
+	drawShelf(shelfWidth, shelfDepth);
+	gfxPopMatrix();
+
+	// Draw top shelf
+	gfxPushMatrix();
+	gfxTranslate(0, 0.5f, 0); // Position the top shelf higher
+	drawShelf(shelfWidth, shelfDepth);
+	gfxPopMatrix();
+
+	// Draw vertical supports
+	gfxPushMatrix();
+	gfxTranslate(-shelfWidth / 2 + 0.05f, 0.35f, -shelfDepth / 2 + 0.05f);
+	drawVerticalSupport(0.7f);
+	gfxPopMatrix();
+
+	gfxPushMatrix();
+	gfxTranslate(shelfWidth / 2 - 0.05f, 0.35f, -shelfDepth / 2 + 0.05f);
+	drawVerticalSupport(0.7f);
+	gfxPopMatrix();
+
+	gfxPushMatrix();
+	gfxTranslate(-shelfWidth / 2 + 0.05f, 0.35f, shelfDepth / 2 - 0.05f);
+	drawVerticalSupport(0.7f);
+	gfxPopMatrix();
+
+	gfxPushMatrix();
+	gfxTranslate(shelfWidth / 2 - 0.05f, 0.35f, shelfDepth / 2 - 0.05f);
+	drawVerticalSupport(0.7f);
+	gfxPopMatrix();
+
+	// Draw dumbbell holders on the bottom shelf
+	for (int i = -2; i <= 2; i++) {
+		gfxPushMatrix();
+		gfxTranslate(i * 0.3f, 0.18f, 0); // Position holders along the shelf
+		drawDumbbellHolder(0.1f, 0.05f, 0.35f);
+		gfxTranslate(0, 0.05, 0.0);
+		gfxRotate(90, 0.0, 1.0, 0.0);
+		drawDumbbell();
+		gfxPopMatrix();
+	}
+
+	// Draw dumbbell holders on the top shelf
+	for (int i = -2; i <= 2; i++) {
+		gfxPushMatrix();
+		gfxTranslate(i * 0.3f, 0.53f, 0); // Position holders along the shelf
+		drawDumbbellHolder(0.1f, 0.05f, 0.35f);
+		gfxTranslate(0, 0.05, 0);
+		gfxRotate(90, 0.0, 1.0, 0.0);
+		drawDumbbell();
+		gfxPopMatrix();
+	}
+}
+
+void drawChinUpDipMachine() {
+	// Base1
+	gfxPushMatrix();
+	gfxColor(0.9f, 0.9f, 0.9f);  // Light gray for the frame
+	gfxScale(0.1, 0.05, 0.5);    // Scale for the long base
+	gfxTranslate(-1.5, 0, -0.1);     // Position the base
+	solidCube(1);
+	gfxPopMatrix();
+
+	// Base2
+	gfxPushMatrix();
+	gfxColor(0.9f, 0.9f, 0.9f);  // Light gray for the frame
+	gfxScale(0.1, 0.05, 0.5);    // Scale for the long base
+	gfxTranslate(1.5, 0, -0.1);     // Position the base
+	solidCube(1);
+	gfxPopMatrix();
+
+	// Vertical Supports (left and right)
+	gfxPushMatrix();
+	gfxColor(0.9f, 0.9f, 0.9f);  // Light gray for the supports
+	gfxTranslate(-0.15, 0.5, 0);  // Left vertical support position
+	gfxScale(0.05, 1.0, 0.05);    // Scale for the support height
+	solidCube(1);
+	gfxPopMatrix();
+
+	gfxPushMatrix();
+	gfxColor(0.9f, 0.9f, 0.9f);  // Light gray for the supports
+	gfxTranslate(0.15, 0.5, 0);   // Right vertical support position
+	gfxScale(0.05, 1.0, 0.05);    // Scale for the support height
+	solidCube(1);
+	gfxPopMatrix();
+
+	// Horizontal Bar at the Top (for chin-ups)
+	gfxPushMatrix();
+	gfxColor(0.9f, 0.9f, 0.9f);  // Light gray for the top bar
+	gfxTranslate(0, 1.0, 0);      // Position the top bar
+	gfxScale(0.4, 0.05, 0.05);    // Scale for the bar width
+	solidCube(1);
+	gfxPopMatrix();
+
+	// Chin-up Handles (angled)
+	gfxPushMatrix();
+	gfxColor(0.1f, 0.1f, 0.1f);  // Dark color for handles
+	gfxTranslate(-0.18, 1.0, 0.1);  // Left handle position
+	gfxRotate(45, 0, 1, 0);        // Angle the handle
+	gfxScale(0.15, 0.05, 0.05);    // Scale for the handle
+	solidCube(1);
+	gfxPopMatrix();
+
+	gfxPushMatrix();
+	gfxColor(0.1f, 0.1f, 0.1f);  // Dark color for handles
+	gfxTranslate(0.18, 1.0, 0.1);   // Right handle position
+	gfxRotate(-45, 0, 1, 0);       // Angle the handle
+	gfxScale(0.15, 0.05, 0.05);    // Scale for the handle
+	solidCube(1);
+	gfxPopMatrix();
+
+
+}
+
+#endif
+float rotationAngle = 0.0f;  // Direction player is facing
+
+float startPosX = posX;
+float startPosZ = posZ;
+
+// Poses the exercise clips are baked from when no clip file is found. They are
+// the motions the exercises used to compute every frame, with the root relative
+// to where the exercise puts the player.
+void restPose(JointPose* pose) {
+	for (int j = 0; j < JOINT_COUNT; j++) {
+		quatFromAxisAngle(0.0f, 1.0f, 0.0f, 0.0f, pose[j].rotation);
+		memcpy(pose[j].translation, jointBindPositions[j], sizeof(pose[j].translation));
+	}
+}
+
+void setJoint(JointPose* pose, int joint, float degrees, float x, float y, float z) {
+	quatFromAxisAngle(degrees, x, y, z, pose[joint].rotation);
+}
+
+void poseIdle(float, JointPose* pose) {  // Still; the time is there for bakeClip()
+	restPose(pose);
+}
+
+void poseWalk(float time, JointPose* pose) {
+	restPose(pose);
+	float swing = sin(time * 10.0f);
+	setJoint(pose, JOINT_LEFT_LEG, swing * 10.0f, 1.0f, 0.0f, 0.0f);  // Swing legs with sine wave
+	setJoint(pose, JOINT_RIGHT_LEG, -swing * 10.0f, 1.0f, 0.0f, 0.0f);
+	setJoint(pose, JOINT_LEFT_ARM, swing * 20.0f, 1.0f, 0.0f, 0.0f);
+	setJoint(pose, JOINT_RIGHT_ARM, -swing * 20.0f, 1.0f, 0.0f, 0.0f);
+}
+
+void poseChinUp(float time, JointPose* pose) {
+	const float chinUpDuration = 2.0f;   // Total time for the full up-and-down motion in seconds
+	const float startY = 0.1f, endY = 0.4f;
+	restPose(pose);
+	float progress = fmod(time, chinUpDuration) / chinUpDuration;
+	float y = startY + (endY - startY) * sin(progress * 3.14159f);  // Sine function for smooth up and down
+	pose[JOINT_ROOT].translation[1] = y - startY;
+	pose[JOINT_HEAD].translation[1] = 0.3f + y;
+	pose[JOINT_TORSO].translation[1] = y;
+	pose[JOINT_LEFT_ARM].translation[1] = pose[JOINT_RIGHT_ARM].translation[1] = 0.35f;
+	pose[JOINT_LEFT_LEG].translation[1] = pose[JOINT_RIGHT_LEG].translation[1] = -0.3f + y;
+	setJoint(pose, JOINT_LEFT_ARM, 135.0f, 1.0f, 0.0f, 0.0f);  // Gripping the bar
+}
+
+void poseBenchPress(float time, JointPose* pose) {
+	const float barLift = 0.15f;
+	restPose(pose);
+	setJoint(pose, JOINT_ROOT, -90.0f, 1.0f, 0.0f, 0.0f);  // Lying on the bench
+	if (time < 1.0f) {  // Reaching up for the bar
+		setJoint(pose, JOINT_LEFT_ARM, 180.0f, 1.0f, 0.0f, 0.0f);
+		setJoint(pose, JOINT_RIGHT_ARM, 180.0f, 1.0f, 0.0f, 0.0f);
+		return;
+	}
+	float z = 0.1f + barLift * sin(time * 3.14f);
+	for (int joint = JOINT_LEFT_ARM; joint <= JOINT_RIGHT_ARM; joint++) {
+		pose[joint].translation[1] = 0.25f;
+		pose[joint].translation[2] = z;
+		setJoint(pose, joint, 90.0f, 1.0f, 0.0f, 0.0f);
+	}
+}
+
+void poseTreadmill(float time, JointPose* pose) {
+	const float legSwingSpeed = 15.0f, runPeriod = 5.0f;
+	const float maxLegAngle = 45.0f, maxArmAngle = 30.0f, maxTorsoAngle = 10.0f;
+	restPose(pose);
+	float progress = fmod(time * legSwingSpeed, runPeriod) / runPeriod;
+	float angleFactor = sin(progress * 3.14159f * 2);
+	setJoint(pose, JOINT_LEFT_LEG, maxLegAngle * angleFactor, 1.0f, 0.0f, 0.0f);
+	setJoint(pose, JOINT_RIGHT_LEG, -maxLegAngle * angleFactor, 1.0f, 0.0f, 0.0f);
+	setJoint(pose, JOINT_LEFT_ARM, -maxArmAngle * angleFactor, 1.0f, 0.0f, 0.0f);
+	setJoint(pose, JOINT_RIGHT_ARM, maxArmAngle * angleFactor, 1.0f, 0.0f, 0.0f);
+	setJoint(pose, JOINT_TORSO, maxTorsoAngle * angleFactor, 0.0f, 1.0f, 0.0f);
+}
+
+void poseDeadlift(float time, JointPose* pose) {
+	const float bendDown = 5.0f, liftUp = 5.0f;  // Seconds
+	restPose(pose);
+	float armAngle, armY = 0.0f;
+	if (time <= bendDown) {
+		armAngle = 90.0f * time / bendDown;
+	}
+	else {
+		float progress = time <= bendDown + liftUp ? (time - bendDown) / liftUp : 1.0f;
+		armAngle = 90.0f + 90.0f * progress;
+		armY = 0.1f + 0.215f * progress;
+	}
+	for (int joint = JOINT_LEFT_ARM; joint <= JOINT_RIGHT_ARM; joint++) {
+		pose[joint].translation[1] = armY;
+		setJoint(pose, joint, armAngle, 1.0f, 0.0f, 0.0f);
+	}
+}
+
+void bakeAnimationClips() {
+	TraceScope trace("bake animation clips");
+	animationClips.clear();
+	animationClips.push_back(bakeClip("idle", 0.0f, -1.0f, poseIdle));
+	animationClips.push_back(bakeClip("walk", 2.0f * 3.14159265f / 10.0f, 0.0f, poseWalk));
+	animationClips.push_back(bakeClip("chin up", 2.0f, 0.0f, poseChinUp));
+	animationClips.push_back(bakeClip("bench press", 1.0f + 2.0f * 3.14159265f / 3.14f, 1.0f, poseBenchPress));
+	animationClips.push_back(bakeClip("treadmill", 1.0f / 3.0f, 0.0f, poseTreadmill));
+	animationClips.push_back(bakeClip("deadlift", 14.0f, -1.0f, poseDeadlift));
+}
+
+// Use the clip file next to the executable, or bake the clips and write it
+void initAnimationClips(const char* filename) {
+	if (loadAnimationClips(filename)) return;
+	bakeAnimationClips();
+	writeAnimationClips(filename);
+}
+
+AnimationController playerAnimation;
+
+
+#ifndef GYM_HEADLESS
+void drawPlayer() {
+	float skin[JOINT_COUNT][16];
+	computeSkinMatrices(frame.playerPose, skin);
+	gfxSkinnedMesh(playerMesh, skin);
+}
+#endif
+
+
+
+
+
+// Bounding box for the ChinUpDipMachine based on the dimensions from drawChinUpDipMachine()
+BoundingBox getChinUpDipMachineBoundingBox() {
+	BoundingBox box;
+	box.minX = -3.20f;
+	box.maxX = -2.70f;
+	box.minY = 0.0f;
+	box.maxY = 1.05f;
+	box.minZ = -0.35f;
+	box.maxZ = 0.35f;
+	return box;
+}
+BoundingBox getBenchPressBoundingBox() {
+	BoundingBox box;
+	box.minX = -3.20f;
+	box.maxX = -2.40f;
+	box.minY = 0.0f;
+	box.maxY = 1.05f;
+	box.minZ = -2.35f;
+	box.maxZ = -1.05f;
+	return box;
+}
+BoundingBox getSmithBoundingBox() {
+	BoundingBox box;
+	box.minX = -1.40f;
+	box.maxX = 0.0f;
+	box.minY = 0.0f;
+	box.maxY = 1.05f;
+	box.minZ = -3.2f;
+	box.maxZ = -2.8f;
+	return box;
+}
+
+BoundingBox getTreadMillBoundingBox() {
+	BoundingBox box;
+	box.minX = 1.0f;
+	box.maxX = 3.0f;
+	box.minY = 0.0f;
+	box.maxY = 1.05f;
+	box.minZ = -3.2f;
+	box.maxZ = -1.1f;
+	return box;
+}
+
+BoundingBox getDumbellRackBoundingBox() {
+	BoundingBox box;
+	box.minX = 1.5f;
+	box.maxX = 2.4f;
+	box.minY = 0.0f;
+	box.maxY = 1.05f;
+	box.minZ = -0.3f;
+	box.maxZ = 1.4f;
+	return box;
+}
+
+BoundingBox getDeadLiftBoundingBox() {
+	BoundingBox box;
+	box.minX = -1.5f;
+	box.maxX = 0.5f;
+	box.minY = 0.0f;
+	box.maxY = 1.05f;
+	box.minZ = -0.5f;
+	box.maxZ = 0.2f;
+	return box;
+}
+
+// Bounding box for the player based on their position and size
+BoundingBox getPlayerBoundingBox(float posX, float posY, float posZ) {
+	BoundingBox box;
+	float playerSize = 0.3f; // Adjust based on player size
+	box.minX = posX - playerSize / 2;
+	box.maxX = posX + playerSize / 2;
+	box.minY = posY;
+	box.maxY = posY + playerSize; // Adjust for player height
+	box.minZ = posZ - playerSize / 2;
+	box.maxZ = posZ + playerSize / 2;
+	return box;
+}
+
+bool checkCollisionChinUp = false;
+bool checkCollisionDeadLift = false;
+bool checkCollisionBenchPress = false;
+bool checkCollisionSmith = false;
+bool checkCollisionTreadMill = false;
+bool checkCollisionDumbellRack = false;
+
+bool checkCollision(const BoundingBox& box1, const BoundingBox& box2) {
+	return (box1.minX <= box2.maxX && box1.maxX >= box2.minX) &&
+		(box1.minY <= box2.maxY && box1.maxY >= box2.minY) &&
+		(box1.minZ <= box2.maxZ && box1.maxZ >= box2.minZ);
+}
+
+BoundingBox chinUpMachineBox = getChinUpDipMachineBoundingBox();
+BoundingBox BenchPressBox = getBenchPressBoundingBox();
+BoundingBox SmithBox = getSmithBoundingBox();
+BoundingBox TreadMillBox = getTreadMillBoundingBox();
+BoundingBox DumbellRackBox = getDumbellRackBoundingBox();
+BoundingBox DeadLiftBox = getDeadLiftBoundingBox();
+
+const float ROOM_MIN_X = -3.2f, ROOM_MAX_X = 2.2f, ROOM_MIN_Z = -3.2f, ROOM_MAX_Z = 1.9f;
+
+// Interaction zones. Every machine has a solid box that stops the player and a
+// trigger volume reaching TRIGGER_MARGIN past it where 'e' works; the deadlift bar is
+// only a trigger. Both live in one grid over the room, built once, where each cell
+// has a bit for every machine whose solid or trigger a body centred in the cell can
+// touch. A move only tests the machines its cell lists, and enter and leave events
+// come from comparing the triggers the body is in with the ones it was in.
+const float TRIGGER_MARGIN = 0.15f;  // A step of slack around the machine
+const float PLAYER_HALF_WIDTH = 0.15f;
+const float ZONE_CELL = 0.5f;
+const int ZONE_GRID_X = (int)((ROOM_MAX_X - ROOM_MIN_X) / ZONE_CELL) + 1;
+const int ZONE_GRID_Z = (int)((ROOM_MAX_Z - ROOM_MIN_Z) / ZONE_CELL) + 1;
+
+// GymMachine order
+struct MachineZone {
+	const BoundingBox* box;
+	bool* touching;  // The player is in the trigger
+	bool solid;
+};
+
+const MachineZone machineZones[MACHINE_COUNT] = {
+	{ &chinUpMachineBox, &checkCollisionChinUp, true },
+	{ &BenchPressBox, &checkCollisionBenchPress, true },
+	{ &TreadMillBox, &checkCollisionTreadMill, true },
+	{ &DumbellRackBox, &checkCollisionDumbellRack, true },
+	{ &SmithBox, &checkCollisionSmith, true },
+	{ &DeadLiftBox, &checkCollisionDeadLift, false },
+};
+
+unsigned int zoneSolids[ZONE_GRID_X * ZONE_GRID_Z];    // Machine bits per cell
+unsigned int zoneTriggers[ZONE_GRID_X * ZONE_GRID_Z];
+
+inline int zoneCell(float x, float z) {
+	int cx = (int)((x - ROOM_MIN_X) / ZONE_CELL);
+	int cz = (int)((z - ROOM_MIN_Z) / ZONE_CELL);
+	cx = cx < 0 ? 0 : (cx >= ZONE_GRID_X ? ZONE_GRID_X - 1 : cx);
+	cz = cz < 0 ? 0 : (cz >= ZONE_GRID_Z ? ZONE_GRID_Z - 1 : cz);
+	return cz * ZONE_GRID_X + cx;
+}
+
+// The box grown by reach on every side of the floor
+BoundingBox grownBox(const BoundingBox& box, float reach) {
+	BoundingBox grown = box;
+	grown.minX -= reach;
+	grown.maxX += reach;
+	grown.minZ -= reach;
+	grown.maxZ += reach;
+	return grown;
+}
+
+void initZones() {
+	for (int c = 0; c < ZONE_GRID_X * ZONE_GRID_Z; c++) {
+		// Every body centred in the cell, clamped like zoneCell() does at the walls
+		int cx = c % ZONE_GRID_X, cz = c / ZONE_GRID_X;
+		BoundingBox cell;
+		cell.minX = cx == 0 ? -1e30f : ROOM_MIN_X + cx * ZONE_CELL;
+		cell.maxX = cx == ZONE_GRID_X - 1 ? 1e30f : ROOM_MIN_X + (cx + 1) * ZONE_CELL;
+		cell.minZ = cz == 0 ? -1e30f : ROOM_MIN_Z + cz * ZONE_CELL;
+		cell.maxZ = cz == ZONE_GRID_Z - 1 ? 1e30f : ROOM_MIN_Z + (cz + 1) * ZONE_CELL;
+		cell.minY = 0.0f;
+		cell.maxY = 0.0f;
+		zoneSolids[c] = zoneTriggers[c] = 0;
+		for (int m = 0; m < MACHINE_COUNT; m++) {
+			const BoundingBox& box = *machineZones[m].box;
+			if (machineZones[m].solid && checkCollision(cell, grownBox(box, PLAYER_HALF_WIDTH))) zoneSolids[c] |= 1u << m;
+			if (checkCollision(cell, grownBox(box, PLAYER_HALF_WIDTH + TRIGGER_MARGIN))) zoneTriggers[c] |= 1u << m;
+		}
+	}
+}
+
+bool inTrigger(const BoundingBox& machine, float x, float z) {
+	return checkCollision(grownBox(getPlayerBoundingBox(x, 0.0f, z), TRIGGER_MARGIN), machine);
+}
+
+// Machines whose solid box a body at x, z would run into, as bits
+unsigned int solidsHit(float x, float z) {
+	unsigned int candidates = zoneSolids[zoneCell(x, z)], hit = 0;
+	BoundingBox body = getPlayerBoundingBox(x, 0.0f, z);
+	for (int m = 0; candidates >> m; m++) {
+		if ((candidates >> m & 1) && checkCollision(body, *machineZones[m].box)) hit |= 1u << m;
+	}
+	return hit;
+}
+
+// Machines whose trigger a body at x, z is in, as bits
+unsigned int triggersAt(float x, float z) {
+	unsigned int candidates = zoneTriggers[zoneCell(x, z)], inside = 0;
+	for (int m = 0; candidates >> m; m++) {
+		if ((candidates >> m & 1) && inTrigger(*machineZones[m].box, x, z)) inside |= 1u << m;
+	}
+	return inside;
+}
+
+// Bring the player's collision flags up to date after a move and post what changed
+void updateMachineZones() {
+	unsigned int inside = triggersAt(posX, posZ);
+	for (int m = 0; m < MACHINE_COUNT; m++) {
+		bool touching = (inside >> m & 1) != 0;
+		if (touching != *machineZones[m].touching) {
+			gymEvents.post(touching ? EVENT_ENTER_MACHINE_ZONE : EVENT_LEAVE_MACHINE_ZONE, m);
+			*machineZones[m].touching = touching;
+		}
+	}
+}
+
+// Character controller. The arrow keys only say which way the player wants to go;
+// every simulation tick the velocity eases towards that at WALK_ACCELERATION and the
+// body moves by it, keeping the part of a move that runs along a wall or machine.
+// The velocity depends on nothing but the keys, so the same keys from the same
+// place always end in the same place: the server and the client's prediction rely on it.
+const float WALK_SPEED = 1.5f;         // Metres per second with a key held
+const float WALK_ACCELERATION = 8.0f;  // Also how fast the player stops
+const float WALK_CLIP_SPEED = 1.0f;    // Pace the walk clip's stride was made for
+
+enum ArrowKey { ARROW_LEFT = 1, ARROW_RIGHT = 2, ARROW_UP = 4, ARROW_DOWN = 8 };
+
+struct CharacterMotion {
+	float vx, vz;  // Metres per second
+	float moved;   // Metres covered in the last tick; drives the walk clip
+};
+
+CharacterMotion playerMotion = { 0.0f, 0.0f, 0.0f };
+unsigned char playerKeys = 0;  // ArrowKey bits held down
+
+unsigned char arrowBit(int key) {
+	switch (key) {
+	case GLUT_KEY_LEFT: return ARROW_LEFT;
+	case GLUT_KEY_RIGHT: return ARROW_RIGHT;
+	case GLUT_KEY_UP: return ARROW_UP;
+	case GLUT_KEY_DOWN: return ARROW_DOWN;
+	default: return 0;
+	}
+}
+
+// One tick of walking with the keys held; returns the distance covered
+float moveCharacter(float& x, float& z, float& heading, CharacterMotion& motion, unsigned char keys, float dt) {
+	float wantX = (float)((keys & ARROW_RIGHT) != 0) - (float)((keys & ARROW_LEFT) != 0);
+	float wantZ = (float)((keys & ARROW_DOWN) != 0) - (float)((keys & ARROW_UP) != 0);
+	float length = sqrt(wantX * wantX + wantZ * wantZ);
+	if (length > 0.0f) {
+		heading = atan2(wantX, -wantZ) * 57.29578f;  // Face where the keys point
+		wantX *= WALK_SPEED / length;
+		wantZ *= WALK_SPEED / length;
+	}
+	float dvx = wantX - motion.vx, dvz = wantZ - motion.vz;
+	float change = sqrt(dvx * dvx + dvz * dvz), most = WALK_ACCELERATION * dt;
+	if (change > most) {
+		dvx *= most / change;
+		dvz *= most / change;
+	}
+	motion.vx += dvx;
+	motion.vz += dvz;
+
+	float nx = x + motion.vx * dt, nz = z + motion.vz * dt;
+	nx = nx < ROOM_MIN_X ? ROOM_MIN_X : (nx > ROOM_MAX_X ? ROOM_MAX_X : nx);
+	nz = nz < ROOM_MIN_Z ? ROOM_MIN_Z : (nz > ROOM_MAX_Z ? ROOM_MAX_Z : nz);
+	float fromX = x, fromZ = z;
+	if (!solidsHit(nx, nz)) {
+		x = nx;
+		z = nz;
+	}
+	else if (!solidsHit(nx, z)) {  // Slide along the machine
+		x = nx;
+	}
+	else if (!solidsHit(x, nz)) {
+		z = nz;
+	}
+	return sqrt((x - fromX) * (x - fromX) + (z - fromZ) * (z - fromZ));
+}
+
+// Key down or up. A held key repeats on most systems; that changes nothing here.
+void handleSpecialKeyboard(int key, bool down) {
+	if (down) playerKeys |= arrowBit(key);
+	else playerKeys &= ~arrowBit(key);
+}
+
+
+
+bool isAnimatingChinUp = false;
+float startPosY = 0.1f;        // Starting position of the player
+
+
+
+// Count the machine as used and tell the subscribers whether this was the first time
+void startedExercise(int machine, bool& used) {
+	gymEvents.post(EVENT_START_EXERCISE, machine, used ? 0.0f : 1.0f);
+	used = true;
+}
+
+void startChinUpAnimation() {
+	isAnimatingChinUp = true;
+	PosY = startPosY;      // Start at the initial position
+	rotationAngle = -90;
+	playerAnimation.playExercise(CLIP_CHIN_UP);
+}
+
+void updateChinUpAnimation() {
+	if (isAnimatingChinUp) {
+		posX = -2.8f;  // Hold the player under the bar
+		posZ = 0.0f;
+	}
+}
+void startBenchPressAnimation() {
+	isAnimatingBenchPress = true;
+	benchPressAnimationTime = 0.0f;
+	rotationAngle = 90.0f;
+	playerAnimation.playExercise(CLIP_BENCH_PRESS);
+}
+
+
+void updateBenchPressAnimation(float deltaTime) {
+	if (isAnimatingBenchPress) {
+		benchPressAnimationTime += deltaTime;
+
+		// Phase 1: Move the player to a seated position on the bench
+		if (benchPressAnimationTime < benchPressDuration / 3) {
+			posX = -2.7f;
+			posZ = -1.75f;
+			PosY = -0.1f;
+		}
+		else {
+			// Phase 2: lift or lower the bar with the arms of the clip
+			barPosY = 0.7f + barLiftAmount * sin(benchPressAnimationTime * 3.14f);
+		}
+	}
+}
+float smithStepTime = 0.0f;    // Milliseconds since the last animation step
+
+void stepSmithAnimation() {
+
+	switch (animationStep) {
+	case 0:  // Scaling up
+		scaleFactor += 0.05f;
+		for (int i = 0; i < 3; i++) {
+			color[i] = originalColor[i] + (maxColor[i] - originalColor[i]) * (scaleFactor - 1) / (targetScale - 1);
+		}
+		if (scaleFactor >= targetScale) {
+			scaleFactor = targetScale;
+			animationStep = 1;  // Move to hold phase
+		}
+		break;
+
+	case 1:  // Hold at maximum size and color
+		// Remain in this state indefinitely until 'P' key is pressed
+		break;
+
+	case 2:  // Scaling down
+		scaleFactor -= 0.05f;
+		for (int i = 0; i < 3; i++) {
+			color[i] = maxColor[i] - (maxColor[i] - originalColor[i]) * (targetScale - scaleFactor) / (targetScale - 1);
+		}
+		if (scaleFactor <= 1.0f) {
+			scaleFactor = 1.0f;
+			animationStep = 3;  // Move to reset phase
+		}
+		break;
+
+	case 3:  // Reset to original color and stop animation
+		for (int i = 0; i < 3; i++) {
+			color[i] = originalColor[i];
+		}
+		isAnimatingSmith = false;
+		animationStep = 0;
+		gymEvents.post(EVENT_STOP_EXERCISE, MACHINE_SMITH);
+		break;
+	}
+}
+
+// Take one animation step every animationSpeed milliseconds
+void updateSmithAnimation(float deltaTime) {
+	smithStepTime += deltaTime * 1000.0f;
+	while (isAnimatingSmith && smithStepTime >= animationSpeed) {
+		smithStepTime -= animationSpeed;
+		stepSmithAnimation();
+	}
+}
+
+
+
+bool isAnimatingTreadmill = false;
+
+// Start the treadmill animation
+void startTreadmillAnimation() {
+	isAnimatingTreadmill = true;
+	posX = 1.7f;                    // Set position on treadmill
+	PosY = 0.1f;
+	posZ = -1.5f;
+	rotationAngle = 90.0f;         // Face the treadmill
+	playerAnimation.playExercise(CLIP_TREADMILL);
+}
+
+bool isColorChanging = false;  // Flag to toggle color-changing animation
+float colorChangeTime = 0.0f;  // Timer to track color change progress
+
+
+void updateDumbbellColor(float deltaTime) {
+	if (isColorChanging) {
+		colorChangeTime += deltaTime;  // Increase the timer based on deltaTime
+
+		// Create oscillating RGB values with sine functions for smooth color transitions
+		dumbbellColor[0] = 0.1f + 0.5f * sin(colorChangeTime * 2.0f);
+		dumbbellColor[1] = 0.1f + 0.5f * sin(colorChangeTime * 2.5f);
+		dumbbellColor[2] = 0.1f + 0.5f * sin(colorChangeTime * 3.0f);
+
+	}
+	else {
+		dumbbellColor[0] = 0.1f;
+		dumbbellColor[1] = 0.1f;
+		dumbbellColor[2] = 0.1f;
+	}
+}
+
+
+
+float deadliftRotationAngle = 0.0f;
+float dumbellRackRotationAngle = 0.0f;
+
+float holdingPhaseCameraAngle = 0.0f; // Angle for rotating camera
+const float holdingCameraSpeed = 0.3f; // Adjust speed of rotation as needed
+
+
+bool isLifting = false;
+float deadliftAnimationTime = 0.0f;
+
+
+
+// Constants for timing each animation phase
+const float bendDownDuration = 5.0f; // seconds
+const float liftUpDuration = 5.0f;   // seconds
+const float holdUpDuration = 4.0f;     // seconds
+
+void startDeadliftAnimation() {
+	isLifting = true;
+	deadliftAnimationTime = 0.0f;
+	barHeight = 0.0f;
+	playerAnimation.playExercise(CLIP_DEADLIFT);
+}
+
+void updateDeadliftAnimation(float deltaTime) {
+	if (isLifting) {
+		deadliftAnimationTime += deltaTime;
+		deadliftRotationAngle = 0.0f;
+
+		if (deadliftAnimationTime <= bendDownDuration) {  // Bending down phase
+			float progress = deadliftAnimationTime / bendDownDuration;
+			posX = -0.5f;
+			posZ = -0.29f;
+			rotationAngle = 180;
+			barHeight = 0.1f * progress;
+		}
+		else if (deadliftAnimationTime <= bendDownDuration + liftUpDuration) {  // Lifting up phase
+			camera.setSideLiftView();  // Set camera for side view during lift
+			float progress = (deadliftAnimationTime - bendDownDuration) / liftUpDuration;
+			barHeight = 0.1f + 0.415f * progress;
+		}
+		else if (deadliftAnimationTime <= bendDownDuration + liftUpDuration + holdUpDuration) {  // Holding phase
+			holdingPhaseCameraAngle += holdingCameraSpeed * deltaTime;
+
+			// Calculate the new camera position in a circular path around the player
+			float radius = 2.5f; // Radius of the camera circle
+			camera.eye.x = radius * cos(holdingPhaseCameraAngle) + 2.0f;  // X position
+			camera.eye.z = radius * sin(holdingPhaseCameraAngle) + 2.0f;  // Z position
+			camera.eye.y = 3.5f - radius * sin(holdingPhaseCameraAngle);
+			barHeight = 0.57f;
+		}
+		else {
+			isLifting = false;  // End animation
+			barHeight = -0.2f;
+			playerAnimation.stopExercise();
+			gameState = WIN;
+			gymEvents.post(EVENT_STOP_EXERCISE, MACHINE_DEADLIFT);
+			gymEvents.post(EVENT_GAME_WON);
+		}
+	}
+}
+
+
+// Crowd mode: autonomous gym-goers that walk to a free machine, reserve it, do
+// the exercise and move on. Agents live in the player's coordinates and are
+// updated in parallel on the simulation workers; each job only writes its own
+// agent, reads the positions from the start of the tick and reserves machines
+// with a compare-and-swap.
+struct GymStation {
+	const char* name;
+	int clip;
+	float spotX, spotY, spotZ, heading;  // Where the exercise puts the body
+	float approachX, approachZ;          // Free floor next to the machine
+	float duration;                      // Seconds of exercise
+	const BoundingBox* box;
+};
+
+const GymStation gymStations[] = {
+	{ "chin up", CLIP_CHIN_UP, -2.8f, 0.1f, 0.0f, -90.0f, -2.45f, 0.0f, 6.0f, &chinUpMachineBox },
+	{ "bench press", CLIP_BENCH_PRESS, -2.7f, -0.1f, -1.75f, 90.0f, -2.15f, -1.75f, 8.0f, &BenchPressBox },
+	{ "treadmill 1", CLIP_TREADMILL, 1.7f, 0.1f, -3.1f, 90.0f, 0.75f, -3.0f, 10.0f, &TreadMillBox },
+	{ "treadmill 2", CLIP_TREADMILL, 1.7f, 0.1f, -2.3f, 90.0f, 0.75f, -2.3f, 10.0f, &TreadMillBox },
+	{ "treadmill 3", CLIP_TREADMILL, 1.7f, 0.1f, -1.5f, 90.0f, 0.75f, -1.5f, 10.0f, &TreadMillBox },
+	{ "deadlift", CLIP_DEADLIFT, -0.5f, 0.1f, -0.29f, 180.0f, -0.5f, 0.45f, 14.0f, &DeadLiftBox },
+};
+const int STATION_COUNT = sizeof(gymStations) / sizeof(gymStations[0]);
+std::atomic<int> stationReservations[STATION_COUNT];  // Agent using each station, -1 when free
+
+// The Smith machine grows while it is in use, so its footprint is tracked separately
+BoundingBox smithFootprint = SmithBox;
+const BoundingBox* const gymObstacles[] = { &chinUpMachineBox, &BenchPressBox, &smithFootprint, &TreadMillBox, &DumbellRackBox, &DeadLiftBox };
+
+bool blockedByEquipment(float x, float z) {
+	BoundingBox body = getPlayerBoundingBox(x, 0.0f, z);
+	for (size_t i = 0; i < sizeof(gymObstacles) / sizeof(gymObstacles[0]); i++) {
+		if (checkCollision(body, *gymObstacles[i])) return true;
+	}
+	return false;
+}
+
+// Navigation. The floor is rasterized into cells that are blocked wherever a body
+// would touch a machine. Each station gets a flow field pointing every cell at its
+// cheapest neighbour towards the machine, built once and shared by everyone heading
+// there; one-off trips like a click on the floor use A* instead.
+const float NAV_CELL = 0.1f;
+const int NAV_GRID_X = 55;  // Cell centers from ROOM_MIN_X to ROOM_MAX_X
+const int NAV_GRID_Z = 52;
+const int NAV_CELLS = NAV_GRID_X * NAV_GRID_Z;
+const float NAV_UNREACHABLE = 1e30f;
+
+unsigned char navBlocked[NAV_CELLS];
+
+// Neighbour offsets and step lengths, straight ones first
+const int navStepX[8] = { 1, -1, 0, 0, 1, 1, -1, -1 };
+const int navStepZ[8] = { 0, 0, 1, -1, 1, -1, 1, -1 };
+const float navStepCost[8] = { 1.0f, 1.0f, 1.0f, 1.0f, 1.41421f, 1.41421f, 1.41421f, 1.41421f };
+
+struct FlowField {
+	float goalX, goalZ;
+	bool valid;
+	std::vector<float> cost;       // Distance to the goal in cells
+	std::vector<float> direction;  // x, z per cell towards the next cell, zero at the goal
+};
+
+FlowField stationFlow[STATION_COUNT];
+
+inline int navCellX(float x) {
+	int cx = (int)((x - ROOM_MIN_X) / NAV_CELL + 0.5f);
+	return cx < 0 ? 0 : (cx >= NAV_GRID_X ? NAV_GRID_X - 1 : cx);
+}
+
+inline int navCellZ(float z) {
+	int cz = (int)((z - ROOM_MIN_Z) / NAV_CELL + 0.5f);
+	return cz < 0 ? 0 : (cz >= NAV_GRID_Z ? NAV_GRID_Z - 1 : cz);
+}
+
+inline int navCell(float x, float z) {
+	return navCellZ(z) * NAV_GRID_X + navCellX(x);
+}
+
+inline float navCenterX(int cell) { return ROOM_MIN_X + (cell % NAV_GRID_X) * NAV_CELL; }
+inline float navCenterZ(int cell) { return ROOM_MIN_Z + (cell / NAV_GRID_X) * NAV_CELL; }
+
+// The cell one step in direction d, or -1 off the grid, into a machine or cutting a corner
+int navNeighbour(int cell, int d) {
+	int x = cell % NAV_GRID_X + navStepX[d], z = cell / NAV_GRID_X + navStepZ[d];
+	if (x < 0 || z < 0 || x >= NAV_GRID_X || z >= NAV_GRID_Z) return -1;
+	int next = z * NAV_GRID_X + x;
+	if (navBlocked[next]) return -1;
+	if (d >= 4 && (navBlocked[cell / NAV_GRID_X * NAV_GRID_X + x] || navBlocked[z * NAV_GRID_X + cell % NAV_GRID_X])) return -1;
+	return next;
+}
+
+// Closest free cell, for goals that were clicked inside a machine
+int navNearestFree(int cell) {
+	if (!navBlocked[cell]) return cell;
+	int cx = cell % NAV_GRID_X, cz = cell / NAV_GRID_X;
+	for (int r = 1; r < NAV_GRID_X; r++) {
+		int best = -1, bestDistance = 0;
+		for (int z = cz - r; z <= cz + r; z++) {
+			for (int x = cx - r; x <= cx + r; x++) {
+				if (x < 0 || z < 0 || x >= NAV_GRID_X || z >= NAV_GRID_Z) continue;
+				if (abs(x - cx) != r && abs(z - cz) != r) continue;  // Ring only
+				int distance = (x - cx) * (x - cx) + (z - cz) * (z - cz);
+				if (!navBlocked[z * NAV_GRID_X + x] && (best < 0 || distance < bestDistance)) {
+					best = z * NAV_GRID_X + x;
+					bestDistance = distance;
+				}
+			}
+		}
+		if (best >= 0) return best;
+	}
+	return cell;
+}
+
+typedef std::pair<float, int> NavQueueEntry;  // Cost, cell
+
+// Dijkstra outwards from the goal, then point every cell at its cheapest neighbour
+void buildFlowField(FlowField& field) {
+	TraceScope trace("flow field");
+	field.cost.assign(NAV_CELLS, NAV_UNREACHABLE);
+	field.direction.assign(2 * NAV_CELLS, 0.0f);
+	int goal = navNearestFree(navCell(field.goalX, field.goalZ));
+	std::priority_queue<NavQueueEntry, std::vector<NavQueueEntry>, std::greater<NavQueueEntry> > open;
+	field.cost[goal] = 0.0f;
+	open.push(NavQueueEntry(0.0f, goal));
+	while (!open.empty()) {
+		NavQueueEntry top = open.top();
+		open.pop();
+		if (top.first > field.cost[top.second]) continue;  // Stale entry
+		for (int d = 0; d < 8; d++) {
+			int next = navNeighbour(top.second, d);
+			if (next < 0) continue;
+			float cost = top.first + navStepCost[d];
+			if (cost < field.cost[next]) {
+				field.cost[next] = cost;
+				open.push(NavQueueEntry(cost, next));
+			}
+		}
+	}
+	for (int cell = 0; cell < NAV_CELLS; cell++) {
+		if (field.cost[cell] == NAV_UNREACHABLE || cell == goal) continue;
+		int best = -1;
+		float bestCost = field.cost[cell];
+		for (int d = 0; d < 8; d++) {
+			int next = navNeighbour(cell, d);
+			if (next >= 0 && field.cost[next] < bestCost) {
+				best = d;
+				bestCost = field.cost[next];
+			}
+		}
+		if (best < 0) continue;
+		float length = navStepCost[best];
+		field.direction[2 * cell] = navStepX[best] / length;
+		field.direction[2 * cell + 1] = navStepZ[best] / length;
+	}
+	field.valid = true;
+}
+
+// Recompute the cells inside a rectangle of the floor. A flow field only goes stale
+// when a cell that flipped touches the part of the floor it reaches.
+void navRasterize(float minX, float maxX, float minZ, float maxZ) {
+	int x0 = navCellX(minX), x1 = navCellX(maxX), z0 = navCellZ(minZ), z1 = navCellZ(maxZ);
+	for (int z = z0; z <= z1; z++) {
+		for (int x = x0; x <= x1; x++) {
+			int cell = z * NAV_GRID_X + x;
+			unsigned char blocked = blockedByEquipment(navCenterX(cell), navCenterZ(cell)) ? 1 : 0;
+			if (blocked == navBlocked[cell]) continue;
+			navBlocked[cell] = blocked;
+			for (int s = 0; s < STATION_COUNT; s++) {
+				FlowField& field = stationFlow[s];
+				if (!field.valid) continue;
+				for (int d = -1; d < 8 && field.valid; d++) {
+					int nx = x + (d < 0 ? 0 : navStepX[d]), nz = z + (d < 0 ? 0 : navStepZ[d]);
+					if (nx < 0 || nz < 0 || nx >= NAV_GRID_X || nz >= NAV_GRID_Z) continue;
+					if (field.cost[nz * NAV_GRID_X + nx] != NAV_UNREACHABLE) field.valid = false;
+				}
+			}
+		}
+	}
+}
+
+void initNavigation() {
+	memset(navBlocked, 0, sizeof(navBlocked));
+	for (int s = 0; s < STATION_COUNT; s++) {
+		stationFlow[s].goalX = gymStations[s].approachX;
+		stationFlow[s].goalZ = gymStations[s].approachZ;
+		stationFlow[s].valid = false;
+	}
+	navRasterize(ROOM_MIN_X, ROOM_MAX_X, ROOM_MIN_Z, ROOM_MAX_Z);
+}
+
+// Follow the Smith machine's scale and rebuild the flow fields it made stale. Runs on
+// the simulation thread before any agent reads a field.
+void updateNavigation() {
+	BoundingBox footprint = SmithBox;
+	float halfX = (SmithBox.maxX - SmithBox.minX) * 0.5f * scaleFactor;
+	float halfZ = (SmithBox.maxZ - SmithBox.minZ) * 0.5f * scaleFactor;
+	float centerX = (SmithBox.minX + SmithBox.maxX) * 0.5f, centerZ = (SmithBox.minZ + SmithBox.maxZ) * 0.5f;
+	footprint.minX = centerX - halfX;
+	footprint.maxX = centerX + halfX;
+	footprint.minZ = centerZ - halfZ;
+	footprint.maxZ = centerZ + halfZ;
+	if (footprint.minX != smithFootprint.minX || footprint.maxX != smithFootprint.maxX ||
+		footprint.minZ != smithFootprint.minZ || footprint.maxZ != smithFootprint.maxZ) {
+		BoundingBox old = smithFootprint;
+		smithFootprint = footprint;
+		const float margin = 0.2f;  // Body half width and a cell
+		navRasterize((old.minX < footprint.minX ? old.minX : footprint.minX) - margin,
+			(old.maxX > footprint.maxX ? old.maxX : footprint.maxX) + margin,
+			(old.minZ < footprint.minZ ? old.minZ : footprint.minZ) - margin,
+			(old.maxZ > footprint.maxZ ? old.maxZ : footprint.maxZ) + margin);
+	}
+	for (int s = 0; s < STATION_COUNT; s++) {
+		if (!stationFlow[s].valid) buildFlowField(stationFlow[s]);
+	}
+}
+
+// Direction to walk from (x, z), straight at the goal once in its cell
+void flowDirection(const FlowField& field, float x, float z, float& dirX, float& dirZ) {
+	int cell = navCell(x, z);
+	dirX = field.direction[2 * cell];
+	dirZ = field.direction[2 * cell + 1];
+	if (dirX == 0.0f && dirZ == 0.0f) {
+		float dx = field.goalX - x, dz = field.goalZ - z;
+		float distance = sqrt(dx * dx + dz * dz);
+		if (distance > 1e-4f) {
+			dirX = dx / distance;
+			dirZ = dz / distance;
+		}
+	}
+}
+
+// A* over the grid with the octile distance as heuristic. Fills path with x, z
+// waypoints at the corners of the route, ending at the goal.
+bool navFindPath(float fromX, float fromZ, float toX, float toZ, std::vector<float>& path) {
+	TraceScope trace("path search");
+	static std::vector<float> cost;
+	static std::vector<int> parent;
+	cost.assign(NAV_CELLS, NAV_UNREACHABLE);
+	parent.assign(NAV_CELLS, -1);
+	int start = navNearestFree(navCell(fromX, fromZ));
+	int goal = navNearestFree(navCell(toX, toZ));
+	int goalX = goal % NAV_GRID_X, goalZ = goal / NAV_GRID_X;
+	std::priority_queue<NavQueueEntry, std::vector<NavQueueEntry>, std::greater<NavQueueEntry> > open;
+	cost[start] = 0.0f;
+	open.push(NavQueueEntry(0.0f, start));
+	while (!open.empty()) {
+		int cell = open.top().second;
+		open.pop();
+		if (cell == goal) break;
+		for (int d = 0; d < 8; d++) {
+			int next = navNeighbour(cell, d);
+			if (next < 0) continue;
+			float g = cost[cell] + navStepCost[d];
+			if (g >= cost[next]) continue;
+			cost[next] = g;
+			parent[next] = cell;
+			int dx = abs(next % NAV_GRID_X - goalX), dz = abs(next / NAV_GRID_X - goalZ);
+			float h = (float)(dx > dz ? dx : dz) + 0.41421f * (dx < dz ? dx : dz);
+			open.push(NavQueueEntry(g + h, next));
+		}
+	}
+	path.clear();
+	if (cost[goal] == NAV_UNREACHABLE) return false;
+
+	// Walk back from the goal, keeping only the cells where the route turns
+	std::vector<int> cells;
+	for (int cell = goal; cell >= 0; cell = parent[cell]) cells.push_back(cell);
+	for (int k = (int)cells.size() - 2; k > 0; k--) {
+		int prev = cells[k + 1], cell = cells[k], next = cells[k - 1];
+		if (cell - prev != next - cell) {
+			path.push_back(navCenterX(cell));
+			path.push_back(navCenterZ(cell));
+		}
+	}
+	if (navBlocked[navCell(toX, toZ)]) {  // Stop at the edge of the machine
+		path.push_back(navCenterX(goal));
+		path.push_back(navCenterZ(goal));
+	}
+	else {
+		path.push_back(toX);
+		path.push_back(toZ);
+	}
+	return true;
+}
+
+enum AgentTask { AGENT_CHOOSING, AGENT_WALKING, AGENT_EXERCISING };
+
+struct CrowdAgent {
+	float x, y, z, heading;
+	AgentTask task;
+	int station;
+	float timer;               // Seconds left exercising, waiting or detouring
+	float detourX, detourZ;    // Direction to try while stuck
+	unsigned int random;
+};
+
+int crowdSize = 200;  // Agents spawned by 'm' or -crowd N
+std::vector<CrowdAgent> crowdAgents;
+std::vector<AnimationController> crowdAnimation;  // Parallel to crowdAgents
+std::vector<float> crowdPositions;                // x, z per agent at the start of the tick
+
+// Uniform grid over the room for finding neighbours, rebuilt every tick
+const float CROWD_CELL = 0.5f;
+const int CROWD_GRID_X = (int)((ROOM_MAX_X - ROOM_MIN_X) / CROWD_CELL) + 1;
+const int CROWD_GRID_Z = (int)((ROOM_MAX_Z - ROOM_MIN_Z) / CROWD_CELL) + 1;
+std::vector<int> crowdCellStart;  // Agents of cell c are crowdCellAgents[crowdCellStart[c] .. crowdCellStart[c + 1])
+std::vector<int> crowdCellAgents;
+
+inline float crowdRandom(unsigned int& state) {  // xorshift, 0..1
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return (state & 0xFFFFFF) / 16777216.0f;
+}
+
+inline int crowdCell(float x, float z) {
+	int cx = (int)((x - ROOM_MIN_X) / CROWD_CELL);
+	int cz = (int)((z - ROOM_MIN_Z) / CROWD_CELL);
+	cx = cx < 0 ? 0 : (cx >= CROWD_GRID_X ? CROWD_GRID_X - 1 : cx);
+	cz = cz < 0 ? 0 : (cz >= CROWD_GRID_Z ? CROWD_GRID_Z - 1 : cz);
+	return cz * CROWD_GRID_X + cx;
+}
+
+void releaseStation(int agent) {
+	int station = crowdAgents[agent].station;
+	if (station >= 0) {
+		stationReservations[station].store(-1);
+		crowdAgents[agent].station = -1;
+	}
+}
+
+void spawnCrowd(int count) {
+	for (int s = 0; s < STATION_COUNT; s++) stationReservations[s].store(-1);
+	crowdAgents.resize(count);
+	crowdAnimation.assign(count, AnimationController());
+	crowdPositions.resize(2 * count);
+	unsigned int seed = 12345;
+	for (int i = 0; i < count; i++) {
+		CrowdAgent& agent = crowdAgents[i];
+		do {  // Anywhere on the free floor
+			agent.x = ROOM_MIN_X + 0.2f + crowdRandom(seed) * (ROOM_MAX_X - ROOM_MIN_X - 0.4f);
+			agent.z = ROOM_MIN_Z + 0.2f + crowdRandom(seed) * (ROOM_MAX_Z - ROOM_MIN_Z - 0.4f);
+		} while (blockedByEquipment(agent.x, agent.z));
+		agent.y = 0.1f;
+		agent.heading = crowdRandom(seed) * 360.0f;
+		agent.task = AGENT_CHOOSING;
+		agent.station = -1;
+		agent.timer = crowdRandom(seed) * 2.0f;  // Don't all rush at once
+		agent.random = seed | 1;
+	}
+}
+
+void clearCrowd() {
+	crowdAgents.clear();
+	crowdAnimation.clear();
+	crowdPositions.clear();
+}
+
+void toggleCrowd() {
+	if (crowdAgents.empty()) spawnCrowd(crowdSize);
+	else clearCrowd();
+}
+
+// Reserve a free machine. Runs serially in agent order before the parallel update, so
+// which agent wins a machine doesn't depend on thread timing and replays stay exact.
+void chooseStation(int i) {
+	CrowdAgent& agent = crowdAgents[i];
+	int first = (int)(crowdRandom(agent.random) * STATION_COUNT);
+	for (int k = 0; k < STATION_COUNT; k++) {
+		int station = (first + k) % STATION_COUNT;
+		int expected = -1;
+		if (stationReservations[station].compare_exchange_strong(expected, i)) {
+			agent.station = station;
+			agent.task = AGENT_WALKING;
+			agent.timer = 0.0f;
+			return;
+		}
+	}
+	agent.timer = 1.0f + crowdRandom(agent.random);  // All taken, look again later
+}
+
+void updateCrowdAgent(int i, float deltaTime) {
+	const float speed = 1.0f, radius = 0.3f;
+	CrowdAgent& agent = crowdAgents[i];
+	AnimationController& animation = crowdAnimation[i];
+	agent.timer -= deltaTime;
+
+	switch (agent.task) {
+	case AGENT_CHOOSING:  // chooseStation() moves the agent on
+		animation.requestLocomotion(CLIP_IDLE);
+		break;
+	case AGENT_WALKING: {
+		const GymStation& station = gymStations[agent.station];
+		float dx = station.approachX - agent.x, dz = station.approachZ - agent.z;
+		float distance = sqrt(dx * dx + dz * dz);
+		if (distance < 0.25f) {  // Get on the machine
+			agent.x = station.spotX;
+			agent.y = station.spotY;
+			agent.z = station.spotZ;
+			agent.heading = station.heading;
+			agent.task = AGENT_EXERCISING;
+			agent.timer = station.duration;
+			animation.playExercise(station.clip);
+			break;
+		}
+		animation.requestLocomotion(CLIP_WALK);
+
+		// Follow the machine's flow field, or sideways for a while after getting stuck
+		float dirX, dirZ;
+		flowDirection(stationFlow[agent.station], agent.x, agent.z, dirX, dirZ);
+		if (agent.timer > 0.0f) {
+			dirX = agent.detourX;
+			dirZ = agent.detourZ;
+		}
+		// Keep clear of the agents nearby
+		int cx = crowdCell(agent.x, agent.z) % CROWD_GRID_X, cz = crowdCell(agent.x, agent.z) / CROWD_GRID_X;
+		for (int z = cz - 1; z <= cz + 1; z++) {
+			for (int x = cx - 1; x <= cx + 1; x++) {
+				if (x < 0 || z < 0 || x >= CROWD_GRID_X || z >= CROWD_GRID_Z) continue;
+				int cell = z * CROWD_GRID_X + x;
+				for (int k = crowdCellStart[cell]; k < crowdCellStart[cell + 1]; k++) {
+					int other = crowdCellAgents[k];
+					if (other == i) continue;
+					float ox = agent.x - crowdPositions[2 * other], oz = agent.z - crowdPositions[2 * other + 1];
+					float d2 = ox * ox + oz * oz;
+					if (d2 < radius * radius && d2 > 1e-8f) {
+						float push = 0.5f * (radius - sqrt(d2)) / radius;  // Soft, so a crowd can be squeezed through
+						dirX += ox / sqrt(d2) * push;
+						dirZ += oz / sqrt(d2) * push;
+					}
+				}
+			}
+		}
+
+		float step = speed * deltaTime;
+		float oldX = agent.x, oldZ = agent.z;
+		float nx = agent.x + dirX * step, nz = agent.z + dirZ * step;
+		nx = nx < ROOM_MIN_X ? ROOM_MIN_X : (nx > ROOM_MAX_X ? ROOM_MAX_X : nx);
+		nz = nz < ROOM_MIN_Z ? ROOM_MIN_Z : (nz > ROOM_MAX_Z ? ROOM_MAX_Z : nz);
+		if (!blockedByEquipment(nx, nz)) {
+			agent.x = nx;
+			agent.z = nz;
+		}
+		else if (!blockedByEquipment(nx, agent.z)) {  // Slide along the machine
+			agent.x = nx;
+		}
+		else if (!blockedByEquipment(agent.x, nz)) {
+			agent.z = nz;
+		}
+		float movedX = agent.x - oldX, movedZ = agent.z - oldZ;
+		if (agent.timer <= 0.0f && movedX * movedX + movedZ * movedZ < 0.25f * step * step) {  // Jammed in the crowd
+			float angle = crowdRandom(agent.random) * 6.2831853f;
+			agent.detourX = cos(angle);
+			agent.detourZ = sin(angle);
+			agent.timer = 0.5f;
+		}
+		if (dirX != 0.0f || dirZ != 0.0f) {
+			agent.heading = atan2(dirX, -dirZ) * 57.29578f;  // Same convention as the arrow keys
+		}
+		break;
+	}
+	case AGENT_EXERCISING:
+		if (agent.timer > 0.0f) break;
+		// Step back off the machine and pick the next one
+		agent.x = gymStations[agent.station].approachX;
+		agent.z = gymStations[agent.station].approachZ;
+		agent.y = 0.1f;
+		releaseStation(i);
+		agent.task = AGENT_CHOOSING;
+		agent.timer = crowdRandom(agent.random) * 2.0f;
+		animation.stopExercise();
+		break;
+	}
+	animation.advance(deltaTime);
+}
+
+void updateCrowd(float deltaTime) {
+	int count = (int)crowdAgents.size();
+	if (count == 0) return;
+	TraceScope trace("crowd update");
+
+	// Bucket the agents by cell with a counting sort
+	crowdCellStart.assign(CROWD_GRID_X * CROWD_GRID_Z + 1, 0);
+	crowdCellAgents.resize(count);
+	for (int i = 0; i < count; i++) {
+		crowdPositions[2 * i] = crowdAgents[i].x;
+		crowdPositions[2 * i + 1] = crowdAgents[i].z;
+		crowdCellStart[crowdCell(crowdAgents[i].x, crowdAgents[i].z) + 1]++;
+	}
+	for (size_t c = 1; c < crowdCellStart.size(); c++) crowdCellStart[c] += crowdCellStart[c - 1];
+	static std::vector<int> fill;
+	fill.assign(crowdCellStart.begin(), crowdCellStart.end() - 1);
+	for (int i = 0; i < count; i++) {
+		crowdCellAgents[fill[crowdCell(crowdAgents[i].x, crowdAgents[i].z)]++] = i;
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (crowdAgents[i].task == AGENT_CHOOSING && crowdAgents[i].timer <= 0.0f) chooseStation(i);
+	}
+	simulationWorkers.parallelFor(count, [deltaTime](int i) {
+		updateCrowdAgent(i, deltaTime);
+	});
+}
+
+// Joint poses of every agent, evaluated in batches of CROWD_BATCH on the workers
+void evaluateCrowdPoses(std::vector<JointPose>& poses) {
+	const int CROWD_BATCH = 64;
+	int count = (int)crowdAgents.size();
+	poses.resize(count * JOINT_COUNT);
+	if (count == 0) return;
+	simulationWorkers.parallelFor((count + CROWD_BATCH - 1) / CROWD_BATCH, [count, &poses](int batch) {
+		int begin = batch * CROWD_BATCH;
+		int n = count - begin < CROWD_BATCH ? count - begin : CROWD_BATCH;
+		float placements[CROWD_BATCH][4];
+		for (int k = 0; k < n; k++) {
+			const CrowdAgent& agent = crowdAgents[begin + k];
+			placements[k][0] = agent.x;
+			placements[k][1] = agent.y;
+			placements[k][2] = agent.z;
+			placements[k][3] = agent.heading;
+		}
+		evaluateAnimations(&crowdAnimation[begin], placements, n, &poses[begin * JOINT_COUNT]);
+	});
+}
+
+bool DeadLiftUsed = false;
+bool BenchPressUsed = false;
+bool TreadMillUsed = false;
+bool ChinUpUsed = false;
+bool DumbellRackUsed = false;
+bool SmithUsed = false;
+
+
+void handleKeyboard(unsigned char key, int x, int y) {
+	// Check if "E" is pressed and player is colliding with the chin-up machine
+	const float moveStep = 0.2f;
+	switch (key)
+	{
+	case 't':
+		camera.setTopView();
+		break;
+	case 'f':
+		camera.setFrontView();
 		break;
 	case 's':
 		camera.setSideView();
 		break;
-	case 'g':  // Move right along X-axis
-		camera.eye.x += moveStep;
-		camera.center.x += moveStep;
+	case 'g':  // Move right along X-axis
+		camera.eye.x += moveStep;
+		camera.center.x += moveStep;
+		break;
+	case 'h':  // Move left along X-axis
+		camera.eye.x -= moveStep;
+		camera.center.x -= moveStep;
+		break;
+
+		// Move along the Y-axis
+	case 'j':  // Move up along Y-axis
+		camera.eye.y += moveStep;
+		camera.center.y += moveStep;
+		break;
+	case 'k':  // Move down along Y-axis
+		camera.eye.y -= moveStep;
+		camera.center.y -= moveStep;
+		break;
+
+		// Move along the Z-axis
+	case 'l':  // Move forward along Z-axis
+		camera.eye.z -= moveStep;
+		camera.center.z -= moveStep;
+		break;
+	case ';':  // Move backward along Z-axis
+		camera.eye.z += moveStep;
+		camera.center.z += moveStep;
+		break;
+	case '/':
+		deadliftAnimationTime += 0.1;
+		break;
+	case 'm':  // Spawn or remove the crowd of AI gym-goers
+		toggleCrowd();
+		break;
+	default:
+		break;
+	}
+	if (key == 'E' || key == 'e') {  // Check for both uppercase and lowercase
+		if (checkCollisionChinUp && !isAnimatingChinUp) {
+			startChinUpAnimation();  // Start the chin-up animation
+			startedExercise(MACHINE_CHIN_UP, ChinUpUsed);
+		}
+		if (checkCollisionBenchPress && !isAnimatingBenchPress) {
+			startBenchPressAnimation();  // Start the chin-up animation
+			startedExercise(MACHINE_BENCH_PRESS, BenchPressUsed);
+		}
+		if (checkCollisionSmith && !isAnimatingSmith) {
+			isAnimatingSmith = true;
+			animationStep = 0;       // Start scaling up
+			scaleFactor = 1.0f;      // Reset scale factor
+			smithStepTime = 0.0f;
+			startedExercise(MACHINE_SMITH, SmithUsed);
+		}
+		if (checkCollisionTreadMill && !isAnimatingTreadmill) {
+			startTreadmillAnimation();  // Start the chin-up animation
+			startedExercise(MACHINE_TREADMILL, TreadMillUsed);
+		}
+		if (checkCollisionDumbellRack) {
+			isColorChanging = true;
+			startedExercise(MACHINE_DUMBBELL_RACK, DumbellRackUsed);
+		}
+		if (checkCollisionDeadLift && !isLifting && DumbellRackUsed && TreadMillUsed && SmithUsed && BenchPressUsed && ChinUpUsed) {
+			startDeadliftAnimation();
+			startedExercise(MACHINE_DEADLIFT, DeadLiftUsed);
+		}
+	}
+	if (key == 'P' || key == 'p') {  // Check for both uppercase and lowercase
+		if (checkCollisionChinUp && isAnimatingChinUp) {
+			isAnimatingChinUp = false;  // End the animation after one full cycle
+			PosY = 0;           // Reset position
+			posX = startPosX;
+			posZ = startPosZ;
+			rotationAngle = -90;
+			playerAnimation.stopExercise();
+			gymEvents.post(EVENT_STOP_EXERCISE, MACHINE_CHIN_UP);
+		}
+		if (checkCollisionBenchPress && isAnimatingBenchPress) {
+			isAnimatingBenchPress = false;
+			posX = startPosX;      // Reset X position
+			posZ = startPosZ;      // Reset Z position
+			PosY = 0.1f;                // Reset height
+			barPosY = 0.6f;             // Reset bar height
+			rotationAngle = 0.0f;
+			playerAnimation.stopExercise();
+			benchPressAnimationTime = 0.0f;  // Reset animation time
+			gymEvents.post(EVENT_STOP_EXERCISE, MACHINE_BENCH_PRESS);
+		}
+		if (checkCollisionSmith && isAnimatingSmith) {
+			animationStep = 2;       // Start scaling down phase
+		}
+		if (checkCollisionTreadMill && isAnimatingTreadmill) {
+			isAnimatingTreadmill = false;
+			playerAnimation.stopExercise();
+			// Reset player position if desired
+			posX = startPosX;
+			posZ = startPosZ;
+			PosY = 0.1f;
+			gymEvents.post(EVENT_STOP_EXERCISE, MACHINE_TREADMILL);
+		}
+		if (checkCollisionDumbellRack && isColorChanging) {
+			isColorChanging = false;
+			colorChangeTime = 0.0f;   // Start the chin-up animation
+			gymEvents.post(EVENT_STOP_EXERCISE, MACHINE_DUMBBELL_RACK);
+		}
+	}
+
+}
+
+
+
+float timeRemaining = 90.0f;  // Start timer at 90 seconds
+float WallColor[3] = { 0.9f, 0.9f, 0.9f };
+
+float colorUpdateInterval = 10.0f;  // Interval in seconds for WallColor adjustment
+
+void updateTimer(float deltaTime) {
+	// Update remaining time
+	timeRemaining -= deltaTime;
+
+	// Check if timeRemaining has reached zero
+	if (timeRemaining <= 0.0f) {
+		timeRemaining = 0.0f;
+		gameState = LOSE;  // Set game state to LOSE when time is up
+		gymEvents.post(EVENT_GAME_LOST);
+	}
+
+	// Decrease WallColor every 10 seconds if not already at minimum
+	if (static_cast<int>(timeRemaining) % 10 == 0 && timeRemaining <= colorUpdateInterval * 9) {
+		for (int i = 0; i < 3; i++) {
+			if (WallColor[i] > 0.0f) {
+				WallColor[i] -= 0.1f;
+				if (WallColor[i] < 0.0f) WallColor[i] = 0.0f;  // Clamp color to minimum 0
+			}
+		}
+		colorUpdateInterval -= 10.0f;  // Update interval to avoid repeated reduction
+	}
+}
+
+// Input-to-photon latency (-latency). Every input carries the time it happened; the
+// simulation notes the tick that applied it, and the renderer takes the time again
+// once the first frame drawn from that tick or a later one is on the screen. The
+// percentiles are over the last LATENCY_WINDOW inputs.
+const int LATENCY_WINDOW = 1024;
+const float LATENCY_LOG_INTERVAL = 5.0f;  // Seconds between lines in the log
+
+long long inputClock() {  // Microseconds on the steady clock, which evdev is set to as well
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct LatencySample {
+	unsigned int tick;  // simulationTicks when it was applied
+	long long time;     // InputEvent::time
+};
+
+class LatencyMeter {
+public:
+	LatencyMeter() : enabled(false), total(0), holding(false), lastLog(0) {
+		summary[0] = '\0';
+	}
+
+	// Simulation thread, as the input is applied
+	void applied(long long time, unsigned int tick) {
+		if (!enabled || time == 0) return;
+		LatencySample sample = { tick, time };
+		samples.push(sample);
+	}
+
+	// Render thread, once the frame drawn from the snapshot taken after `tick` ticks is shown
+	void presented(unsigned int tick) {
+		if (!enabled) return;
+		long long now = inputClock();
+		bool added = false;
+		while (holding || samples.pop(waiting)) {
+			holding = waiting.tick >= tick;  // Applied after this snapshot, a later frame shows it
+			if (holding) break;
+			window[total % LATENCY_WINDOW] = (float)(now - waiting.time) / 1000.0f;
+			total++;
+			added = true;
+		}
+		if (added) format();
+		if (log.is_open() && now - lastLog >= (long long)(LATENCY_LOG_INTERVAL * 1e6f)) {
+			log << summary << std::endl;
+			lastLog = now;
+		}
+	}
+
+	bool openLog(const char* filename) {
+		log.open(filename, std::ios::app);
+		if (!log) {
+			std::cerr << "Failed to open latency log: " << filename << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// Last word in the log and on the console, at exit
+	void finish() {
+		if (!enabled || total == 0) return;
+		if (log.is_open()) log << summary << std::endl;
+		std::cout << "Latency " << summary << std::endl;
+	}
+
+	bool enabled;
+	char summary[96];  // "input 123: p50 .. p95 .. p99 .. max .. ms", empty until the first sample
+
+private:
+	void format() {
+		int count = total < LATENCY_WINDOW ? (int)total : LATENCY_WINDOW;
+		std::vector<float> sorted(window, window + count);
+		std::sort(sorted.begin(), sorted.end());
+		sprintf(summary, "input %u: p50 %.1f  p95 %.1f  p99 %.1f  max %.1f ms", total,
+			sorted[count * 50 / 100], sorted[count * 95 / 100], sorted[count * 99 / 100], sorted[count - 1]);
+	}
+
+	SpscQueue<LatencySample, 256> samples;  // Simulation -> render thread
+	float window[LATENCY_WINDOW];           // Milliseconds, the newest at total - 1
+	unsigned int total;
+	LatencySample waiting;                  // Popped but not on the screen yet
+	bool holding;
+	std::ofstream log;
+	long long lastLog;
+};
+
+LatencyMeter inputLatency;
+
+void finishLatency() {
+	inputLatency.finish();
+}
+
+
+
+#ifndef GYM_HEADLESS
+int timerWidget = -1;
+int timerShownSeconds = -1;
+int timerShownRewind = -1;  // Tenths of a second
+
+// Update the timer widget; the text is only formatted again when the shown second changes
+void displayTimer() {
+	if (timerWidget < 0) {
+		TextLayer layer = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+		timerWidget = hud.addWidget(FONT_HUD, &layer, 1);
+	}
+	int seconds = (int)floor(frame.timeRemaining + 0.5f);
+	int rewind = (int)floor(frame.rewindOffset * 10.0f + 0.5f);
+	if (seconds != timerShownSeconds || rewind != timerShownRewind) {
+		char timerText[32];
+		if (rewind > 0) sprintf(timerText, "Time: %d  << %.1fs", seconds, rewind / 10.0f);
+		else sprintf(timerText, "Time: %d", seconds);  // Format as "Time: X"
+		hud.setText(timerWidget, timerText);
+		timerShownSeconds = seconds;
+		timerShownRewind = rewind;
+	}
+
+	// Display timerText at a specific location on the screen
+	float x, y;
+	if (projectToWindow(3.0f, 4.0f, 3.0f, x, y)) {  // Adjust position as needed
+		hud.setPosition(timerWidget, x, y);
+	}
+	else {
+		hud.hide(timerWidget);
+	}
+}
+
+int promptWidget = -1;
+
+// The score and key hint the HUD subscriber formatted, in the bottom left corner
+void displayPrompt() {
+	if (promptWidget < 0) {
+		TextLayer layer = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+		promptWidget = hud.addWidget(FONT_HUD, &layer, 1);
+	}
+	hud.setText(promptWidget, frame.prompt);  // Rasterized again only when it changed
+	hud.setPosition(promptWidget, 10.0f, 20.0f);
+}
+
+int latencyWidget = -1;
+
+void displayLatency() {
+	if (!inputLatency.enabled) return;
+	if (latencyWidget < 0) {
+		TextLayer layer = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+		latencyWidget = hud.addWidget(FONT_FIXED, &layer, 1);
+	}
+	hud.setText(latencyWidget, inputLatency.summary);
+	hud.setPosition(latencyWidget, 10.0f, 40.0f);
+}
+
+// Main text plus a cyan copy one pixel up and right for the outline effect
+const TextLayer endScreenLayers[2] = {
+	{ 0.0f, 0.0f, 0.0f, 0.0f, 0.0f },
+	{ 1.0f, 1.0f, 0.0f, 1.0f, 1.0f },
+};
+TextLabel endScreenLabel;
+
+void displayEndScreenText(const char* text) {
+	endScreenLabel.set(FONT_TITLE, text, endScreenLayers, 2);
+
+	// Position and display the message
+	float x, y;
+	if (projectToWindow(1.5f, 2.0f, 0.0f, x, y)) {  // Center the text
+		beginScreenText();
+		endScreenLabel.draw(x, y);
+		endScreenText();
+	}
+}
+
+void displayWinScreen() {
+	// Clear the screen with a background color for the win screen
+	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);  // Black background
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	displayEndScreenText("YOU ARE THE WORLD CHAMPION!");
+
+	// Swap buffers to render the screen
+	glutSwapBuffers();
+}
+
+void displayLoseScreen() {
+	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);  // Black background
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	displayEndScreenText("YOU WERE TOO WEAK");
+}
+#endif
+
+
+float simulationTime = 0.0f;  // Seconds of game time simulated so far
+
+void updateAnimation() {
+	// Walk while the player covers ground; the state machine keeps exercises playing
+	playerAnimation.requestLocomotion(playerMotion.moved > 0.0f ? CLIP_WALK : CLIP_IDLE);
+
+	deadliftRotationAngle += 0.05f;  // Adjust the value for desired speed
+	if (deadliftRotationAngle > 360.0f) {
+		deadliftRotationAngle -= 360.0f;  // Keep it within 0-360 degrees
+	}
+	dumbellRackRotationAngle += 0.05f;  // Adjust the value for desired speed
+	if (dumbellRackRotationAngle > 360.0f) {
+		dumbellRackRotationAngle -= 360.0f;  // Keep it within 0-360 degrees
+	}
+}
+#ifndef GYM_HEADLESS
+void idle() {
+	glutPostRedisplay();  // Redisplay for smooth animation
+}
+
+#endif
+// Number of exercise animations currently running, for the trace counters
+int countActiveAnimations() {
+	return isAnimatingChinUp + isAnimatingBenchPress + isAnimatingSmith + isAnimatingTreadmill + isColorChanging + isLifting;
+}
+
+// Click-to-move. A click on the floor walks an A* route there; a click on a machine
+// follows its station's flow field and then bumps into it like an arrow key would,
+// so 'e' starts the exercise.
+bool autoWalking = false;
+int autoWalkStation = -1;        // Station whose flow field is followed, -1 for a path
+std::vector<float> autoWalkPath;  // x, z waypoints
+size_t autoWalkNext = 0;          // Index of the waypoint being walked to
+float autoWalkTargetX, autoWalkTargetZ;
+
+bool touchingEquipment() {
+	return checkCollisionChinUp || checkCollisionBenchPress || checkCollisionSmith ||
+		checkCollisionTreadMill || checkCollisionDumbellRack || checkCollisionDeadLift;
+}
+
+void walkPlayerTo(float x, float z) {
+	if (playerAnimation.exercising || isAnimatingSmith) return;
+	updateNavigation();  // The Smith machine may have changed size since the last walk
+	x = x < ROOM_MIN_X ? ROOM_MIN_X : (x > ROOM_MAX_X ? ROOM_MAX_X : x);
+	z = z < ROOM_MIN_Z ? ROOM_MIN_Z : (z > ROOM_MAX_Z ? ROOM_MAX_Z : z);
+	autoWalkTargetX = x;
+	autoWalkTargetZ = z;
+	autoWalkStation = -1;
+	float nearest = 1e30f;
+	for (int s = 0; s < STATION_COUNT; s++) {  // The treadmills share one box
+		const BoundingBox& box = *gymStations[s].box;
+		if (x < box.minX || x > box.maxX || z < box.minZ || z > box.maxZ) continue;
+		float dx = gymStations[s].approachX - x, dz = gymStations[s].approachZ - z;
+		if (dx * dx + dz * dz < nearest) {
+			nearest = dx * dx + dz * dz;
+			autoWalkStation = s;
+		}
+	}
+	autoWalkNext = 0;
+	autoWalking = autoWalkStation >= 0 || navFindPath(posX, posZ, x, z, autoWalkPath);
+}
+
+void stopAutoWalk() {
+	autoWalking = false;
+}
+
+void updateAutoWalk(float deltaTime) {
+	if (!autoWalking) return;
+	const float speed = 1.0f;
+	playerMotion.moved = 0.0f;
+	float step = speed * deltaTime;
+	float goalX, goalZ, dirX, dirZ;
+	if (autoWalkStation >= 0) {
+		goalX = gymStations[autoWalkStation].approachX;
+		goalZ = gymStations[autoWalkStation].approachZ;
+		flowDirection(stationFlow[autoWalkStation], posX, posZ, dirX, dirZ);
+	}
+	else {
+		goalX = autoWalkPath[autoWalkNext];
+		goalZ = autoWalkPath[autoWalkNext + 1];
+		float dx = goalX - posX, dz = goalZ - posZ;
+		float distance = sqrt(dx * dx + dz * dz);
+		if (distance <= step && autoWalkNext + 2 < autoWalkPath.size()) {  // Turn the corner
+			autoWalkNext += 2;
+			return;
+		}
+		dirX = distance > 1e-4f ? dx / distance : 0.0f;
+		dirZ = distance > 1e-4f ? dz / distance : 0.0f;
+	}
+
+	float dx = goalX - posX, dz = goalZ - posZ;
+	if (dx * dx + dz * dz <= step * step) {
+		posX = goalX;
+		posZ = goalZ;
+		startPosX = posX;
+		startPosZ = posZ;
+		autoWalking = false;
+		updateMachineZones();  // A station's approach point is in its trigger
+		if (blockedByEquipment(autoWalkTargetX, autoWalkTargetZ)) {
+			// Step towards the machine along its main axis until its trigger is reached
+			float tx = autoWalkTargetX - posX, tz = autoWalkTargetZ - posZ;
+			float stepX = fabs(tx) > fabs(tz) ? (tx > 0 ? 0.1f : -0.1f) : 0.0f;
+			float stepZ = fabs(tx) > fabs(tz) ? 0.0f : (tz > 0 ? 0.1f : -0.1f);
+			for (int tries = 0; tries < 3 && !touchingEquipment() && !solidsHit(posX + stepX, posZ + stepZ); tries++) {
+				posX += stepX;
+				posZ += stepZ;
+				startPosX = posX;
+				startPosZ = posZ;
+				updateMachineZones();
+			}
+		}
+		return;
+	}
+	posX += dirX * step;
+	posZ += dirZ * step;
+	startPosX = posX;
+	startPosZ = posZ;
+	rotationAngle = atan2(dirX, -dirZ) * 57.29578f;
+	playerMotion.moved = step;
+	updateMachineZones();
+}
+
+
+// Subscribers to the game events. They run on the simulation thread at the end of a
+// tick; the HUD only formats its line here and the renderer picks it up from the
+// snapshot.
+int score = 0;         // 100 for each machine's first use, 10 for each second left at the finish
+char hudPrompt[48];    // Score and what the keys do where the player stands
+
+const char* machineNames[MACHINE_COUNT] = { "chin up", "bench press", "treadmill", "dumbbell rack", "Smith machine", "deadlift" };
+
+void onSoundEvent(const GymEvent& event) {
+	if (event.type == EVENT_START_EXERCISE) {
+		switch (event.machine) {
+		case MACHINE_CHIN_UP: playChinUpSound(); break;
+		case MACHINE_BENCH_PRESS: playBenchPressSound(); break;
+		case MACHINE_TREADMILL: playTreadmillSound(); break;
+		case MACHINE_DUMBBELL_RACK: playDumbbellRackSound(); break;
+		case MACHINE_SMITH: playSmithSound(); break;
+		case MACHINE_DEADLIFT:
+			stopBackgroundMusic();
+			playDeadliftSound();
+			break;
+		}
+	}
+	else if (event.type == EVENT_STOP_EXERCISE) {
+		switch (event.machine) {  // The Smith machine's clank plays out
+		case MACHINE_CHIN_UP: stopChinUpSound(); break;
+		case MACHINE_BENCH_PRESS: stopBenchPressSound(); break;
+		case MACHINE_TREADMILL: stopTreadmillSound(); break;
+		case MACHINE_DUMBBELL_RACK: stopDumbbellRackSound(); break;
+		case MACHINE_DEADLIFT: stopDeadliftSound(); break;
+		}
+	}
+	else {
+		stopBackgroundMusic();
+		if (event.type == EVENT_GAME_WON) playYouWinSound();
+		else playYouDiedSound();
+	}
+}
+
+void onCameraEvent(const GymEvent& event) {
+	if (event.type == EVENT_START_EXERCISE) camera.setFrontCloseView();  // Close-up while bending down
+	else camera.setFrontView();
+}
+
+void onScoreEvent(const GymEvent& event) {
+	if (event.type == EVENT_START_EXERCISE) score += event.value > 0.0f ? 100 : 0;
+	else score += 10 * (int)timeRemaining;
+}
+
+// The score and the key that does something at `machine`, -1 for none
+void formatHudPrompt(int machine, bool exercising) {
+	const char* name = machine >= 0 ? machineNames[machine] : "";
+	char action[40] = "";
+	if (machine >= 0 && exercising) {
+		if (machine != MACHINE_DEADLIFT) snprintf(action, sizeof(action), "P: get off the %s", name);
+	}
+	else if (machine >= 0 && *machineZones[machine].touching) {
+		if (machine != MACHINE_DEADLIFT) snprintf(action, sizeof(action), "E: use the %s", name);
+		else if (!(DumbellRackUsed && TreadMillUsed && SmithUsed && BenchPressUsed && ChinUpUsed)) snprintf(action, sizeof(action), "Use every machine first");
+		else snprintf(action, sizeof(action), "E: lift!");
+	}
+	snprintf(hudPrompt, sizeof(hudPrompt), "Score: %d%s%s", score, action[0] ? "   " : "", action);
+}
+
+// Subscribed after the score so it shows the new one
+void onHudEvent(const GymEvent& event) {
+	switch (event.type) {
+	case EVENT_ENTER_MACHINE_ZONE:
+	case EVENT_STOP_EXERCISE:
+		formatHudPrompt(event.machine, false);
+		break;
+	case EVENT_START_EXERCISE:
+		formatHudPrompt(event.machine, true);
 		break;
-	case 'h':  // Move left along X-axis
-		camera.eye.x -= moveStep;
-		camera.center.x -= moveStep;
+	default:
+		formatHudPrompt(-1, false);
 		break;
+	}
+}
+
+// A restored state (F9, a rewind scrub, -resume) comes without the events that led
+// to it, so bring the prompt, camera and sounds in line with it here
+void refreshFromGymState() {
+	const bool exercising[MACHINE_COUNT] = { isAnimatingChinUp, isAnimatingBenchPress, isAnimatingTreadmill, isColorChanging, isAnimatingSmith, isLifting };
+	int machine = -1;
+	for (int m = 0; m < MACHINE_COUNT && machine < 0; m++) {
+		if (exercising[m]) machine = m;
+	}
+	bool onMachine = machine >= 0;
+	for (int m = 0; m < MACHINE_COUNT && machine < 0; m++) {
+		if (*machineZones[m].touching) machine = m;
+	}
+	formatHudPrompt(machine, onMachine);
+
+	bool deadlifting = gameState == ACTIVE && isLifting;
+	if (gameState != ACTIVE) camera.setFrontView();  // The deadlift's camera came back with the state
+
+	if (gameState == ACTIVE && !deadlifting) playBackgroundMusic();
+	else stopBackgroundMusic();
+	if (!isAnimatingChinUp) stopChinUpSound();
+	if (!isAnimatingBenchPress) stopBenchPressSound();
+	if (!isAnimatingTreadmill) stopTreadmillSound();
+	if (!isColorChanging) stopDumbbellRackSound();
+	if (!deadlifting) stopDeadliftSound();
+}
+
+void subscribeGymEvents() {
+	gymEvents.subscribe(EVENT_START_EXERCISE, onSoundEvent);
+	gymEvents.subscribe(EVENT_STOP_EXERCISE, onSoundEvent);
+	gymEvents.subscribe(EVENT_GAME_WON, onSoundEvent);
+	gymEvents.subscribe(EVENT_GAME_LOST, onSoundEvent);
+	gymEvents.subscribe(EVENT_GAME_WON, onCameraEvent);
+	gymEvents.subscribe(EVENT_GAME_LOST, onCameraEvent);
+	gymEvents.subscribe(EVENT_START_EXERCISE, [](const GymEvent& event) {
+		if (event.machine == MACHINE_DEADLIFT) onCameraEvent(event);
+	});
+	gymEvents.subscribe(EVENT_START_EXERCISE, onScoreEvent);
+	gymEvents.subscribe(EVENT_GAME_WON, onScoreEvent);
+	for (int type = 0; type < EVENT_TYPES; type++) gymEvents.subscribe((GymEventType)type, onHudEvent);
+	formatHudPrompt(-1, false);
+}
+
+
+// The simulation runs on its own thread at a fixed rate. Keys reach it through a
+// queue and it hands the renderer a RenderSnapshot through a triple buffer, so the
+// two sides never share a global and neither waits for the other.
+const int SIM_TICK_RATE = 100;  // Ticks per second
+const float SIM_DT = 1.0f / SIM_TICK_RATE;
+
+enum InputType { INPUT_KEY, INPUT_SPECIAL_KEY, INPUT_CLICK, INPUT_SPECIAL_KEY_UP };
+
+struct InputEvent {
+	InputType type;
+	int key;
+	float x = 0.0f, z = 0.0f;  // Floor point of a click, in the player's coordinates
+	long long time = 0;        // inputClock() when it happened, 0 if nobody knows
+};
+
+SpscQueue<InputEvent, 256> inputQueue;       // GLUT thread -> simulation
+TripleBuffer<RenderSnapshot> snapshots;      // Simulation -> GLUT thread
+std::atomic<bool> simulationRunning(false);
+std::thread simulationThread;
+unsigned int simulationTicks = 0;
+
+// Raw input. GLUT only hands over keys when its event pump runs, with the key
+// repeat mixed in; on the kiosks a thread of our own reads the keyboards and
+// gamepads straight from evdev instead (-rawinput). Each event is stamped with the
+// time the kernel saw it and goes to the simulation through its own SPSC queue. A
+// script of timed events (-inputscript) can take the devices' place for tests.
+// While either runs, the GLUT callbacks leave the arrows, 'e' and 'p' alone.
+SpscQueue<InputEvent, 256> rawInputQueue;  // Raw input thread -> simulation
+std::atomic<bool> rawInputRunning(false);
+std::thread rawInputThread;
+bool rawInputActive = false;
+
+void pushRawInput(InputType type, int key, long long time) {
+	InputEvent input = { type, key };
+	input.time = time;
+	rawInputQueue.push(input);
+}
+
+// Lines of "<seconds> down|up|key <arrow or character>", in order of time
+void scriptedInputMain(std::vector<std::pair<float, InputEvent> > script) {
+	traceSetThreadName("input script");
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < script.size() && rawInputRunning.load(); i++) {
+		std::this_thread::sleep_until(start + std::chrono::microseconds((long long)(script[i].first * 1e6f)));
+		pushRawInput(script[i].second.type, script[i].second.key, inputClock());
+	}
+}
+
+bool loadInputScript(const char* filename, std::vector<std::pair<float, InputEvent> >& script) {
+	std::ifstream file(filename);
+	if (!file) {
+		std::cerr << "Failed to open input script: " << filename << std::endl;
+		return false;
+	}
+	const char* arrows[] = { "left", "up", "right", "down" };  // GLUT_KEY_LEFT onwards
+	float seconds;
+	std::string action, name;
+	while (file >> seconds >> action >> name) {
+		int arrow = -1;
+		for (int a = 0; a < 4; a++) {
+			if (name == arrows[a]) arrow = GLUT_KEY_LEFT + a;
+		}
+		InputEvent input = { INPUT_KEY, 0 };
+		if (action == "key" && arrow < 0 && name.size() == 1) {  // Arrows are held, not typed
+			input.key = (unsigned char)name[0];
+		}
+		else if ((action == "down" || action == "up") && arrow >= 0) {
+			input.type = action == "down" ? INPUT_SPECIAL_KEY : INPUT_SPECIAL_KEY_UP;
+			input.key = arrow;
+		}
+		else {
+			std::cerr << "Bad input script line: " << seconds << " " << action << " " << name << std::endl;
+			return false;
+		}
+		script.push_back(std::make_pair(seconds, input));
+	}
+	return true;
+}
+
+// Play a script of timed input on the raw input thread, in place of the devices
+void startScriptedInput(const std::vector<std::pair<float, InputEvent> >& script) {
+	rawInputRunning.store(true);
+	rawInputThread = std::thread(scriptedInputMain, script);
+	rawInputActive = true;
+}
+
+#ifdef __linux__
+// One opened /dev/input/event* node. Sticks and hats become arrow presses and releases.
+struct RawDevice {
+	int fd;
+	int stickMin[2], stickMax[2];  // ABS_X, ABS_Y
+	int stick[2], hat[2];          // -1, 0 or 1 per axis
+};
+
+// Where an axis sits: past half way from the centre counts as pushed
+int stickDirection(int value, int low, int high) {
+	int centre = (low + high) / 2, reach = (high - low) / 4;
+	return value < centre - reach ? -1 : (value > centre + reach ? 1 : 0);
+}
+
+// An axis moved from one direction to another: let go of the old arrow, press the new
+void moveAxis(int& current, int direction, int negativeKey, int positiveKey, long long time) {
+	if (direction == current) return;
+	if (current != 0) pushRawInput(INPUT_SPECIAL_KEY_UP, current < 0 ? negativeKey : positiveKey, time);
+	if (direction != 0) pushRawInput(INPUT_SPECIAL_KEY, direction < 0 ? negativeKey : positiveKey, time);
+	current = direction;
+}
+
+void translateRawEvent(RawDevice& device, const input_event& event) {
+#ifdef input_event_sec
+	long long time = (long long)event.input_event_sec * 1000000 + event.input_event_usec;
+#else
+	long long time = (long long)event.time.tv_sec * 1000000 + event.time.tv_usec;
+#endif
+	if (event.type == EV_KEY && event.value != 2) {  // 2 is the key repeat
+		bool down = event.value == 1;
+		int arrow = -1;
+		switch (event.code) {
+		case KEY_LEFT: case BTN_DPAD_LEFT: arrow = GLUT_KEY_LEFT; break;
+		case KEY_RIGHT: case BTN_DPAD_RIGHT: arrow = GLUT_KEY_RIGHT; break;
+		case KEY_UP: case BTN_DPAD_UP: arrow = GLUT_KEY_UP; break;
+		case KEY_DOWN: case BTN_DPAD_DOWN: arrow = GLUT_KEY_DOWN; break;
+		case KEY_E: case BTN_SOUTH:
+			if (down) pushRawInput(INPUT_KEY, 'e', time);
+			break;
+		case KEY_P: case BTN_EAST:
+			if (down) pushRawInput(INPUT_KEY, 'p', time);
+			break;
+		}
+		if (arrow >= 0) pushRawInput(down ? INPUT_SPECIAL_KEY : INPUT_SPECIAL_KEY_UP, arrow, time);
+	}
+	else if (event.type == EV_ABS) {
+		switch (event.code) {
+		case ABS_X:
+			moveAxis(device.stick[0], stickDirection(event.value, device.stickMin[0], device.stickMax[0]), GLUT_KEY_LEFT, GLUT_KEY_RIGHT, time);
+			break;
+		case ABS_Y:
+			moveAxis(device.stick[1], stickDirection(event.value, device.stickMin[1], device.stickMax[1]), GLUT_KEY_UP, GLUT_KEY_DOWN, time);
+			break;
+		case ABS_HAT0X:
+			moveAxis(device.hat[0], event.value, GLUT_KEY_LEFT, GLUT_KEY_RIGHT, time);
+			break;
+		case ABS_HAT0Y:
+			moveAxis(device.hat[1], event.value, GLUT_KEY_UP, GLUT_KEY_DOWN, time);
+			break;
+		}
+	}
+}
+
+inline bool testBit(const unsigned long* bits, int bit) {
+	return (bits[bit / (8 * sizeof(long))] >> (bit % (8 * sizeof(long)))) & 1;
+}
+
+// Keyboards with arrow keys and gamepads; the mice and power buttons are left alone
+void openRawDevices(std::vector<RawDevice>& devices) {
+	for (int n = 0; n < 64; n++) {
+		char path[32];
+		sprintf(path, "/dev/input/event%d", n);
+		int fd = ::open(path, O_RDONLY | O_NONBLOCK);
+		if (fd < 0) continue;
+		unsigned long keys[KEY_MAX / (8 * sizeof(long)) + 1] = {};
+		ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys);
+		if (!testBit(keys, KEY_LEFT) && !testBit(keys, BTN_SOUTH) && !testBit(keys, BTN_DPAD_LEFT)) {
+			::close(fd);
+			continue;
+		}
+		int clock = CLOCK_MONOTONIC;  // What steady_clock reads
+		ioctl(fd, EVIOCSCLOCKID, &clock);
+		RawDevice device = { fd, { -1, -1 }, { 1, 1 }, { 0, 0 }, { 0, 0 } };
+		for (int axis = 0; axis < 2; axis++) {
+			input_absinfo info;
+			if (ioctl(fd, EVIOCGABS(ABS_X + axis), &info) == 0) {
+				device.stickMin[axis] = info.minimum;
+				device.stickMax[axis] = info.maximum;
+			}
+		}
+		char name[128] = "";
+		ioctl(fd, EVIOCGNAME(sizeof(name)), name);
+		std::cout << "Raw input from " << path << ": " << name << std::endl;
+		devices.push_back(device);
+	}
+}
+
+void evdevInputMain(std::vector<RawDevice> devices) {
+	traceSetThreadName("raw input");
+	std::vector<pollfd> fds(devices.size());
+	for (size_t d = 0; d < devices.size(); d++) {
+		fds[d].fd = devices[d].fd;
+		fds[d].events = POLLIN;
+	}
+	while (rawInputRunning.load()) {
+		if (poll(&fds[0], fds.size(), 100) <= 0) continue;  // Wake up now and then to see if we should stop
+		for (size_t d = 0; d < devices.size(); d++) {
+			if (!(fds[d].revents & POLLIN)) continue;
+			input_event events[64];
+			ssize_t bytes;
+			while ((bytes = read(devices[d].fd, events, sizeof(events))) > 0) {
+				for (size_t e = 0; e < bytes / sizeof(input_event); e++) translateRawEvent(devices[d], events[e]);
+			}
+		}
+	}
+	for (size_t d = 0; d < devices.size(); d++) ::close(devices[d].fd);
+}
+#endif
+
+// The script if there is one, else evdev. False leaves the input to GLUT.
+bool startRawInput(const char* scriptFile) {
+	if (scriptFile) {
+		std::vector<std::pair<float, InputEvent> > script;
+		if (!loadInputScript(scriptFile, script)) return false;
+		startScriptedInput(script);
+		return true;
+	}
+	else {
+#ifdef __linux__
+		std::vector<RawDevice> devices;
+		openRawDevices(devices);
+		if (devices.empty()) {
+			std::cerr << "No readable keyboard or gamepad in /dev/input (is the user in the input group?)" << std::endl;
+			return false;
+		}
+		rawInputRunning.store(true);
+		rawInputThread = std::thread(evdevInputMain, devices);
+#else
+		std::cerr << "Raw input needs Linux evdev; using the GLUT keyboard" << std::endl;
+		return false;
+#endif
+	}
+	rawInputActive = true;
+	return true;
+}
+
+void stopRawInput() {
+	rawInputRunning.store(false);
+	if (rawInputThread.joinable()) rawInputThread.join();
+}
+
+// FNV-1a over the state a replay has to reproduce
+unsigned int simulationChecksum() {
+	unsigned int hash = 2166136261u;
+	auto mix = [&hash](const void* data, size_t size) {
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 16777619u;
+	};
+	float player[] = { posX, PosY, posZ, rotationAngle, playerMotion.vx, playerMotion.vz, timeRemaining, barPosY, scaleFactor, barHeight };
+	mix(&gameState, sizeof(gameState));
+	mix(player, sizeof(player));
+	for (size_t i = 0; i < crowdAgents.size(); i++) {
+		const CrowdAgent& agent = crowdAgents[i];
+		float place[] = { agent.x, agent.y, agent.z, agent.heading, agent.timer };
+		mix(place, sizeof(place));
+		mix(&agent.task, sizeof(agent.task));
+		mix(&agent.station, sizeof(agent.station));
+	}
+	return hash;
+}
+
+// Quick-save. Every gameplay global goes through one GymState record, which with the
+// crowd arrays is laid out in a single buffer: written with one write, read back with
+// one read and checked before anything is touched. Rewind and session resume build on
+// the same buffers.
+const unsigned short SAVE_VERSION = 3;
+
+struct SaveHeader {
+	char magic[4];               // "GYMS"
+	unsigned short version;
+	unsigned short stateSize;    // sizeof(GymState), catches a layout change without a version bump
+	unsigned int crowdCount;
+	unsigned int pathFloats;     // Size of autoWalkPath
+	unsigned int payloadSize;    // Bytes after the header
+	unsigned int checksum;       // FNV-1a of the payload
+};
+
+struct GymState {
+	GameState gameState;
+	Camera camera;
+	float timeRemaining, simulationTime, colorUpdateInterval, WallColor[3];
+	bool used[6];  // Chin up, bench press, treadmill, dumbbell rack, Smith, deadlift
+
+	float posX, PosY, posZ, rotationAngle, startPosX, startPosY, startPosZ;
+	CharacterMotion playerMotion;
+	unsigned char playerKeys;
+	bool collisions[6];  // Same order as used
+	AnimationController playerAnimation;
+	bool autoWalking;
+	int autoWalkStation;
+	unsigned int autoWalkNext;
+	float autoWalkTargetX, autoWalkTargetZ;
+
+	bool isAnimatingChinUp, isAnimatingBenchPress, isAnimatingTreadmill, isAnimatingSmith, isColorChanging, isLifting;
+	float benchPressAnimationTime, barPosY;
+	float scaleFactor, color[3], smithStepTime;
+	int animationStep;
+	float colorChangeTime, dumbbellColor[3];
+	float barHeight, deadliftAnimationTime, deadliftRotationAngle, dumbellRackRotationAngle, holdingPhaseCameraAngle;
+	int crowdSize;
+	int score;
+};
+
+// Copy between the globals and a GymState; one list for both directions
+template <typename T>
+void transferState(T& global, T& saved, bool save) {
+	if (save) saved = global;
+	else global = saved;
+}
+
+template <typename T, size_t N>
+void transferState(T(&global)[N], T(&saved)[N], bool save) {
+	for (size_t i = 0; i < N; i++) transferState(global[i], saved[i], save);
+}
+
+void exchangeGymState(GymState& state, bool save) {
+	transferState(gameState, state.gameState, save);
+	transferState(camera, state.camera, save);
+	transferState(timeRemaining, state.timeRemaining, save);
+	transferState(simulationTime, state.simulationTime, save);
+	transferState(colorUpdateInterval, state.colorUpdateInterval, save);
+	transferState(WallColor, state.WallColor, save);
+	transferState(ChinUpUsed, state.used[0], save);
+	transferState(BenchPressUsed, state.used[1], save);
+	transferState(TreadMillUsed, state.used[2], save);
+	transferState(DumbellRackUsed, state.used[3], save);
+	transferState(SmithUsed, state.used[4], save);
+	transferState(DeadLiftUsed, state.used[5], save);
+
+	transferState(posX, state.posX, save);
+	transferState(PosY, state.PosY, save);
+	transferState(posZ, state.posZ, save);
+	transferState(rotationAngle, state.rotationAngle, save);
+	transferState(startPosX, state.startPosX, save);
+	transferState(startPosY, state.startPosY, save);
+	transferState(startPosZ, state.startPosZ, save);
+	transferState(playerMotion, state.playerMotion, save);
+	transferState(playerKeys, state.playerKeys, save);
+	transferState(checkCollisionChinUp, state.collisions[0], save);
+	transferState(checkCollisionBenchPress, state.collisions[1], save);
+	transferState(checkCollisionTreadMill, state.collisions[2], save);
+	transferState(checkCollisionDumbellRack, state.collisions[3], save);
+	transferState(checkCollisionSmith, state.collisions[4], save);
+	transferState(checkCollisionDeadLift, state.collisions[5], save);
+	transferState(playerAnimation, state.playerAnimation, save);
+	transferState(autoWalking, state.autoWalking, save);
+	transferState(autoWalkStation, state.autoWalkStation, save);
+	unsigned int next = (unsigned int)autoWalkNext;
+	transferState(next, state.autoWalkNext, save);
+	autoWalkNext = next;
+	transferState(autoWalkTargetX, state.autoWalkTargetX, save);
+	transferState(autoWalkTargetZ, state.autoWalkTargetZ, save);
+
+	transferState(isAnimatingChinUp, state.isAnimatingChinUp, save);
+	transferState(isAnimatingBenchPress, state.isAnimatingBenchPress, save);
+	transferState(isAnimatingTreadmill, state.isAnimatingTreadmill, save);
+	transferState(isAnimatingSmith, state.isAnimatingSmith, save);
+	transferState(isColorChanging, state.isColorChanging, save);
+	transferState(isLifting, state.isLifting, save);
+	transferState(benchPressAnimationTime, state.benchPressAnimationTime, save);
+	transferState(barPosY, state.barPosY, save);
+	transferState(scaleFactor, state.scaleFactor, save);
+	transferState(color, state.color, save);
+	transferState(smithStepTime, state.smithStepTime, save);
+	transferState(animationStep, state.animationStep, save);
+	transferState(colorChangeTime, state.colorChangeTime, save);
+	transferState(dumbbellColor, state.dumbbellColor, save);
+	transferState(barHeight, state.barHeight, save);
+	transferState(deadliftAnimationTime, state.deadliftAnimationTime, save);
+	transferState(deadliftRotationAngle, state.deadliftRotationAngle, save);
+	transferState(dumbellRackRotationAngle, state.dumbellRackRotationAngle, save);
+	transferState(holdingPhaseCameraAngle, state.holdingPhaseCameraAngle, save);
+	transferState(crowdSize, state.crowdSize, save);
+	transferState(score, state.score, save);
+}
+
+unsigned int saveChecksum(const char* data, size_t size) {
+	unsigned int hash = 2166136261u;
+	for (size_t i = 0; i < size; i++) hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+	return hash;
+}
+
+// Header, GymState, crowd agents, their animation controllers, then the walk path
+void saveGymState(std::vector<char>& buffer) {
+	SaveHeader header;
+	memcpy(header.magic, "GYMS", 4);
+	header.version = SAVE_VERSION;
+	header.stateSize = sizeof(GymState);
+	header.crowdCount = (unsigned int)crowdAgents.size();
+	header.pathFloats = (unsigned int)autoWalkPath.size();
+	header.payloadSize = (unsigned int)(sizeof(GymState) + header.crowdCount * (sizeof(CrowdAgent) + sizeof(AnimationController)) +
+		header.pathFloats * sizeof(float));
+	buffer.resize(sizeof(SaveHeader) + header.payloadSize);
+
+	char* out = &buffer[sizeof(SaveHeader)];
+	GymState state;
+	memset(static_cast<void*>(&state), 0, sizeof(state));  // Padding too, so equal states give equal files
+	exchangeGymState(state, true);
+	memcpy(out, &state, sizeof(state));
+	out += sizeof(state);
+	if (header.crowdCount > 0) {
+		memcpy(out, &crowdAgents[0], header.crowdCount * sizeof(CrowdAgent));
+		out += header.crowdCount * sizeof(CrowdAgent);
+		memcpy(out, &crowdAnimation[0], header.crowdCount * sizeof(AnimationController));
+		out += header.crowdCount * sizeof(AnimationController);
+	}
+	if (header.pathFloats > 0) {
+		memcpy(out, &autoWalkPath[0], header.pathFloats * sizeof(float));
+	}
+	header.checksum = saveChecksum(&buffer[sizeof(SaveHeader)], header.payloadSize);
+	memcpy(&buffer[0], &header, sizeof(header));
+}
+
+// Leaves the game untouched unless the whole buffer checks out
+bool validClips(const AnimationController& animation) {
+	return animation.current.clip >= 0 && animation.current.clip < CLIP_COUNT &&
+		animation.previous.clip >= 0 && animation.previous.clip < CLIP_COUNT;
+}
+
+bool restoreGymState(const std::vector<char>& buffer) {
+	SaveHeader header;
+	if (buffer.size() < sizeof(header)) return false;
+	memcpy(&header, &buffer[0], sizeof(header));
+	if (memcmp(header.magic, "GYMS", 4) != 0 || header.version != SAVE_VERSION || header.stateSize != sizeof(GymState) ||
+		buffer.size() != sizeof(SaveHeader) + (size_t)header.payloadSize ||
+		header.payloadSize != sizeof(GymState) + header.crowdCount * (sizeof(CrowdAgent) + sizeof(AnimationController)) + header.pathFloats * sizeof(float) ||
+		saveChecksum(&buffer[sizeof(SaveHeader)], header.payloadSize) != header.checksum) {
+		return false;
+	}
+
+	const char* in = &buffer[sizeof(SaveHeader)];
+	GymState state;
+	memcpy(&state, in, sizeof(state));
+	in += sizeof(state);
+
+	// The checksum only catches accidents; indices are checked before anything changes
+	if (!validClips(state.playerAnimation) || state.autoWalkStation < -1 || state.autoWalkStation >= STATION_COUNT) return false;
+	for (unsigned int i = 0; i < header.crowdCount; i++) {
+		CrowdAgent agent;
+		AnimationController animation;
+		memcpy(&agent, in + i * sizeof(CrowdAgent), sizeof(agent));
+		memcpy(&animation, in + header.crowdCount * sizeof(CrowdAgent) + i * sizeof(AnimationController), sizeof(animation));
+		if (agent.station < -1 || agent.station >= STATION_COUNT || !validClips(animation)) return false;
+	}
+
+	exchangeGymState(state, false);
+	crowdAgents.resize(header.crowdCount);
+	crowdAnimation.resize(header.crowdCount);
+	crowdPositions.resize(2 * header.crowdCount);
+	if (header.crowdCount > 0) {
+		memcpy(&crowdAgents[0], in, header.crowdCount * sizeof(CrowdAgent));
+		in += header.crowdCount * sizeof(CrowdAgent);
+		memcpy(&crowdAnimation[0], in, header.crowdCount * sizeof(AnimationController));
+		in += header.crowdCount * sizeof(AnimationController);
+	}
+	autoWalkPath.resize(header.pathFloats);
+	if (header.pathFloats > 0) {
+		memcpy(&autoWalkPath[0], in, header.pathFloats * sizeof(float));
+	}
+
+	// The reservations follow from who is on their way to or using each machine
+	for (int s = 0; s < STATION_COUNT; s++) stationReservations[s].store(-1);
+	for (size_t i = 0; i < crowdAgents.size(); i++) {
+		if (crowdAgents[i].station >= 0) stationReservations[crowdAgents[i].station].store((int)i);
+	}
+	return true;
+}
+
+bool writeSaveFile(const char* filename, const std::vector<char>& buffer) {
+	std::ofstream file(filename, std::ios::binary);
+	file.write(&buffer[0], buffer.size());
+	if (!file) {
+		std::cerr << "Failed to write save: " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// The save's bytes are left in `loaded` when given, for the input journal
+bool readGymState(const char* filename, std::vector<char>* loaded = NULL) {
+	TraceScope trace(filename);
+	std::ifstream file(filename, std::ios::binary | std::ios::ate);
+	if (!file) return false;
+	std::vector<char> buffer((size_t)file.tellg());
+	file.seekg(0);
+	if (!buffer.empty()) file.read(&buffer[0], buffer.size());
+	if (!file || !restoreGymState(buffer)) {
+		std::cerr << "Invalid save: " << filename << std::endl;
+		return false;
+	}
+	if (loaded) loaded->swap(buffer);
+	return true;
+}
+
+// F5 keeps a copy in memory as well as on disk, so F9 in the same session skips the file
+const char* quickSaveFile = "gym_quicksave.sav";
+std::vector<char> quickSave;
+bool replayingJournal = false;  // Replays leave the files alone; the journal has what F9 read
+
+void quickSaveGame() {
+	TraceScope trace("quick save");
+	saveGymState(quickSave);
+	if (!replayingJournal) writeSaveFile(quickSaveFile, quickSave);
+}
+
+void recordLoadedSave(const std::vector<char>& save);
+
+void quickLoadGame() {
+	TraceScope trace("quick load");
+	std::vector<char> loaded;
+	if (!quickSave.empty()) restoreGymState(quickSave);
+	else if (!replayingJournal && readGymState(quickSaveFile, &loaded)) recordLoadedSave(loaded);
+	playerKeys = 0;  // The keys held then aren't held now
+	refreshFromGymState();
+}
+
+// Kiosk mode: -resume picks up the session saved in a file and saves it there on exit
+const char* resumeFile = NULL;
+
+void saveResumeFile() {
+	if (!resumeFile) return;
+	std::vector<char> buffer;
+	saveGymState(buffer);
+	writeSaveFile(resumeFile, buffer);
+}
+
+// Delta between two buffers of the same size: pairs of varint lengths, unchanged bytes
+// then changed bytes, each changed run followed by its XOR. Applying it to either
+// buffer gives the other.
+void putVarint(std::vector<char>& out, unsigned int value) {
+	while (value >= 0x80) {
+		out.push_back((char)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((char)value);
+}
+
+bool getVarint(const char*& in, const char* end, unsigned int& value) {
+	value = 0;
+	for (int shift = 0; shift < 35 && in < end; shift += 7) {
+		unsigned char byte = (unsigned char)*in++;
+		value |= (unsigned int)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return true;
+	}
+	return false;
+}
+
+void encodeXorDelta(const std::vector<char>& from, const std::vector<char>& to, std::vector<char>& out) {
+	size_t i = 0, n = to.size();
+	while (i < n) {
+		size_t same = i;
+		while (same < n && from[same] == to[same]) same++;
+		size_t changed = same;
+		while (changed < n && (from[changed] != to[changed] || (changed + 1 < n && from[changed + 1] != to[changed + 1]))) changed++;
+		putVarint(out, (unsigned int)(same - i));
+		putVarint(out, (unsigned int)(changed - same));
+		for (size_t k = same; k < changed; k++) out.push_back(from[k] ^ to[k]);
+		i = changed;
+	}
+}
+
+// False, with the buffer partly changed, when the delta runs past either end
+bool applyXorDelta(const char* in, size_t size, std::vector<char>& buffer) {
+	const char* end = in + size;
+	size_t i = 0;
+	unsigned int same, changed;
+	while (in < end) {
+		if (!getVarint(in, end, same) || !getVarint(in, end, changed)) return false;
+		i += same;
+		if (i + changed > buffer.size() || changed > (size_t)(end - in)) return false;
+		for (unsigned int k = 0; k < changed; k++) buffer[i++] ^= *in++;
+	}
+	return true;
+}
+
+// Rewind. After every simulated tick the state is saved and stored in a ring of fixed
+// size as the XOR against the tick before, zero runs packed, with a full keyframe every
+// REWIND_KEYFRAME_TICKS. XOR works both ways, so scrubbing one tick back or forward
+// applies a single delta; a seek starts from the closest keyframe before it, so it never
+// applies more than one keyframe's worth of deltas. The oldest ticks are dropped to make room.
+const int REWIND_KEYFRAME_TICKS = 100;
+const int REWIND_SCRUB_TICKS = 10;  // Per '[' or ']' press
+
+struct RewindFrame {
+	size_t offset;       // Into the ring
+	unsigned int size;   // Bytes stored
+	bool keyframe;
+};
+
+class RewindBuffer {
+public:
+	bool scrubbing = false;
+
+	void init(size_t bytes) {
+		ring.assign(bytes, 0);
+		frames.clear();
+		head = 0;
+		position = 0;
+		scrubbing = false;
+	}
+
+	// Store the state of the tick just simulated
+	void record() {
+		if (ring.empty()) return;
+		TraceScope trace("rewind record");
+		saveGymState(current);
+		bool keyframe = frames.empty() || current.size() != previous.size() || ++sinceKeyframe >= REWIND_KEYFRAME_TICKS;
+		encoded.clear();
+		if (keyframe) {
+			encoded = current;
+			sinceKeyframe = 0;
+		}
+		else {
+			encodeXorDelta(previous, current, encoded);
+		}
+		append(encoded, keyframe);
+		previous.swap(current);
+		position = frames.size() - 1;
+	}
+
+	// Seconds of history behind the newest tick
+	float available() const {
+		return frames.empty() ? 0.0f : (float)(frames.size() - 1) / SIM_TICK_RATE;
+	}
+
+	float offset() const {
+		return frames.empty() ? 0.0f : (float)(frames.size() - 1 - position) / SIM_TICK_RATE;
+	}
+
+	// Move the game to `ticks` from the current position, negative for back
+	void scrub(int ticks) {
+		if (frames.empty()) return;
+		TraceScope trace("rewind scrub");
+		if (!scrubbing) {
+			state = previous;  // The newest frame
+			scrubbing = true;
+		}
+		long target = (long)position + ticks;
+		target = target < 0 ? 0 : (target >= (long)frames.size() ? (long)frames.size() - 1 : target);
+		if (labs(target - (long)position) > REWIND_KEYFRAME_TICKS) {
+			seek((size_t)target);
+		}
+		while (position > (size_t)target) stepBack();
+		while (position < (size_t)target) stepForward();
+		restoreGymState(state);
+		refreshFromGymState();
+	}
+
+	// Continue playing from the scrubbed tick; the ticks after it are forgotten
+	void resume() {
+		if (!scrubbing) return;
+		scrubbing = false;
+		playerKeys = 0;  // The keys held then aren't held now
+		frames.resize(position + 1);
+		head = frames.back().offset + frames.back().size;
+		previous = state;
+		sinceKeyframe = 0;
+		for (size_t i = frames.size(); i-- > 0 && !frames[i].keyframe;) sinceKeyframe++;
+	}
+
+private:
+	std::vector<char> ring;
+	std::deque<RewindFrame> frames;  // Oldest first; the front is always a keyframe
+	size_t head = 0;                 // Where the next frame goes
+	size_t position = 0;             // Frame the game is showing
+	int sinceKeyframe = 0;
+	std::vector<char> previous, current, encoded, state;
+
+	void append(const std::vector<char>& data, bool keyframe) {
+		if (data.size() > ring.size()) {  // Budget too small for one tick
+			frames.clear();
+			return;
+		}
+		if (head + data.size() > ring.size()) {  // Wrap, dropping the frames in the unused end first
+			while (!frames.empty() && frames.front().offset >= head) frames.pop_front();
+			head = 0;
+		}
+		// Drop the frames this one overwrites, and any deltas left without a keyframe
+		while (!frames.empty() && overlaps(frames.front(), head, data.size())) frames.pop_front();
+		while (!frames.empty() && !frames.front().keyframe) frames.pop_front();
+		if (frames.empty() && !keyframe) {  // Nothing left to be a delta against
+			sinceKeyframe = 0;
+			append(current, true);
+			return;
+		}
+		memcpy(&ring[head], &data[0], data.size());
+		RewindFrame frame = { head, (unsigned int)data.size(), keyframe };
+		frames.push_back(frame);
+		head += data.size();
+	}
+
+	static bool overlaps(const RewindFrame& frame, size_t offset, size_t size) {
+		return frame.offset < offset + size && offset < frame.offset + frame.size;
+	}
+
+	void applyDelta(const RewindFrame& frame) {
+		applyXorDelta(&ring[frame.offset], frame.size, state);
+	}
+
+	void loadKeyframe(const RewindFrame& frame) {
+		state.assign(&ring[frame.offset], &ring[frame.offset] + frame.size);
+	}
+
+	void stepBack() {
+		const RewindFrame& frame = frames[position];
+		if (!frame.keyframe) {
+			applyDelta(frame);  // XOR back to the tick before
+			position--;
+		}
+		else {
+			seek(position - 1);
+		}
+	}
+
+	void stepForward() {
+		const RewindFrame& frame = frames[++position];
+		if (frame.keyframe) loadKeyframe(frame);
+		else applyDelta(frame);
+	}
+
+	void seek(size_t target) {
+		size_t key = target;
+		while (!frames[key].keyframe) key--;
+		loadKeyframe(frames[key]);
+		position = key;
+		while (position < target) stepForward();
+	}
+};
+
+size_t rewindBudget = 16u << 20;  // Bytes of history, -rewind <MB>
+RewindBuffer rewindHistory;
+
+// Multiplayer. One process runs the gym with -server and kiosks join it with -connect.
+// The server owns the crowd, every player's avatar and who is on which machine; it
+// sends each client the part of the world around its camera about 20 times a second
+// as an XOR delta against the last snapshot that client acknowledged. Clients still run their own game for their
+// player: arrow steps are applied at once and sent with a sequence number, and every
+// snapshot says which steps the server has applied, so the client puts its player
+// where the server has it and re-applies the steps still in flight. Machines are
+// asked for and the server decides, so two kiosks never get the same one.
+const unsigned short NET_DEFAULT_PORT = 27960;
+const unsigned char NET_PROTOCOL = 3;
+const int NET_MAX_PLAYERS = 8;
+const int NET_SEND_TICKS = 5;          // Server snapshot interval
+const int NET_HISTORY = 32;            // Snapshots kept as delta baselines
+const int NET_MAX_MOVES = 128;         // Unacknowledged moves sent with every input packet
+const float NET_TIMEOUT = 5.0f;        // Seconds of silence before a player is dropped
+const size_t NET_MAX_PACKET = 60000;   // UDP datagram; fine on a venue LAN
+
+// Interest management. Each client sees at most NET_INTEREST_SLOTS people, the nearest
+// to the floor point its camera looks at within NET_INTEREST_RADIUS, and the machines
+// inside that circle. People further than NET_NEAR_RADIUS are only refreshed every
+// NET_FAR_INTERVAL snapshots, and unchanged slots cost nothing in the delta, so what
+// a client receives doesn't grow with the number of people in the gym.
+const int NET_INTEREST_SLOTS = 32;
+const float NET_INTEREST_RADIUS = 3.5f;
+const float NET_NEAR_RADIUS = 1.5f;
+const int NET_FAR_INTERVAL = 4;
+const float NET_INTEREST_CELL = 1.0f;         // Spatial hash of people on the server
+const unsigned short NET_NO_ENTITY = 0xFFFF;  // Empty slot
+const short NET_STATION_UNSEEN = -2;          // Machine outside the client's interest
+
+enum NetMessage { NET_HELLO = 1, NET_WELCOME, NET_FULL, NET_INPUT, NET_SNAPSHOT };
+
+#ifdef _WIN32
+typedef SOCKET NetSocket;
+typedef int NetAddressLength;
+#else
+typedef int NetSocket;
+typedef socklen_t NetAddressLength;
+const NetSocket INVALID_SOCKET = -1;
+#endif
+
+inline void closeSocket(NetSocket handle) {
+#ifdef _WIN32
+	closesocket(handle);
+#else
+	::close(handle);
+#endif
+}
+
+// Non-blocking UDP socket
+class UdpSocket {
+public:
+	float dropRate = 0.0f;  // -netloss, for testing prediction over loopback
+
+	bool open(unsigned short port) {
+#ifdef _WIN32
+		WSADATA wsa;
+		if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+#endif
+		handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (handle == INVALID_SOCKET) return false;
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons(port);
+		if (bind(handle, (sockaddr*)&address, sizeof(address)) != 0) {
+			std::cerr << "Failed to bind UDP port " << port << std::endl;
+			close();
+			return false;
+		}
+#ifdef _WIN32
+		u_long nonBlocking = 1;
+		ioctlsocket(handle, FIONBIO, &nonBlocking);
+#else
+		fcntl(handle, F_SETFL, fcntl(handle, F_GETFL, 0) | O_NONBLOCK);
+#endif
+		return true;
+	}
+
+	void close() {
+		if (handle != INVALID_SOCKET) closeSocket(handle);
+		handle = INVALID_SOCKET;
+	}
+
+	void send(const sockaddr_in& to, const std::vector<char>& packet) {
+		if (handle == INVALID_SOCKET || packet.size() > NET_MAX_PACKET) return;
+		if (dropRate > 0.0f && rand() < dropRate * RAND_MAX) return;
+		sendto(handle, &packet[0], (int)packet.size(), 0, (const sockaddr*)&to, sizeof(to));
+	}
+
+	// Size of the next datagram, or -1 when there is none
+	int receive(std::vector<char>& packet, sockaddr_in& from) {
+		if (handle == INVALID_SOCKET) return -1;
+		packet.resize(NET_MAX_PACKET);
+		NetAddressLength length = sizeof(from);
+		int size = (int)recvfrom(handle, &packet[0], (int)packet.size(), 0, (sockaddr*)&from, &length);
+		packet.resize(size > 0 ? size : 0);
+		return size;
+	}
+
+private:
+	NetSocket handle = INVALID_SOCKET;
+};
+
+bool sameAddress(const sockaddr_in& a, const sockaddr_in& b) {
+	return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+// Packets are a protocol byte, a message byte and fields in host order; every kiosk is x86
+template <typename T>
+void netPut(std::vector<char>& packet, const T& value) {
+	const char* bytes = reinterpret_cast<const char*>(&value);
+	packet.insert(packet.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+bool netGet(const std::vector<char>& packet, size_t& read, T& value) {
+	if (read + sizeof(T) > packet.size()) return false;
+	memcpy(&value, &packet[read], sizeof(T));
+	read += sizeof(T);
+	return true;
+}
+
+void netBegin(std::vector<char>& packet, NetMessage message) {
+	packet.clear();
+	netPut(packet, NET_PROTOCOL);
+	netPut(packet, (unsigned char)message);
+}
+
+// One replicated person, quantized to millimetres and tenths of a degree
+struct NetEntity {
+	unsigned short id;
+	unsigned char clip;
+	unsigned char exercising;
+	short x, y, z, heading;
+};
+
+// What follows the snapshot header: who holds each station, then NET_INTEREST_SLOTS
+// entities. A person keeps their slot while they stay in view, so slots change little
+// from one snapshot to the next.
+struct NetWorldHeader {
+	short stationOwner[STATION_COUNT];  // Entity id, -1 when free
+};
+
+inline short netQuantize(float value, float scale) {
+	return (short)floor(value * scale + 0.5f);
+}
+
+// Close enough to a station's machine to use it: in its trigger, the same test the client made
+bool nearStation(float x, float z, int station) {
+	return inTrigger(*gymStations[station].box, x, z);
+}
+
+const int NET_PLAYER_AGENT = 1000000;  // stationReservations value of player slot 0
+
+struct NetPlayer {
+	bool active;
+	sockaddr_in address;
+	float x, z, heading;
+	CharacterMotion motion;
+	float savedX, savedZ;     // Where the player stood before getting on a machine
+	int station;              // Held station, -1 for none
+	int wanted;               // Station the client last asked for, -1 for none
+	float silence, walking;   // Seconds since the last packet, and of walk clip left
+	unsigned int lastMove;    // Sequence number of the last move applied
+	unsigned int ackedTick;   // Newest snapshot the client has, 0 for none
+	AnimationController animation;
+	float focusX, focusZ;     // Where the client's camera looks
+	NetEntity slots[NET_INTEREST_SLOTS];  // As last sent
+	std::deque<std::pair<unsigned int, std::vector<char> > > history;  // Tick and world sent, oldest first
+};
+
+class NetServer {
+public:
+	bool start(unsigned short port) {
+		if (!socket.open(port)) return false;
+		for (int p = 0; p < NET_MAX_PLAYERS; p++) players[p].active = false;
+		std::cout << "Gym server listening on UDP port " << port << std::endl;
+		return true;
+	}
+
+	UdpSocket& transport() { return socket; }
+
+	// Read what the clients sent, move their avatars and send snapshots when due
+	void update(float deltaTime) {
+		TraceScope trace("net server");
+		sockaddr_in from;
+		while (socket.receive(packet, from) >= 0) {
+			if (packet.size() >= 2 && (unsigned char)packet[0] == NET_PROTOCOL) handle(from);
+		}
+		for (int p = 0; p < NET_MAX_PLAYERS; p++) {
+			NetPlayer& player = players[p];
+			if (!player.active) continue;
+			player.silence += deltaTime;
+			if (player.silence > NET_TIMEOUT) {
+				std::cout << "Player " << p << " timed out" << std::endl;
+				leaveStation(p);
+				player.active = false;
+				continue;
+			}
+			player.walking -= deltaTime;
+			player.animation.requestLocomotion(player.walking > 0.0f ? CLIP_WALK : CLIP_IDLE);
+			player.animation.advance(deltaTime);
+		}
+		if (++ticks % NET_SEND_TICKS == 0) sendSnapshots();
+	}
 
-		// Move along the Y-axis
-	case 'j':  // Move up along Y-axis
-		camera.eye.y += moveStep;
-		camera.center.y += moveStep;
-		break;
-	case 'k':  // Move down along Y-axis
-		camera.eye.y -= moveStep;
-		camera.center.y -= moveStep;
-		break;
+private:
+	UdpSocket socket;
+	NetPlayer players[NET_MAX_PLAYERS];
+	std::vector<NetEntity> entities;  // Everyone this tick, by id
+	std::vector<float> entityX, entityZ;
+	int playerEntity[NET_MAX_PLAYERS];         // Index into entities of each active player
+	std::vector<int> cellStart, cellEntities;  // Spatial hash, laid out like the crowd's neighbour grid
+	std::vector<std::pair<float, int> > nearby;  // Squared distance and entity
+	std::vector<char> packet, world, delta;
+	unsigned int ticks = 0;
+	int gridX = 0, gridZ = 0;
+
+	void handle(const sockaddr_in& from) {
+		int slot = -1;
+		for (int p = 0; p < NET_MAX_PLAYERS; p++) {
+			if (players[p].active && sameAddress(players[p].address, from)) slot = p;
+		}
+		if (packet[1] == NET_HELLO) {
+			if (slot < 0) slot = join(from);
+			netBegin(packet, slot < 0 ? NET_FULL : NET_WELCOME);
+			netPut(packet, (short)slot);
+			socket.send(from, packet);
+			return;
+		}
+		if (packet[1] != NET_INPUT || slot < 0) return;
+
+		NetPlayer& player = players[slot];
+		player.silence = 0.0f;
+		size_t read = 2;
+		unsigned int acked, firstMove;
+		signed char wanted;
+		float focusX, focusZ;
+		unsigned char count;
+		if (!netGet(packet, read, acked) || !netGet(packet, read, wanted) || !netGet(packet, read, focusX) || !netGet(packet, read, focusZ) ||
+			!netGet(packet, read, firstMove) || !netGet(packet, read, count)) return;
+		if (acked > player.ackedTick) player.ackedTick = acked;
+		player.focusX = focusX;
+		player.focusZ = focusZ;
+		// The client only keeps NET_MAX_MOVES; what it let go of is gone, so carry on
+		// from the oldest it still has and let reconciliation snap it to us
+		if (count > 0 && (int)(firstMove - (player.lastMove + 1)) > 0) player.lastMove = firstMove - 1;
+		for (unsigned int k = 0; k < count; k++) {
+			unsigned char key;
+			if (!netGet(packet, read, key)) return;
+			if (firstMove + k != player.lastMove + 1) continue;  // Applied already, or a gap
+			player.lastMove++;
+			if (player.station >= 0) continue;  // Nobody walks off a machine, as locally
+			if (moveCharacter(player.x, player.z, player.heading, player.motion, key, SIM_DT) > 0.0f) player.walking = 0.5f;
+		}
+		player.wanted = wanted;
+		if (wanted != player.station) {
+			if (player.station >= 0) leaveStation(slot);
+			if (wanted >= 0 && wanted < STATION_COUNT) takeStation(slot, wanted);
+		}
+	}
 
-		// Move along the Z-axis
-	case 'l':  // Move forward along Z-axis
-		camera.eye.z -= moveStep;
-		camera.center.z -= moveStep;
-		break;
-	case ';':  // Move backward along Z-axis
-		camera.eye.z += moveStep;
-		camera.center.z += moveStep;
-		break;
-	case '/':
-		deadliftAnimationTime += 0.1;
-		break;
-	case 27:  // Escape key
-		exit(0);
-		break;
-	default:
-		break;
+	int join(const sockaddr_in& from) {
+		for (int p = 0; p < NET_MAX_PLAYERS; p++) {
+			NetPlayer& player = players[p];
+			if (player.active) continue;
+			player.active = true;
+			player.address = from;
+			player.x = -0.5f;  // Where the single-player game starts
+			player.z = 1.5f;
+			player.heading = 0.0f;
+			player.motion = CharacterMotion();
+			player.station = -1;
+			player.wanted = -1;
+			player.silence = 0.0f;
+			player.walking = 0.0f;
+			player.lastMove = 0;
+			player.ackedTick = 0;
+			player.animation = AnimationController();
+			player.focusX = player.x;
+			player.focusZ = player.z;
+			for (int k = 0; k < NET_INTEREST_SLOTS; k++) player.slots[k].id = NET_NO_ENTITY;
+			player.history.clear();
+			std::cout << "Player " << p << " joined" << std::endl;
+			return p;
+		}
+		return -1;
 	}
-	if (key == 'E' || key == 'e') {  // Check for both uppercase and lowercase
-		if (checkCollisionChinUp && !isAnimatingChinUp) {
-			startChinUpAnimation();  // Start the chin-up animation
-			ChinUpUsed = true;
-			playChinUpSound();
+
+	// The server's one decision about machines: first come, first served, and only next to it
+	void takeStation(int slot, int station) {
+		NetPlayer& player = players[slot];
+		int expected = -1;
+		if (!nearStation(player.x, player.z, station)) return;
+		if (!stationReservations[station].compare_exchange_strong(expected, NET_PLAYER_AGENT + slot)) return;
+		const GymStation& machine = gymStations[station];
+		player.station = station;
+		player.motion = CharacterMotion();
+		player.savedX = player.x;
+		player.savedZ = player.z;
+		player.x = machine.spotX;
+		player.z = machine.spotZ;
+		player.heading = machine.heading;
+		player.animation.playExercise(machine.clip);
+	}
+
+	void leaveStation(int slot) {
+		NetPlayer& player = players[slot];
+		if (player.station < 0) return;
+		stationReservations[player.station].store(-1);
+		player.station = -1;
+		player.x = player.savedX;
+		player.z = player.savedZ;
+		player.animation.stopExercise();
+	}
+
+	void addEntity(unsigned short id, const AnimationController& animation, float x, float y, float z, float heading) {
+		NetEntity entity = { id, (unsigned char)animation.current.clip, (unsigned char)animation.exercising,
+			netQuantize(x, 1000.0f), netQuantize(y, 1000.0f), netQuantize(z, 1000.0f), netQuantize(heading, 10.0f) };
+		entities.push_back(entity);
+		entityX.push_back(x);
+		entityZ.push_back(z);
+	}
+
+	int cellOf(float x, float z) const {
+		int cx = (int)((x - ROOM_MIN_X) / NET_INTEREST_CELL);
+		int cz = (int)((z - ROOM_MIN_Z) / NET_INTEREST_CELL);
+		cx = cx < 0 ? 0 : (cx >= gridX ? gridX - 1 : cx);
+		cz = cz < 0 ? 0 : (cz >= gridZ ? gridZ - 1 : cz);
+		return cz * gridX + cx;
+	}
+
+	// Everyone's state this tick, hashed by where they stand
+	void gatherEntities() {
+		entities.clear();
+		entityX.clear();
+		entityZ.clear();
+		for (int p = 0; p < NET_MAX_PLAYERS; p++) {
+			const NetPlayer& player = players[p];
+			if (!player.active) continue;
+			float y = player.station >= 0 ? gymStations[player.station].spotY : 0.1f;
+			playerEntity[p] = (int)entities.size();
+			addEntity((unsigned short)p, player.animation, player.x, y, player.z, player.heading);
 		}
-		if (checkCollisionBenchPress && !isAnimatingBenchPress) {
-			startBenchPressAnimation();  // Start the chin-up animation
-			BenchPressUsed = true;
-			playBenchPressSound();
+		for (size_t i = 0; i < crowdAgents.size(); i++) {
+			const CrowdAgent& agent = crowdAgents[i];
+			addEntity((unsigned short)(NET_MAX_PLAYERS + i), crowdAnimation[i], agent.x, agent.y, agent.z, agent.heading);
 		}
-		if (checkCollisionSmith && !isAnimatingSmith) {
-			isAnimatingSmith = true;
-			animationStep = 0;       // Start scaling up
-			scaleFactor = 1.0f;      // Reset scale factor
-			glutTimerFunc(animationSpeed, updateSmithAnimation, 0);
-			SmithUsed = true;
-			playSmithSound();
+
+		gridX = (int)((ROOM_MAX_X - ROOM_MIN_X) / NET_INTEREST_CELL) + 1;
+		gridZ = (int)((ROOM_MAX_Z - ROOM_MIN_Z) / NET_INTEREST_CELL) + 1;
+		cellStart.assign(gridX * gridZ + 1, 0);
+		cellEntities.resize(entities.size());
+		for (size_t e = 0; e < entities.size(); e++) cellStart[cellOf(entityX[e], entityZ[e]) + 1]++;
+		for (int c = 0; c < gridX * gridZ; c++) cellStart[c + 1] += cellStart[c];
+		std::vector<int> fill(cellStart.begin(), cellStart.end() - 1);
+		for (size_t e = 0; e < entities.size(); e++) cellEntities[fill[cellOf(entityX[e], entityZ[e])]++] = (int)e;
+	}
+
+	// The world as one player should see it: the nearest people around its camera, each
+	// kept in the slot it had, and the owners of the machines in view
+	void buildWorld(int slot) {
+		NetPlayer& player = players[slot];
+		float r = NET_INTEREST_RADIUS;
+		nearby.clear();
+		bool seen = false;
+		int first = cellOf(player.focusX - r, player.focusZ - r), last = cellOf(player.focusX + r, player.focusZ + r);
+		for (int cz = first / gridX; cz <= last / gridX; cz++) {
+			for (int cx = first % gridX; cx <= last % gridX; cx++) {
+				int c = cz * gridX + cx;
+				for (int k = cellStart[c]; k < cellStart[c + 1]; k++) {
+					int e = cellEntities[k];
+					float dx = entityX[e] - player.focusX, dz = entityZ[e] - player.focusZ;
+					float distance = dx * dx + dz * dz;
+					if (entities[e].id == slot) {  // Our own avatar always comes first
+						distance = -1.0f;
+						seen = true;
+					}
+					if (distance <= r * r) nearby.push_back(std::make_pair(distance, e));
+				}
+			}
 		}
-		if (checkCollisionTreadMill && !isAnimatingTreadmill) {
-			startTreadmillAnimation();  // Start the chin-up animation
-			TreadMillUsed = true;
-			playTreadmillSound();
+		if (!seen) nearby.push_back(std::make_pair(-1.0f, playerEntity[slot]));
+		if (nearby.size() > (size_t)NET_INTEREST_SLOTS) {
+			std::partial_sort(nearby.begin(), nearby.begin() + NET_INTEREST_SLOTS, nearby.end());
+			nearby.resize(NET_INTEREST_SLOTS);
 		}
-		if (checkCollisionDumbellRack) {
-			isColorChanging = true;
-			DumbellRackUsed = true;
-			playDumbbellRackSound();
+
+		// Keep people in their slots and give the slots of those gone to newcomers
+		int placed[NET_INTEREST_SLOTS];
+		bool kept[NET_INTEREST_SLOTS];
+		for (int k = 0; k < NET_INTEREST_SLOTS; k++) placed[k] = -1;
+		for (size_t n = 0; n < nearby.size(); n++) {
+			kept[n] = false;
+			for (int k = 0; k < NET_INTEREST_SLOTS && !kept[n]; k++) {
+				if (player.slots[k].id == entities[nearby[n].second].id) {
+					placed[k] = (int)n;
+					kept[n] = true;
+				}
+			}
 		}
-		if (checkCollisionDeadLift && !isLifting && DumbellRackUsed && TreadMillUsed && SmithUsed && BenchPressUsed && ChinUpUsed) {
-			startDeadliftAnimation();
-			playDeadliftSound();
+		int freeSlot = 0;
+		for (size_t n = 0; n < nearby.size(); n++) {
+			if (kept[n]) continue;
+			while (placed[freeSlot] >= 0) freeSlot++;
+			placed[freeSlot] = (int)n;
+			player.slots[freeSlot].id = NET_NO_ENTITY;  // Sent in full below
+		}
+		for (int k = 0; k < NET_INTEREST_SLOTS; k++) {
+			NetEntity& sent = player.slots[k];
+			if (placed[k] < 0) {
+				memset(&sent, 0, sizeof(sent));
+				sent.id = NET_NO_ENTITY;
+				continue;
+			}
+			const std::pair<float, int>& n = nearby[placed[k]];
+			const NetEntity& now = entities[n.second];
+			// Far people take turns, a quarter of them each snapshot
+			bool refreshFar = (ticks / NET_SEND_TICKS + now.id) % NET_FAR_INTERVAL == 0;
+			if (sent.id != now.id || n.first < NET_NEAR_RADIUS * NET_NEAR_RADIUS || refreshFar) sent = now;
+		}
+
+		NetWorldHeader header;
+		for (int s = 0; s < STATION_COUNT; s++) {
+			// Nearest point of the machine to the camera's focus
+			const BoundingBox& box = *gymStations[s].box;
+			float x = player.focusX < box.minX ? box.minX : (player.focusX > box.maxX ? box.maxX : player.focusX);
+			float z = player.focusZ < box.minZ ? box.minZ : (player.focusZ > box.maxZ ? box.maxZ : player.focusZ);
+			bool own = s == player.station || s == player.wanted;  // The client waits to hear about these
+			if (!own && (x - player.focusX) * (x - player.focusX) + (z - player.focusZ) * (z - player.focusZ) > r * r) {
+				header.stationOwner[s] = NET_STATION_UNSEEN;
+				continue;
+			}
+			int owner = stationReservations[s].load();
+			header.stationOwner[s] = (short)(owner < 0 ? -1 : (owner >= NET_PLAYER_AGENT ? owner - NET_PLAYER_AGENT : NET_MAX_PLAYERS + owner));
 		}
+		world.clear();
+		netPut(world, header);
+		const char* bytes = reinterpret_cast<const char*>(player.slots);
+		world.insert(world.end(), bytes, bytes + sizeof(player.slots));
 	}
-	if (key == 'P' || key == 'p') {  // Check for both uppercase and lowercase
-		if (checkCollisionChinUp && isAnimatingChinUp) {
-			isAnimatingChinUp = false;  // End the animation after one full cycle
-			PosY = 0;           // Reset position
-			armAngle = 0.0f;           // Reset arm angle
-			leftarmAngle = 0.0f;
-			headPosY = 0.3f;
-			torsoPosY = 0.0f;
-			leftLegPosY = rightLegPosY = -0.3f;
-			leftArmPosY = rightArmPosY = 0.0f;
-			posX = startPosX;
-			posZ = startPosZ;
-			rotationAngle = -90;
-			animationTime = 0;
-			alSourceStop(sourceChinUp);
+
+	void sendSnapshots() {
+		gatherEntities();
+		for (int p = 0; p < NET_MAX_PLAYERS; p++) {
+			NetPlayer& player = players[p];
+			if (!player.active) continue;
+			buildWorld(p);
+			player.history.push_back(std::make_pair(ticks, world));
+			if (player.history.size() > (size_t)NET_HISTORY) player.history.pop_front();
+			// Against the newest snapshot the client has, when it is still here
+			const std::vector<char>* base = NULL;
+			for (size_t h = 0; h < player.history.size(); h++) {
+				if (player.history[h].first == player.ackedTick) base = &player.history[h].second;
+			}
+			netBegin(packet, NET_SNAPSHOT);
+			netPut(packet, ticks);
+			netPut(packet, base ? player.ackedTick : 0u);
+			netPut(packet, player.lastMove);
+			if (base) {
+				delta.clear();
+				encodeXorDelta(*base, world, delta);
+				packet.insert(packet.end(), delta.begin(), delta.end());
+			}
+			else {
+				packet.insert(packet.end(), world.begin(), world.end());
+			}
+			socket.send(player.address, packet);
 		}
-		if (checkCollisionBenchPress && isAnimatingBenchPress) {
-			isAnimatingBenchPress = false;
-			posX = startPosX;      // Reset X position
-			posZ = startPosZ;      // Reset Z position
-			PosY = 0.1f;                // Reset height
-			armAngle = 0.0f;            // Reset arms
-			leftarmAngle = 0.0f;
-			barPosY = 0.6f;             // Reset bar height
-			rotationAngle = 0.0f;
-			rotationY = 1.0f;
-
-			rotationZ = 0.0f;
-			rightArmPosY = 0.0f;
-			leftArmPosY = 0.0f;
-			rightArmPosZ = 0.0f;
-			leftArmPosZ = 0.0f;
-			rightArmPosX = -0.2f;
-			leftArmPosX = 0.2f;
-			rotationBench = 0.0f;
-			benchPressAnimationTime = 0.0f;  // Reset animation time
-			alSourceStop(sourceBenchPress);
+	}
+};
+
+NetServer netServer;
+
+// The kiosk side. Runs on the simulation thread; until the server answers the game
+// plays on its own.
+class NetClient {
+public:
+	int slot = -1;  // Our entity id once welcomed
+
+	bool connect(const char* host, unsigned short port) {
+		if (!socket.open(0)) return false;
+		addrinfo hints, *found = NULL;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		if (getaddrinfo(host, NULL, &hints, &found) != 0 || !found) {
+			std::cerr << "Unknown gym server: " << host << std::endl;
+			socket.close();
+			return false;
 		}
-		if (checkCollisionSmith && isAnimatingSmith) {
-			animationStep = 2;       // Start scaling down phase
+		server = *reinterpret_cast<sockaddr_in*>(found->ai_addr);
+		server.sin_port = htons(port);
+		freeaddrinfo(found);
+		enabled = true;
+		return true;
+	}
+
+	bool connected() const {
+		return slot >= 0;
+	}
+
+	UdpSocket& transport() { return socket; }
+
+	// The player is about to walk a tick with these keys; the server walks it too
+	void predictMove(unsigned char keys, const CharacterMotion& motion) {
+		if (!connected()) return;
+		if (pendingMoves.size() >= (size_t)NET_MAX_MOVES) pendingMoves.pop_front();  // Hopelessly behind; the server skips ahead
+		NetMove move = { ++lastMove, keys, motion };
+		pendingMoves.push_back(move);
+	}
+
+	// 'e' while touching station s; it starts once the server has given it to us
+	void requestStation(int station) {
+		wantedStation = station;
+		granted = false;
+		waiting = 0.0f;
+	}
+
+	void update(float deltaTime) {
+		if (!enabled) return;
+		TraceScope trace("net client");
+		sockaddr_in from;
+		while (socket.receive(packet, from) >= 0) {
+			if (packet.size() < 2 || (unsigned char)packet[0] != NET_PROTOCOL || !sameAddress(from, server)) continue;
+			size_t read = 2;
+			short welcome;
+			if (packet[1] == NET_WELCOME && slot < 0 && netGet(packet, read, welcome)) {
+				slot = welcome;
+				clearCrowd();  // The server's crowd replaces ours
+				std::cout << "Joined the gym server as player " << slot << std::endl;
+			}
+			else if (packet[1] == NET_FULL && slot < 0) {
+				std::cout << "Gym server is full" << std::endl;
+				enabled = false;
+				return;
+			}
+			else if (packet[1] == NET_SNAPSHOT && connected()) {
+				receiveSnapshot();
+			}
 		}
-		if (checkCollisionTreadMill && isAnimatingTreadmill) {
-			isAnimatingTreadmill = false;
-			legAngle = 0.0f;
-			armAngle = 0.0f;
-			leftarmAngle = 0.0f;
-			TorsoAngle = 0.0f;
-			// Reset player position if desired
-			posX = startPosX;
-			posZ = startPosZ;
-			PosY = 0.1f;
-			alSourceStop(sourceTreadmill);
+
+		if (!connected()) {
+			if (++ticks % 50 == 0) {  // Knock twice a second
+				netBegin(packet, NET_HELLO);
+				socket.send(server, packet);
+			}
+			return;
 		}
-		if (checkCollisionDumbellRack && isColorChanging) {
-			isColorChanging = false;
-			colorChangeTime = 0.0f;   // Start the chin-up animation
-			alSourceStop(sourceDumbbellRack);
+
+		// A station we got has ended locally, or the server gave it to someone else
+		if (wantedStation >= 0 && granted && !playerAnimation.exercising) wantedStation = -1;
+		waiting += deltaTime;
+		if (wantedStation >= 0 && !granted && waiting > 1.0f) wantedStation = -1;  // Turned down, too far away
+		interpolate(deltaTime);
+		if (!pendingMoves.empty() || ++ticks % NET_SEND_TICKS == 0) sendInput();
+	}
+
+private:
+	UdpSocket socket;
+	sockaddr_in server;
+	bool enabled = false;
+	unsigned int ticks = 0, lastMove = 0, newestTick = 0;
+	// A tick of walking the server hasn't confirmed, with the velocity it started from
+	struct NetMove {
+		unsigned int sequence;
+		unsigned char keys;
+		CharacterMotion before;
+	};
+	std::deque<NetMove> pendingMoves;
+	int wantedStation = -1;
+	bool granted = false;
+	float waiting = 0.0f;
+	std::deque<std::pair<unsigned int, std::vector<char> > > history;  // Received worlds, oldest first
+	std::vector<char> packet, world;
+
+	// Someone else in view, drawn as crowdAgents[i] for remotes[i]
+	struct NetRemote {
+		unsigned short id;
+		float from[4], to[4];   // x, y, z, heading
+		float blend, span;      // Seconds into and of the move from one to the other
+		unsigned int changed;   // Tick of the last snapshot that moved them
+	};
+	std::vector<NetRemote> remotes;
+
+	// Floor point in the middle of the view, in the player's coordinates
+	void cameraFocus(float& x, float& z) const {
+		Vector3f eye = camera.eye, center = camera.center;
+		float down = eye.y - center.y;
+		float t = down > 0.01f ? eye.y / down : 1.0f;  // Where the line of sight meets the floor
+		x = eye.x + (center.x - eye.x) * t - 2.5f;
+		z = eye.z + (center.z - eye.z) * t - 2.0f;
+		x = x < ROOM_MIN_X ? ROOM_MIN_X : (x > ROOM_MAX_X ? ROOM_MAX_X : x);
+		z = z < ROOM_MIN_Z ? ROOM_MIN_Z : (z > ROOM_MAX_Z ? ROOM_MAX_Z : z);
+	}
+
+	void sendInput() {
+		float focusX, focusZ;
+		cameraFocus(focusX, focusZ);
+		netBegin(packet, NET_INPUT);
+		netPut(packet, newestTick);
+		netPut(packet, (signed char)wantedStation);
+		netPut(packet, focusX);
+		netPut(packet, focusZ);
+		netPut(packet, pendingMoves.empty() ? lastMove + 1 : pendingMoves.front().sequence);
+		netPut(packet, (unsigned char)pendingMoves.size());
+		for (size_t k = 0; k < pendingMoves.size(); k++) netPut(packet, pendingMoves[k].keys);
+		socket.send(server, packet);
+	}
+
+	void receiveSnapshot() {
+		size_t read = 2;
+		unsigned int tick, baseTick, appliedMove;
+		if (!netGet(packet, read, tick) || !netGet(packet, read, baseTick) || !netGet(packet, read, appliedMove)) return;
+		if (tick <= newestTick) return;  // Late or duplicated
+		if (baseTick == 0) {
+			world.assign(packet.begin() + read, packet.end());
+		}
+		else {
+			const std::vector<char>* base = NULL;
+			for (size_t h = 0; h < history.size(); h++) {
+				if (history[h].first == baseTick) base = &history[h].second;
+			}
+			if (!base) return;
+			world = *base;
+			if (!applyXorDelta(&packet[read], packet.size() - read, world)) return;
+		}
+		NetWorldHeader header;
+		size_t offset = 0;
+		if (!netGet(world, offset, header) || world.size() != sizeof(header) + NET_INTEREST_SLOTS * sizeof(NetEntity)) return;
+		newestTick = tick;
+		history.push_back(std::make_pair(tick, world));
+		if (history.size() > (size_t)NET_HISTORY) history.pop_front();
+
+		while (!pendingMoves.empty() && pendingMoves.front().sequence <= appliedMove) pendingMoves.pop_front();
+		if (wantedStation >= 0 && !granted) {
+			short owner = header.stationOwner[wantedStation];
+			if (owner == slot) {
+				granted = true;
+				handleKeyboard('e', 0, 0);  // Ours; start it for real
+			}
+			else if (owner >= 0) {
+				wantedStation = -1;  // Someone beat us to it
+			}
+		}
+
+		// People keep their animation and carry on from where they are drawn; newcomers
+		// appear where the server has them
+		const NetEntity* entities = reinterpret_cast<const NetEntity*>(&world[sizeof(header)]);
+		std::vector<NetRemote> seen;
+		std::vector<CrowdAgent> agents;
+		std::vector<AnimationController> animations;
+		for (int k = 0; k < NET_INTEREST_SLOTS; k++) {
+			const NetEntity& entity = entities[k];
+			if (entity.id == NET_NO_ENTITY) continue;
+			if (entity.id == slot) {
+				reconcile(entity);
+				continue;
+			}
+			float place[4] = { entity.x / 1000.0f, entity.y / 1000.0f, entity.z / 1000.0f, entity.heading / 10.0f };
+			size_t old = 0;
+			while (old < remotes.size() && remotes[old].id != entity.id) old++;
+			NetRemote remote;
+			CrowdAgent agent = CrowdAgent();
+			AnimationController animation;
+			if (old < remotes.size()) {
+				remote = remotes[old];
+				agent = crowdAgents[old];
+				animation = crowdAnimation[old];
+			}
+			else {
+				remote.id = entity.id;
+				memcpy(remote.to, place, sizeof(place));
+				remote.changed = tick;
+				agent.station = -1;
+				agent.x = place[0];
+				agent.y = place[1];
+				agent.z = place[2];
+				agent.heading = place[3];
+			}
+			if (memcmp(remote.to, place, sizeof(place)) != 0) {
+				// Far people are refreshed less often; spread their move over the gap
+				float gap = (tick - remote.changed) * SIM_DT;
+				float shortest = NET_SEND_TICKS * SIM_DT, longest = NET_FAR_INTERVAL * shortest;
+				float current[4] = { agent.x, agent.y, agent.z, agent.heading };
+				memcpy(remote.from, current, sizeof(current));
+				memcpy(remote.to, place, sizeof(place));
+				remote.blend = 0.0f;
+				remote.span = gap < shortest ? shortest : (gap > longest ? longest : gap);
+				remote.changed = tick;
+			}
+			else if (old == remotes.size()) {
+				memcpy(remote.from, place, sizeof(place));
+				remote.blend = remote.span = 1.0f;
+			}
+			if (entity.exercising && (!animation.exercising || animation.current.clip != entity.clip)) {
+				animation.playExercise(entity.clip);
+			}
+			else if (!entity.exercising) {
+				if (animation.exercising) animation.stopExercise();
+				animation.requestLocomotion(entity.clip);
+			}
+			seen.push_back(remote);
+			agents.push_back(agent);
+			animations.push_back(animation);
+		}
+		remotes.swap(seen);
+		crowdAgents.swap(agents);
+		crowdAnimation.swap(animations);
+	}
+
+	// Put the player where the server has it, plus the moves it hasn't seen yet. The
+	// velocity comes from our own record, as it only depends on the keys.
+	void reconcile(const NetEntity& self) {
+		if (playerAnimation.exercising || self.exercising) return;  // The machine places the player
+		float x = self.x / 1000.0f, z = self.z / 1000.0f, heading = rotationAngle;
+		CharacterMotion motion = pendingMoves.empty() ? playerMotion : pendingMoves.front().before;
+		for (size_t k = 0; k < pendingMoves.size(); k++) moveCharacter(x, z, heading, motion, pendingMoves[k].keys, SIM_DT);
+		if (fabs(x - posX) > 0.01f || fabs(z - posZ) > 0.01f) {
+			posX = x;
+			posZ = z;
+			startPosX = x;
+			startPosZ = z;
+		}
+	}
+
+	// Other people move smoothly from where they were drawn to where the server has them
+	void interpolate(float deltaTime) {
+		for (size_t i = 0; i < crowdAgents.size() && i < remotes.size(); i++) {
+			NetRemote& remote = remotes[i];
+			CrowdAgent& agent = crowdAgents[i];
+			remote.blend += deltaTime;
+			float t = remote.blend < remote.span ? remote.blend / remote.span : 1.0f;
+			const float* a = remote.from;
+			const float* b = remote.to;
+			agent.x = a[0] + (b[0] - a[0]) * t;
+			agent.y = a[1] + (b[1] - a[1]) * t;
+			agent.z = a[2] + (b[2] - a[2]) * t;
+			float turn = fmod(b[3] - a[3] + 540.0f, 360.0f) - 180.0f;  // The short way round
+			agent.heading = a[3] + turn * t;
+			crowdAnimation[i].advance(deltaTime);
+		}
+	}
+};
+
+NetClient netClient;
+
+// The station 'e' would use from the collision flags, -1 for a machine nobody queues for
+int touchedStation() {
+	if (checkCollisionChinUp) return 0;
+	if (checkCollisionBenchPress) return 1;
+	if (checkCollisionTreadMill) {
+		int best = 2;
+		for (int s = 3; s <= 4; s++) {
+			if (fabs(gymStations[s].approachZ - posZ) < fabs(gymStations[best].approachZ - posZ)) best = s;
+		}
+		return best;
+	}
+	if (checkCollisionDeadLift && DumbellRackUsed && TreadMillUsed && SmithUsed && BenchPressUsed && ChinUpUsed) return 5;
+	return -1;
+}
+
+// -server: no window and no player of its own, just the crowd and everyone's avatars
+int runServer(unsigned short port, float loss) {
+	if (!netServer.start(port)) return 1;
+	netServer.transport().dropRate = loss;
+	const std::chrono::microseconds tick(1000000 / SIM_TICK_RATE);
+	std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+	for (;;) {
+		updateNavigation();
+		updateCrowd(SIM_DT);
+		netServer.update(SIM_DT);
+		simulationTicks++;
+		next += tick;
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now - next > std::chrono::milliseconds(250)) {
+			next = now;
+		}
+		std::this_thread::sleep_until(next);
+	}
+}
+
+// Every input the simulation consumes, stamped with the tick it was applied on, so a
+// session can be replayed exactly. The header is followed by a save of the state the
+// session started from, then each record is the tick delta as a varint, the event
+// type and its payload; a trailer holds the last tick and the state checksum there,
+// which a replay must match.
+// When F9 loads from disk, the save it read follows as a JOURNAL_SAVE record (size as a
+// varint, then the bytes), so a replay doesn't depend on the file as it is then.
+const unsigned short JOURNAL_VERSION = 4;
+const unsigned char JOURNAL_END = 0xFF;
+const unsigned char JOURNAL_SAVE = 0xFE;
+
+struct JournalEntry {
+	unsigned int tick;
+	InputEvent input;
+	std::vector<char> save;  // What this F9 read from disk, else empty
+};
+
+class InputJournal {
+public:
+	bool open(const char* filename) {
+		file.open(filename, std::ios::binary);
+		if (!file) {
+			std::cerr << "Failed to write input journal: " << filename << std::endl;
+			return false;
+		}
+		std::vector<char> start;
+		saveGymState(start);
+		unsigned short header[2] = { JOURNAL_VERSION, SIM_TICK_RATE };
+		unsigned int startInfo[3] = { simulationTicks, (unsigned int)start.size(), (unsigned int)rewindBudget };
+		file.write("GYMJ", 4);
+		file.write(reinterpret_cast<const char*>(header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(startInfo), sizeof(startInfo));
+		file.write(&start[0], start.size());
+		lastTick = simulationTicks;
+		return true;
+	}
+
+	void record(unsigned int tick, const InputEvent& input) {
+		if (!file.is_open()) return;
+		writeVarint(tick - lastTick);
+		lastTick = tick;
+		file.put((char)input.type);
+		if (input.type == INPUT_CLICK) {
+			file.write(reinterpret_cast<const char*>(&input.x), sizeof(input.x));
+			file.write(reinterpret_cast<const char*>(&input.z), sizeof(input.z));
+		}
+		else {
+			writeVarint((unsigned int)input.key);
+		}
+		file.flush();  // Keep what led up to a crash
+	}
+
+	void recordSave(unsigned int tick, const std::vector<char>& save) {
+		if (!file.is_open()) return;
+		writeVarint(tick - lastTick);
+		lastTick = tick;
+		file.put((char)JOURNAL_SAVE);
+		writeVarint((unsigned int)save.size());
+		file.write(&save[0], save.size());
+		file.flush();
+	}
+
+	void close(unsigned int tick, unsigned int checksum) {
+		if (!file.is_open()) return;
+		writeVarint(tick - lastTick);
+		file.put((char)JOURNAL_END);
+		file.write(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+		file.close();
+	}
+
+private:
+	std::ofstream file;
+	unsigned int lastTick = 0;
+
+	void writeVarint(unsigned int value) {
+		while (value >= 0x80) {
+			file.put((char)(value | 0x80));
+			value >>= 7;
+		}
+		file.put((char)value);
+	}
+};
+
+InputJournal inputJournal;
+
+void recordLoadedSave(const std::vector<char>& save) {
+	inputJournal.recordSave(simulationTicks, save);
+}
+
+bool readVarint(std::istream& in, unsigned int& value) {
+	value = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		int byte = in.get();
+		if (byte == EOF) return false;
+		value |= (unsigned int)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return true;
+	}
+	return false;
+}
+
+// Reads a whole journal. hasEnd is false for a session that crashed before its trailer.
+bool loadJournal(const char* filename, std::vector<char>& start, std::vector<JournalEntry>& entries,
+	unsigned int& startTick, unsigned int& endTick, unsigned int& checksum, bool& hasEnd) {
+	std::ifstream file(filename, std::ios::binary);
+	char magic[4];
+	unsigned short header[2];
+	unsigned int startInfo[3];  // Tick and size of the starting save, rewind budget
+	file.read(magic, 4);
+	file.read(reinterpret_cast<char*>(header), sizeof(header));
+	file.read(reinterpret_cast<char*>(startInfo), sizeof(startInfo));
+	if (!file || memcmp(magic, "GYMJ", 4) != 0 || header[0] != JOURNAL_VERSION || header[1] != SIM_TICK_RATE ||
+		startInfo[1] == 0 || startInfo[1] > (1u << 28)) {
+		std::cerr << "Invalid input journal: " << filename << std::endl;
+		return false;
+	}
+	start.resize(startInfo[1]);
+	file.read(&start[0], start.size());
+	rewindBudget = startInfo[2];  // Scrubs only replay the same with the same history
+	entries.clear();
+	hasEnd = false;
+	startTick = startInfo[0];
+	unsigned int tick = startTick, delta, key;
+	while (readVarint(file, delta)) {
+		tick += delta;
+		int type = file.get();
+		if (type == JOURNAL_END) {
+			file.read(reinterpret_cast<char*>(&checksum), sizeof(checksum));
+			hasEnd = (bool)file;
+			break;
+		}
+		if (type == JOURNAL_SAVE) {  // Belongs to the F9 just before it
+			unsigned int size;
+			if (!readVarint(file, size) || size == 0 || size > (1u << 28) || entries.empty() ||
+				entries.back().input.key != GLUT_KEY_F9 || entries.back().input.type != INPUT_SPECIAL_KEY) {
+				std::cerr << "Corrupt input journal: " << filename << std::endl;
+				return false;
+			}
+			entries.back().save.resize(size);
+			file.read(&entries.back().save[0], size);
+			if (!file) break;
+			continue;
+		}
+		JournalEntry entry;
+		entry.tick = tick;
+		entry.input = InputEvent();
+		entry.input.type = (InputType)type;
+		if (type == INPUT_CLICK) {
+			file.read(reinterpret_cast<char*>(&entry.input.x), sizeof(entry.input.x));
+			file.read(reinterpret_cast<char*>(&entry.input.z), sizeof(entry.input.z));
+			if (!file) break;
+		}
+		else if (type == INPUT_KEY || type == INPUT_SPECIAL_KEY || type == INPUT_SPECIAL_KEY_UP) {
+			if (!readVarint(file, key)) break;
+			entry.input.key = (int)key;
+		}
+		else {
+			std::cerr << "Corrupt input journal: " << filename << std::endl;
+			return false;
+		}
+		entries.push_back(entry);
+	}
+	endTick = hasEnd ? tick : (entries.empty() ? startTick : entries.back().tick + 1);
+	return true;
+}
+
+void captureSnapshot(RenderSnapshot& out) {
+	out.gameState = gameState;
+	out.timeRemaining = timeRemaining;
+	out.rewindOffset = rewindHistory.scrubbing ? rewindHistory.offset() : 0.0f;
+	out.camera = camera;
+	memcpy(out.prompt, hudPrompt, sizeof(out.prompt));
+	out.tick = simulationTicks;
+
+	out.posX = posX;
+	out.PosY = PosY;
+	out.posZ = posZ;
+	float placement[1][4] = { { posX, PosY, posZ, rotationAngle } };
+	evaluateAnimations(&playerAnimation, placement, 1, out.playerPose);
+	evaluateCrowdPoses(out.crowdPoses);
+
+	out.barPosY = barPosY;
+	out.scaleFactor = scaleFactor;
+	out.barHeight = barHeight;
+	out.deadliftRotationAngle = deadliftRotationAngle;
+	for (int i = 0; i < 3; i++) {
+		out.color[i] = color[i];
+		out.dumbbellColor[i] = dumbbellColor[i];
+		out.WallColor[i] = WallColor[i];
+	}
+}
+
+void applyInput(const InputEvent& input) {
+	if (netClient.connected()) {  // The server has the crowd and the clock can't go back
+		if (input.type == INPUT_CLICK || (input.type == INPUT_KEY && strchr("[]m", input.key))) return;
+		if (input.type == INPUT_SPECIAL_KEY && (input.key == GLUT_KEY_F5 || input.key == GLUT_KEY_F9)) return;  // Nor can it be saved or loaded here
+		int station = touchedStation();
+		if (input.type == INPUT_KEY && (input.key == 'e' || input.key == 'E') && station >= 0 && !playerAnimation.exercising) {
+			netClient.requestStation(station);
+			return;
+		}
+	}
+	if (input.type == INPUT_KEY && (input.key == '[' || input.key == ']')) {  // Scrub the rewind history
+		rewindHistory.scrub(input.key == '[' ? -REWIND_SCRUB_TICKS : REWIND_SCRUB_TICKS);
+		return;
+	}
+	rewindHistory.resume();  // Anything else plays on from the scrubbed tick
+
+	if (input.type == INPUT_KEY) {
+		handleKeyboard((unsigned char)input.key, 0, 0);
+	}
+	else if (input.type == INPUT_CLICK) {
+		walkPlayerTo(input.x, input.z);
+	}
+	else if (input.key == GLUT_KEY_F5) {
+		quickSaveGame();
+	}
+	else if (input.key == GLUT_KEY_F9) {
+		quickLoadGame();
+	}
+	else {
+		if (input.type == INPUT_SPECIAL_KEY) stopAutoWalk();  // The arrow keys take over
+		handleSpecialKeyboard(input.key, input.type == INPUT_SPECIAL_KEY);
+	}
+}
+
+// Walk the player with the keys held. Nobody walks off a machine, and a click's walk
+// moves the player itself.
+void updatePlayerMotion(float deltaTime) {
+	if (playerAnimation.exercising || autoWalking) {
+		playerMotion.vx = playerMotion.vz = 0.0f;
+		if (!autoWalking) playerMotion.moved = 0.0f;
+		return;
+	}
+	if (playerKeys == 0 && playerMotion.vx == 0.0f && playerMotion.vz == 0.0f) {
+		playerMotion.moved = 0.0f;
+		return;
+	}
+	netClient.predictMove(playerKeys, playerMotion);
+	playerMotion.moved = moveCharacter(posX, posZ, rotationAngle, playerMotion, playerKeys, deltaTime);
+	if (playerMotion.moved > 0.0f) {
+		startPosX = posX;
+		startPosZ = posZ;
+		updateMachineZones();
+	}
+}
+
+void simulationTick(float deltaTime) {
+	InputEvent input;
+	while (inputQueue.pop(input) || rawInputQueue.pop(input)) {
+		inputJournal.record(simulationTicks, input);
+		inputLatency.applied(input.time, simulationTicks);
+		applyInput(input);
+	}
+	netClient.update(deltaTime);
+
+	if (gameState == ACTIVE && !rewindHistory.scrubbing) {
+		TraceScope trace("simulation tick");
+		simulationTime += deltaTime;
+		updateTimer(deltaTime);
+		updateDeadliftAnimation(deltaTime);
+		updateDumbbellColor(deltaTime);
+		updateBenchPressAnimation(deltaTime);
+		updateChinUpAnimation();
+		updateSmithAnimation(deltaTime);
+		if (autoWalking || !crowdAgents.empty()) updateNavigation();  // Nothing else finds its way
+		updateAutoWalk(deltaTime);
+		updatePlayerMotion(deltaTime);
+		updateAnimation();  // Pick the walk or idle clip
+		playerAnimation.advance(deltaTime, playerMotion.moved / WALK_CLIP_SPEED);
+		if (!netClient.connected()) updateCrowd(deltaTime);
+		rewindHistory.record();
+	}
+	gymEvents.dispatch();
+	simulationTicks++;
+}
+
+void simulationMain() {
+	traceSetThreadName("simulation");
+	const std::chrono::microseconds tick(1000000 / SIM_TICK_RATE);
+	std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+	while (simulationRunning.load(std::memory_order_relaxed)) {
+		simulationTick(SIM_DT);
+		captureSnapshot(snapshots.back());
+		snapshots.publish();
+
+		if (simulationTicks % 10 == 0) {
+			traceCounter("timeRemaining", timeRemaining);
+			traceCounter("activeAnimations", countActiveAnimations());
+			traceCounter("voices", countPlayingVoices());
+		}
+
+		// Catch up after a short stall, but give up on time lost to a long one
+		next += tick;
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now - next > std::chrono::milliseconds(250)) {
+			next = now;
+		}
+		std::this_thread::sleep_until(next);
+	}
+}
+
+void startSimulation() {
+	captureSnapshot(snapshots.back());  // The first frames draw the initial state
+	snapshots.publish();
+	simulationRunning.store(true);
+	simulationThread = std::thread(simulationMain);
+}
+
+void stopSimulation() {
+	simulationRunning.store(false);
+	if (simulationThread.joinable()) {
+		simulationThread.join();
+	}
+}
+
+// Registered before stopSimulation() so it runs after the simulation thread is gone
+void closeJournal() {
+	inputJournal.close(simulationTicks, simulationChecksum());
+}
+
+// Run a journal headless and as fast as the simulation goes, feeding each input on the
+// tick it was recorded on. Returns non-zero when the end state differs from the session.
+int replayJournal(const char* filename) {
+	std::vector<char> startState;
+	std::vector<JournalEntry> entries;
+	unsigned int startTick, endTick, checksum;
+	bool hasEnd;
+	if (!loadJournal(filename, startState, entries, startTick, endTick, checksum, hasEnd)) return 1;
+	if (!restoreGymState(startState)) {
+		std::cerr << "Invalid starting state in journal: " << filename << std::endl;
+		return 1;
+	}
+	simulationTicks = startTick;
+	rewindHistory.init(rewindBudget);
+	replayingJournal = true;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	size_t next = 0;
+	while (simulationTicks < endTick) {
+		while (next < entries.size() && entries[next].tick == simulationTicks) {
+			bool fromDisk = !entries[next].save.empty();
+			if (fromDisk) quickSave = entries[next].save;  // As the session read it
+			applyInput(entries[next++].input);
+			if (fromDisk) quickSave.clear();  // The session had no copy in memory either
+		}
+		simulationTick(SIM_DT);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double played = (double)(endTick - startTick) / SIM_TICK_RATE;
+	printf("Replayed %u inputs over %u ticks (%.1f s) in %.2f s, %.0fx real time\n",
+		(unsigned int)entries.size(), endTick - startTick, played, seconds, seconds > 0.0 ? played / seconds : 0.0);
+	unsigned int result = simulationChecksum();
+	if (!hasEnd) {
+		printf("Journal has no trailer (session crashed?), final checksum %08x\n", result);
+		return 0;
+	}
+	printf("Checksum %08x, recorded %08x: %s\n", result, checksum, result == checksum ? "match" : "MISMATCH");
+	return result == checksum ? 0 : 2;
+}
+
+
+// Capacity planning. Every session is one kiosk's game kept in a GymState; a tick
+// swaps it into the globals, plays it and swaps it back, so a process can hold
+// thousands. A bot plays each one: it wanders with the arrow keys, gets on any
+// machine it bumps into and off again a few seconds later, and a new game starts
+// when the clock runs out.
+struct GymSession {
+	GymState state;
+	unsigned int random;
+	int key;   // Arrow the bot holds down
+	int wait;  // Ticks before it presses anything again
+};
+
+void playSessionBot(GymSession& session) {
+	if (session.wait-- > 0) return;
+	InputEvent input = { INPUT_KEY, 0 };
+	if (playerAnimation.exercising || isAnimatingSmith) {
+		input.key = 'p';
+		session.wait = 300 + (int)(crowdRandom(session.random) * 300.0f);
+	}
+	else if (touchingEquipment() && crowdRandom(session.random) < 0.3f) {
+		input.key = 'e';
+		session.wait = 100;
+	}
+	else {
+		session.wait = 5;
+		int key = crowdRandom(session.random) < 0.05f ? GLUT_KEY_LEFT + (int)(crowdRandom(session.random) * 4.0f) : session.key;
+		if (key == session.key && (playerKeys & arrowBit(key))) return;  // Keep walking
+		InputEvent release = { INPUT_SPECIAL_KEY_UP, session.key };
+		applyInput(release);
+		session.key = key;
+		input.type = INPUT_SPECIAL_KEY;
+		input.key = key;
+	}
+	applyInput(input);
+}
+
+// Tick the sessions at the simulation rate for a while, reporting every second how
+// much of each tick they take
+int runSessions(int count, float seconds) {
+	GymState fresh;
+	exchangeGymState(fresh, true);
+	std::vector<GymSession> sessions(count);
+	for (int i = 0; i < count; i++) {
+		sessions[i].state = fresh;
+		sessions[i].random = 2654435761u * (i + 1) | 1;
+		sessions[i].key = GLUT_KEY_UP;
+		sessions[i].wait = i % 100;  // Not all in step
+	}
+	printf("Running %d sessions at %d ticks/s for %.0f s\n", count, SIM_TICK_RATE, seconds);
+
+	const std::chrono::microseconds tick(1000000 / SIM_TICK_RATE);
+	std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now(), second = next;
+	int ticks = 0, total = (int)(seconds * SIM_TICK_RATE), games = 0;
+	double busy = 0.0, worst = 0.0, totalBusy = 0.0;
+	while (ticks < total) {
+		std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+		for (int i = 0; i < count; i++) {
+			GymSession& session = sessions[i];
+			exchangeGymState(session.state, false);
+			if (gameState != ACTIVE) {  // Next customer
+				session.state = fresh;
+				exchangeGymState(session.state, false);
+				games++;
+			}
+			playSessionBot(session);
+			simulationTick(SIM_DT);
+			exchangeGymState(session.state, true);
 		}
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+		busy += ms;
+		totalBusy += ms;
+		worst = ms > worst ? ms : worst;
+
+		if (++ticks % SIM_TICK_RATE == 0) {  // Falls behind real time once the ticks take longer than their budget
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			double elapsed = std::chrono::duration<double>(now - second).count();
+			printf("%d s: %.0f session ticks/s, tick %.2f ms avg %.2f ms max, %.0f%% of the %d ms budget\n", ticks / SIM_TICK_RATE,
+				count * SIM_TICK_RATE / elapsed, busy / SIM_TICK_RATE, worst, busy / 10.0, 1000 / SIM_TICK_RATE);
+			second = now;
+			busy = 0.0;
+			worst = 0.0;
+		}
+		next += tick;
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now - next > std::chrono::milliseconds(250)) {
+			next = now;
+		}
+		std::this_thread::sleep_until(next);
 	}
-
+	double perSession = totalBusy / ticks / count;  // ms
+	printf("%.1f us per session tick, %d games finished; one core keeps about %.0f sessions at %d ticks/s\n",
+		perSession * 1000.0, games, 1000.0 / SIM_TICK_RATE / perSession, SIM_TICK_RATE);
+	return 0;
 }
 
+// Play timed input without a window (-inputscript, -latency). The simulation runs on its
+// thread as in the game, the input comes from the raw input thread's scripted source,
+// and the main thread stands in for GLUT: it takes the newest snapshot at the start of
+// each 60 Hz refresh and "swaps" at the end of it. Without a script, -latency presses
+// and lets go of the arrows back and forth at random moments, about eight times a second.
+int runScriptedSession(const char* scriptFile, float seconds, bool measureLatency) {
+	const std::chrono::microseconds refresh(1000000 / 60);
+	if (scriptFile) {
+		if (!startRawInput(scriptFile)) return 1;
+	}
+	else {
+		const int keys[4] = { GLUT_KEY_LEFT, GLUT_KEY_RIGHT, GLUT_KEY_RIGHT, GLUT_KEY_LEFT };
+		std::vector<std::pair<float, InputEvent> > script;
+		unsigned int random = 12345;
+		float time = 0.0f;
+		for (int presses = 0; time < seconds; presses++) {
+			random = random * 1664525u + 1013904223u;
+			time += 0.25f * (random >> 8) / (1 << 24);
+			InputEvent input = { presses % 2 == 0 ? INPUT_SPECIAL_KEY : INPUT_SPECIAL_KEY_UP, keys[presses / 2 % 4] };
+			script.push_back(std::make_pair(time, input));
+		}
+		startScriptedInput(script);
+	}
+	inputLatency.enabled = measureLatency;
+	startSimulation();
+	printf("Playing %s for %.0f s with a simulated 60 Hz swap\n", scriptFile ? scriptFile : "arrow presses", seconds);
+	std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point end = next + std::chrono::microseconds((long long)(seconds * 1e6f));
+	while (next < end) {
+		unsigned int tick = snapshots.latest().tick;
+		next += refresh;
+		std::this_thread::sleep_until(next);  // Waiting for the vertical blank
+		inputLatency.presented(tick);
+	}
+	stopRawInput();
+	stopSimulation();
+	printf("Ended at %.2f %.2f, %.1f s on the clock, score %d, %s\n", posX, posZ, timeRemaining, score,
+		gameState == ACTIVE ? "still playing" : (gameState == WIN ? "won" : "lost"));
+	inputLatency.finish();
+	return 0;
+}
 
+// Batch runs for tuning the clock and the difficulty. A game reduced to what decides
+// it: walk to each of the five machines and press 'e', then finish the 14 second
+// deadlift before the time runs out. Walks take the navigation grid's path length at
+// the player's pace, and every machine is watched for a while before moving on. The
+// games are kept as arrays with one entry per game and run in batches across the
+// simulation workers; the clocks of four games count down per SSE instruction, and
+// only games whose walk, exercise or clock ran out this step take the slow path.
+enum BatchPhase { BATCH_WALKING, BATCH_EXERCISING, BATCH_LIFTING };
+enum BatchPolicy { POLICY_RANDOM, POLICY_NEAREST };
+
+const int BATCH_SIZE = 4096;     // Games per job, a multiple of 4
+const float BATCH_DT = 0.05f;    // Seconds per step
+const float BATCH_DONE = 1e30f;  // Clock of a finished game; never runs out again
+const float DEADLIFT_DURATION = bendDownDuration + liftUpDuration + holdUpDuration;
+
+// Path lengths between the start (row MACHINE_COUNT) and the free floor by each machine
+float batchDistance[MACHINE_COUNT + 1][MACHINE_COUNT];
+
+// Where the player stands to use a machine without a station: the middle of the side facing the room
+void machineApproach(const BoundingBox& box, float& x, float& z) {
+	float cx = (ROOM_MIN_X + ROOM_MAX_X) / 2, cz = (ROOM_MIN_Z + ROOM_MAX_Z) / 2;
+	x = cx < box.minX ? box.minX - 0.3f : (cx > box.maxX ? box.maxX + 0.3f : (box.minX + box.maxX) / 2);
+	z = cz < box.minZ ? box.minZ - 0.3f : (cz > box.maxZ ? box.maxZ + 0.3f : (box.minZ + box.maxZ) / 2);
+	if (x < box.minX || x > box.maxX) z = cz < box.minZ ? box.minZ : (cz > box.maxZ ? box.maxZ : cz);
+}
 
-float timeRemaining = 90.0f;  // Start timer at 90 seconds
-float WallColor[3] = { 0.9f, 0.9f, 0.9f };
-
-std::chrono::time_point<std::chrono::steady_clock> lastUpdate = std::chrono::steady_clock::now();
-float colorUpdateInterval = 10.0f;  // Interval in seconds for WallColor adjustment
-
-void updateTimer() {
-	// Calculate elapsed time since the last call
-	auto now = std::chrono::steady_clock::now();
-	std::chrono::duration<float> elapsed = now - lastUpdate;
-
-	// Update remaining time
-	timeRemaining -= elapsed.count();
-
-	// Check if timeRemaining has reached zero
-	if (timeRemaining <= 0.0f) {
-		timeRemaining = 0.0f;
-		gameState = LOSE;  // Set game state to LOSE when time is up
+void initBatchDistances() {
+	float x[MACHINE_COUNT + 1], z[MACHINE_COUNT + 1];
+	const int stations[] = { 0, 1, 2, -1, -1, 5 };  // gymStations entry of each machine
+	for (int m = 0; m < MACHINE_COUNT; m++) {
+		if (stations[m] >= 0) {
+			x[m] = gymStations[stations[m]].approachX;
+			z[m] = gymStations[stations[m]].approachZ;
+		}
 	}
-
-	// Decrease WallColor every 10 seconds if not already at minimum
-	if (static_cast<int>(timeRemaining) % 10 == 0 && timeRemaining <= colorUpdateInterval * 9) {
-		for (int i = 0; i < 3; i++) {
-			if (WallColor[i] > 0.0f) {
-				WallColor[i] -= 0.1f;
-				if (WallColor[i] < 0.0f) WallColor[i] = 0.0f;  // Clamp color to minimum 0
+	machineApproach(DumbellRackBox, x[MACHINE_DUMBBELL_RACK], z[MACHINE_DUMBBELL_RACK]);
+	machineApproach(SmithBox, x[MACHINE_SMITH], z[MACHINE_SMITH]);
+	x[MACHINE_COUNT] = -0.5f;  // Where every game starts
+	z[MACHINE_COUNT] = 1.5f;
+	std::vector<float> path;
+	for (int from = 0; from <= MACHINE_COUNT; from++) {
+		for (int to = 0; to < MACHINE_COUNT; to++) {
+			float length = 0.0f, px = x[from], pz = z[from];
+			navFindPath(x[from], z[from], x[to], z[to], path);
+			for (size_t k = 0; k + 1 < path.size(); k += 2) {
+				length += sqrt((path[k] - px) * (path[k] - px) + (path[k + 1] - pz) * (path[k + 1] - pz));
+				px = path[k];
+				pz = path[k + 1];
 			}
+			batchDistance[from][to] = length;
 		}
-		colorUpdateInterval -= 10.0f;  // Update interval to avoid repeated reduction
 	}
-
-	// Reset the last update time
-	lastUpdate = now;
 }
 
+struct BatchResults {
+	long long won, lost;
+	long long wonAt[10];                   // By tenth of the clock left
+	long long lostWith[MACHINE_COUNT];    // By machines used when the clock ran out
+	double timeLeft;                       // Summed over the won games
+
+	void add(const BatchResults& other) {
+		won += other.won;
+		lost += other.lost;
+		for (int k = 0; k < 10; k++) wonAt[k] += other.wonAt[k];
+		for (int m = 0; m < MACHINE_COUNT; m++) lostWith[m] += other.lostWith[m];
+		timeLeft += other.timeLeft;
+	}
+};
 
+// One batch of games, each an index into the arrays
+class GameBatch {
+public:
+	void run(int count, unsigned int seed, BatchPolicy policy, float timeLimit, BatchResults& results) {
+		int padded = (count + 3) & ~3;
+		clock.assign(padded, BATCH_DONE);
+		phaseLeft.assign(padded, BATCH_DONE);
+		phase.assign(padded, BATCH_WALKING);
+		machine.assign(padded, 0);
+		used.assign(padded, 0);
+		pace.resize(padded);
+		linger.resize(padded);
+		random.resize(padded);
+		memset(&results, 0, sizeof(results));
+		for (int i = 0; i < count; i++) {  // A player for every game
+			unsigned int& state = random[i];
+			state = (seed + i) * 2654435761u | 1;
+			pace[i] = 0.8f + crowdRandom(state) * 1.2f;    // Metres per second, key repeat and hesitation
+			linger[i] = 1.0f + crowdRandom(state) * 5.0f;  // Seconds on each machine
+			clock[i] = timeLimit;
+			walkTo(i, MACHINE_COUNT, nextMachine(i, MACHINE_COUNT, policy));
+		}
 
-void displayTimer() {
-	char timerText[16];
-	sprintf(timerText, "Time: %.0f", timeRemaining);  // Format as "Time: X"
-
-	// Display timerText at a specific location on the screen
-	glRasterPos3f(3.0f, 4.0f, 3.0f);  // Adjust position as needed
-	for (char* c = timerText; *c != '\0'; c++) {
-		glutBitmapCharacter(GLUT_BITMAP_HELVETICA_18, *c);
+		int running = count;
+		for (int step = 0; running > 0; step++) {
+			for (int i = 0; i < padded; i += 4) {
+				int events = countDown(i);
+				for (int lane = 0; events; lane++, events >>= 1) {
+					if (events & 1) running -= handleEvent(i + lane, policy, timeLimit, results);
+				}
+			}
+		}
 	}
-}
 
-void displayWinScreen() {
-	// Clear the screen with a background color for the win screen
-	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);  // Black background
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+private:
+	std::vector<float> clock, phaseLeft, pace, linger;
+	std::vector<unsigned char> phase, machine, used;  // used has a bit per machine
+	std::vector<unsigned int> random;
+
+	// Four clocks at once; returns a bit for each game that has something to do
+	int countDown(int i) {
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+		__m128 dt = _mm_set1_ps(BATCH_DT);
+		__m128 left = _mm_sub_ps(_mm_loadu_ps(&clock[i]), dt);
+		__m128 phaseEnd = _mm_sub_ps(_mm_loadu_ps(&phaseLeft[i]), dt);
+		_mm_storeu_ps(&clock[i], left);
+		_mm_storeu_ps(&phaseLeft[i], phaseEnd);
+		return _mm_movemask_ps(_mm_cmple_ps(_mm_min_ps(left, phaseEnd), _mm_setzero_ps()));
+#else
+		int events = 0;
+		for (int lane = 0; lane < 4; lane++) {
+			clock[i + lane] -= BATCH_DT;
+			phaseLeft[i + lane] -= BATCH_DT;
+			if (clock[i + lane] <= 0.0f || phaseLeft[i + lane] <= 0.0f) events |= 1 << lane;
+		}
+		return events;
+#endif
+	}
 
-	// Set text color to a bright color
-	  // Magenta color for "GAME WIN!"
+	int nextMachine(int i, int from, BatchPolicy policy) {
+		int left = 0, choices[MACHINE_COUNT];
+		for (int m = 0; m < MACHINE_DEADLIFT; m++) {
+			if (!(used[i] & (1 << m))) choices[left++] = m;
+		}
+		if (left == 0) return MACHINE_DEADLIFT;
+		if (policy == POLICY_RANDOM) return choices[(int)(crowdRandom(random[i]) * left) % left];
+		int best = choices[0];
+		for (int k = 1; k < left; k++) {
+			if (batchDistance[from][choices[k]] < batchDistance[from][best]) best = choices[k];
+		}
+		return best;
+	}
 
-	// Position and display the "Game Win" message
-	glRasterPos2f(1.5f, 2.0f);  // Center the text
+	void walkTo(int i, int from, int to) {
+		phase[i] = BATCH_WALKING;
+		machine[i] = (unsigned char)to;
+		phaseLeft[i] = batchDistance[from][to] / pace[i] + 0.5f;  // Half a second to find the key
+	}
 
-	// Draw main text
+	// Returns 1 when the game ended
+	int handleEvent(int i, BatchPolicy policy, float timeLimit, BatchResults& results) {
+		if (clock[i] <= 0.0f) {  // The timer also runs during the deadlift
+			int machines = 0;
+			for (int m = 0; m < MACHINE_COUNT; m++) machines += (used[i] >> m) & 1;
+			results.lost++;
+			results.lostWith[machines < MACHINE_COUNT ? machines : MACHINE_COUNT - 1]++;
+			clock[i] = phaseLeft[i] = BATCH_DONE;
+			return 1;
+		}
+		if (phase[i] == BATCH_WALKING) {  // Bumped into the machine; press 'e'
+			used[i] |= 1 << machine[i];
+			phase[i] = machine[i] == MACHINE_DEADLIFT ? BATCH_LIFTING : BATCH_EXERCISING;
+			phaseLeft[i] = machine[i] == MACHINE_DEADLIFT ? DEADLIFT_DURATION : linger[i];
+			return 0;
+		}
+		if (phase[i] == BATCH_EXERCISING) {  // Press 'p' and head for the next one
+			walkTo(i, machine[i], nextMachine(i, machine[i], policy));
+			return 0;
+		}
+		int tenth = (int)(clock[i] / timeLimit * 10.0f);
+		results.won++;
+		results.wonAt[tenth < 10 ? tenth : 9]++;
+		results.timeLeft += clock[i];
+		clock[i] = phaseLeft[i] = BATCH_DONE;
+		return 1;
+	}
+};
 
-	const char* winText = "YOU ARE THE WORLD CHAMPION!";
-	for (const char* c = winText; *c != '\0'; c++) {
-		glColor3f(1.0f, 1.0f, 1.0f);
-		glutBitmapCharacter(GLUT_BITMAP_TIMES_ROMAN_24, *c);  // Larger font
+// -batch N: play N games split over the simulation workers and print how they went
+int runBatch(long long games, BatchPolicy policy, float timeLimit) {
+	initBatchDistances();
+	int batches = (int)((games + BATCH_SIZE - 1) / BATCH_SIZE);
+	std::vector<BatchResults> results(batches);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	simulationWorkers.parallelFor(batches, [&](int b) {
+		static thread_local GameBatch batch;
+		long long first = (long long)b * BATCH_SIZE;
+		int count = (int)(games - first < BATCH_SIZE ? games - first : BATCH_SIZE);
+		batch.run(count, (unsigned int)first, policy, timeLimit, results[b]);
+	});
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	BatchResults total;
+	memset(&total, 0, sizeof(total));
+	for (int b = 0; b < batches; b++) total.add(results[b]);
+
+	printf("%lld games, %s policy, %.0f s on the clock: %.1f%% won, %.1f%% lost\n", games,
+		policy == POLICY_RANDOM ? "random" : "nearest", timeLimit, 100.0 * total.won / games, 100.0 * total.lost / games);
+	if (total.won > 0) {
+		printf("Won with %.1f s left on average; by time left:", total.timeLeft / total.won);
+		for (int k = 0; k < 10; k++) printf(" %.0f-%.0f s %.1f%%", timeLimit * k / 10, timeLimit * (k + 1) / 10, 100.0 * total.wonAt[k] / total.won);
+		printf("\n");
 	}
+	if (total.lost > 0) {
+		printf("Lost with machines used:");
+		for (int m = 0; m < MACHINE_COUNT; m++) printf(" %d %.1f%%", m, 100.0 * total.lostWith[m] / total.lost);
+		printf("\n");
+	}
+	printf("%.2f s on %d threads, %.0f games/s\n", seconds, simulationWorkers.size(), games / seconds);
+	return 0;
+}
 
-	// Optional: Add an outline by drawing slightly offset text layers
-	glColor3f(0.0f, 1.0f, 1.0f);  // Yellow color for outline effect
-	glRasterPos2f(1.51f, 2.01f); // Slightly offset position
-	for (const char* c = winText; *c != '\0'; c++) {
-		glutBitmapCharacter(GLUT_BITMAP_TIMES_ROMAN_24, *c);
+#ifndef GYM_HEADLESS
+// GLUT callbacks. Keys that only change how things are drawn are handled here,
+// everything else is queued for the simulation.
+void onKeyboard(unsigned char key, int x, int y) {
+	switch (key) {
+	case 'o':  // Toggle the frame profiler overlay
+		profiler.overlayVisible = !profiler.overlayVisible;
+		break;
+	case 'x':  // Flush the event trace, CPU and GPU passes included, for Perfetto
+		writeTrace(traceFile);
+		break;
+	case 'v':  // Cycle single, picture-in-picture and split-screen views
+		setViewLayout((ViewLayout)((viewLayout + 1) % LAYOUT_COUNT));
+		break;
+	case 27:  // Escape key
+		exit(0);
+		break;
+	default: {
+		if (rawInputActive && strchr("eEpP", key)) break;  // The raw input thread has them
+		InputEvent input = { INPUT_KEY, key };
+		input.time = inputClock();
+		inputQueue.push(input);
+		break;
 	}
+	}
+}
 
-	// Display some additional celebratory text below
+// Only changes reach the simulation, not the key repeat
+unsigned char arrowsDown = 0;
 
-	// Swap buffers to render the screen
-	glutSwapBuffers();
+void onSpecialKeyboard(int key, int x, int y) {
+	if ((arrowsDown & arrowBit(key)) || (rawInputActive && arrowBit(key))) return;
+	arrowsDown |= arrowBit(key);
+	InputEvent input = { INPUT_SPECIAL_KEY, key };
+	input.time = inputClock();
+	inputQueue.push(input);
 }
 
-void displayLoseScreen() {
-	glClearColor(1.0f, 1.0f, 1.0f, 1.0f);  // Black background
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+void onSpecialKeyboardUp(int key, int x, int y) {
+	if (!(arrowsDown & arrowBit(key))) return;
+	arrowsDown &= ~arrowBit(key);
+	InputEvent input = { INPUT_SPECIAL_KEY_UP, key };
+	input.time = inputClock();
+	inputQueue.push(input);
+}
 
-	// Set text color to a bright color
-	  // Magenta color for "GAME WIN!"
 
-	// Position and display the "Game Win" message
-	glRasterPos2f(1.5f, 2.0f);  // Center the text
 
-	// Draw main text
+// Each top-level object of the gym as an item of the draw list. The bounding
+// spheres are in world space and only need to be conservative.
+void drawScenePlayer() {
+	gfxPushMatrix();
+	gfxTranslate(2.5, 0.5, 2.0);
+	drawPlayer();
+	gfxPopMatrix();
+}
 
-	const char* winText = "YOU WERE TOO WEAK";
-	for (const char* c = winText; *c != '\0'; c++) {
-		glColor3f(1.0f, 1.0f, 1.0f);
-		glutBitmapCharacter(GLUT_BITMAP_TIMES_ROMAN_24, *c);  // Larger font
+// The crowd is split over a few items so its command lists are recorded in parallel
+const int CROWD_ITEMS = 4;
+
+void drawCrowdShare(int share) {
+	int count = (int)frame.crowdPoses.size() / JOINT_COUNT;
+	gfxPushMatrix();
+	gfxTranslate(2.5, 0.5, 2.0);  // Agents use the player's coordinates
+	for (int i = share; i < count; i += CROWD_ITEMS) {
+		float skin[JOINT_COUNT][16];
+		computeSkinMatrices(&frame.crowdPoses[i * JOINT_COUNT], skin);
+		gfxSkinnedMesh(playerMesh, skin);
 	}
+	gfxPopMatrix();
+}
 
-	// Optional: Add an outline by drawing slightly offset text layers
-	glColor3f(0.0f, 1.0f, 1.0f);  // Yellow color for outline effect
-	glRasterPos2f(1.51f, 2.01f); // Slightly offset position
-	for (const char* c = winText; *c != '\0'; c++) {
-		glutBitmapCharacter(GLUT_BITMAP_TIMES_ROMAN_24, *c);
-	}
+void drawSceneCrowd1() { drawCrowdShare(0); }
+void drawSceneCrowd2() { drawCrowdShare(1); }
+void drawSceneCrowd3() { drawCrowdShare(2); }
+void drawSceneCrowd4() { drawCrowdShare(3); }
+
+void drawSceneChinUp() {
+	gfxPushMatrix();
+	gfxTranslate(-0.5, 0.1, 2.0);
+	gfxRotate(90, 0.0, 1.0, 0.0);
+	drawChinUpDipMachine();
+	gfxPopMatrix();
 }
 
+void drawSceneDumbbellRack() {
+	gfxPushMatrix();
+	gfxRotate(90, 0.0f, 1.0f, 0.0f);
+	gfxTranslate(-2.5, 0.1, 4.5);
+	drawDumbbellRack();
+	gfxPopMatrix();
+}
 
-void updateAnimation() {
-	// If the timer is active, update the arm and leg angles for animation
-	if (walkTimer > 0) {
-		float time = glutGet(GLUT_ELAPSED_TIME) * 0.01f;
-		legAngle = sin(time) * 10.0f;  // Swing legs with sine wave
-		armAngle = sin(time) * 20.0f;
-		leftarmAngle = -armAngle;
-		walkTimer--;                   // Decrease timer
-	}
-	else {
-		// Reset angles when not walking
-		legAngle = 0.0f;
-		armAngle = 0.0f;
-		leftarmAngle = 0.0f;
-	}
+void drawTreadmill(double z) {
+	gfxPushMatrix();
+	gfxTranslate(4.1, 0.1, z);
+	drawBase();       // Draw the base of the treadmill
+	drawBelt();       // Draw the running belt
+	drawSideRails();  // Draw side rails on both sides
+	drawHandles();
+	drawHandleArms();
+	drawConsole();
+	gfxPopMatrix();
+}
 
-	deadliftRotationAngle += 0.05f;  // Adjust the value for desired speed
-	if (deadliftRotationAngle > 360.0f) {
-		deadliftRotationAngle -= 360.0f;  // Keep it within 0-360 degrees
-	}
-	dumbellRackRotationAngle += 0.05f;  // Adjust the value for desired speed
-	if (dumbellRackRotationAngle > 360.0f) {
-		dumbellRackRotationAngle -= 360.0f;  // Keep it within 0-360 degrees
-	}
+void drawSceneTreadmill1() { drawTreadmill(-1.0); }
+void drawSceneTreadmill2() { drawTreadmill(-0.2); }
+void drawSceneTreadmill3() { drawTreadmill(0.6); }
+
+void drawSceneDeadlift() {
+	gfxPushMatrix();
+	gfxTranslate(2.0, frame.barHeight, 1.8);  // Position the bar
+	gfxRotate(frame.deadliftRotationAngle, 0.0f, 1.0f, 0.0f);  // Rotate around the Y-axis
+	drawDeadliftBar();
+	drawDumbbell(0.4, 0.4);
+	gfxPopMatrix();
 }
-void idle() {
 
-	updateAnimation();  // Update arm and leg animation angles
-	glutPostRedisplay();  // Redisplay for smooth animation
+void drawSceneBenchPress() {
+	gfxPushMatrix();
+	gfxTranslate(-1.3, 0.0, -0.4);  // Center in the larger room
+	drawBenchPressSeat();
+	drawSeatLeg1();
+	drawSeatLeg2();
+	drawVerticalSupport1();
+	drawVerticalSupport2();
+	drawBar();
+	drawLeftWeight();
+	drawRightWeight();
+	gfxPopMatrix();
 }
 
+void drawSceneSmith() {
+	gfxPushMatrix();
+	gfxTranslate(1.8, 0.0, -0.7);
+	drawBaseSupport();
+	drawLeftVerticalFrame();
+	drawRightVerticalFrame();
+	drawTopBar();
+	drawBarbell();
+	drawLeftCounterweight();
+	drawRightCounterweight();
+	drawLeftFrameSupport();
+	drawRightFrameSupport();
+	drawBottomSupport();
+	gfxPopMatrix();
+}
 
+// Ground wall (floor) - light brown
+void drawSceneFloor() {
+	gfxPushMatrix();
+	gfxColor(0.76f, 0.6f, 0.42f); // Light brown color
+	gfxTranslate(2.0, 0.0, 1.0);    // Centered on ground level
+	drawWall(0.02, 6.0, 6.0);       // Increased width significantly
+	gfxPopMatrix();
+}
 
-bool winSoundPlayed = false;
-bool loseSoundPlayed = false;
+// Left wall - light gray with window frame
+void drawSceneLeftWall() {
+	gfxPushMatrix();
+	gfxColor(frame.WallColor[0], frame.WallColor[1], frame.WallColor[2]); // Light gray color
+	gfxTranslate(-1.0, 2.0, 1.0);   // Move to the left side
+	gfxRotate(90, 0, 0, 1.0);
+	drawWall(0.02, 4.0, 6.0);       // Adjusted height to match back wall
+	gfxTranslate(0.0, -0.2, 0.5);    // Slightly offset frame outward
+	gfxRotate(-90, 1.0, 0, 0);
+	drawWindowFrame(1.5, 1.0, 0.05); // Window frame with width, height, thickness
+	gfxPopMatrix();
+}
 
+// Back wall - light gray with window frame
+void drawSceneBackWall() {
+	gfxPushMatrix();
+	gfxTranslate(2.0, 2.0, -1.5);   // Centered back, made wider
+	drawWindowFrame(4.0, 2.0, 0.05); // Window frame with width, height, thickness
+	gfxRotate(-90, 1.0, 0.0, 0.0);
+	gfxColor(frame.WallColor[0], frame.WallColor[1], frame.WallColor[2]); // Light gray color
+	drawWall(0.02, 6.0, 4.0);       // Increased width significantly
+	gfxPopMatrix();
+}
 
+// Right wall - light gray with window frame
+void drawSceneRightWall() {
+	gfxPushMatrix();
+	gfxTranslate(5.0, 2.0, 1.0);    // Move to the right side
+	gfxRotate(90, 0, 0, 1.0);
+	gfxColor(frame.WallColor[0], frame.WallColor[1], frame.WallColor[2]); // Light gray color
+	drawWall(0.02, 4.0, 6.0);       // Adjusted height to match back wall
+	gfxTranslate(0.0, 0.0, 0.5);    // Slightly offset frame outward
+	gfxRotate(-90, 1.0, 0, 0);
+	drawWindowFrame(1.5, 1.0, 0.05); // Window frame with width, height, thickness
+	gfxPopMatrix();
+}
 
+// Which shadow map an item is drawn into. The room itself only receives shadows,
+// otherwise the left wall would put most of the floor in shade.
+enum ShadowCasting { CAST_NONE, CAST_STATIC, CAST_DYNAMIC };
+
+struct SceneItem {
+	const char* name;
+	ProfilePass pass;
+	void (*draw)();
+	Vector3f center;
+	float radius;
+	ShadowCasting shadow;
+	CommandList commands;  // Recorded from draw() once per frame
+};
 
-void Display() {
+SceneItem sceneItems[] = {
+	{ "player", PASS_PLAYERS, drawScenePlayer, Vector3f(2.0f, 0.6f, 3.5f), 0.6f, CAST_DYNAMIC },
+	{ "chin up", PASS_MACHINES, drawSceneChinUp, Vector3f(-0.5f, 0.6f, 2.0f), 0.8f, CAST_STATIC },
+	{ "dumbbell rack", PASS_MACHINES, drawSceneDumbbellRack, Vector3f(4.5f, 0.45f, 2.5f), 1.0f, CAST_STATIC },
+	{ "treadmill 1", PASS_MACHINES, drawSceneTreadmill1, Vector3f(4.1f, 0.5f, -1.0f), 0.9f, CAST_STATIC },
+	{ "treadmill 2", PASS_MACHINES, drawSceneTreadmill2, Vector3f(4.1f, 0.5f, -0.2f), 0.9f, CAST_STATIC },
+	{ "treadmill 3", PASS_MACHINES, drawSceneTreadmill3, Vector3f(4.1f, 0.5f, 0.6f), 0.9f, CAST_STATIC },
+	{ "deadlift", PASS_MACHINES, drawSceneDeadlift, Vector3f(2.0f, 0.3f, 1.8f), 1.0f, CAST_DYNAMIC },
+	{ "bench press", PASS_MACHINES, drawSceneBenchPress, Vector3f(-0.2f, 0.45f, 0.3f), 1.0f, CAST_DYNAMIC },
+	{ "smith machine", PASS_MACHINES, drawSceneSmith, Vector3f(1.8f, 0.9f, -0.7f), 1.9f, CAST_DYNAMIC },
+	{ "floor", PASS_WALLS, drawSceneFloor, Vector3f(2.0f, 0.0f, 1.0f), 4.3f, CAST_NONE },
+	{ "left wall", PASS_WALLS, drawSceneLeftWall, Vector3f(-1.0f, 2.0f, 1.0f), 3.7f, CAST_NONE },
+	{ "back wall", PASS_WALLS, drawSceneBackWall, Vector3f(2.0f, 2.0f, -1.5f), 3.7f, CAST_NONE },
+	{ "right wall", PASS_WALLS, drawSceneRightWall, Vector3f(5.0f, 2.0f, 1.0f), 3.7f, CAST_NONE },
+	// Spread over the whole room; not casting keeps the dynamic shadow cascade tight around the player
+	{ "crowd 1", PASS_PLAYERS, drawSceneCrowd1, Vector3f(2.0f, 0.9f, 1.35f), 3.9f, CAST_NONE },
+	{ "crowd 2", PASS_PLAYERS, drawSceneCrowd2, Vector3f(2.0f, 0.9f, 1.35f), 3.9f, CAST_NONE },
+	{ "crowd 3", PASS_PLAYERS, drawSceneCrowd3, Vector3f(2.0f, 0.9f, 1.35f), 3.9f, CAST_NONE },
+	{ "crowd 4", PASS_PLAYERS, drawSceneCrowd4, Vector3f(2.0f, 0.9f, 1.35f), 3.9f, CAST_NONE },
+};
+const int SCENE_ITEM_COUNT = sizeof(sceneItems) / sizeof(sceneItems[0]);
 
-	if (gameState == WIN) {
-		stopBackgroundMusic();
+// Move the bounds of the items that animate
+void updateSceneBounds() {
+	sceneItems[0].center = Vector3f(2.5f + frame.posX, 0.5f + frame.PosY, 2.0f + frame.posZ);
+	sceneItems[6].center.y = frame.barHeight + 0.5f;
+}
 
+// View frustum planes (a, b, c, d) pointing inwards, from a projection * modelview matrix
+struct Frustum {
+	float planes[6][4];
 
-		// Play win sound once
-		if (!winSoundPlayed) {
-			playYouWinSound();
-			winSoundPlayed = true;
+	void extract(const GLfloat* projection, const GLfloat* modelview) {
+		float m[16];  // Column-major projection * modelview
+		for (int c = 0; c < 4; c++) {
+			for (int r = 0; r < 4; r++) {
+				m[c * 4 + r] = projection[0 * 4 + r] * modelview[c * 4 + 0] + projection[1 * 4 + r] * modelview[c * 4 + 1]
+					+ projection[2 * 4 + r] * modelview[c * 4 + 2] + projection[3 * 4 + r] * modelview[c * 4 + 3];
+			}
 		}
-		setupCamera();
-		setupLights();
-		glColor3f(0.0, 0.0, 0.0);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		glutSwapBuffers();
-		camera.setFrontView();
+		for (int i = 0; i < 3; i++) {
+			for (int c = 0; c < 4; c++) {
+				planes[i * 2][c] = m[c * 4 + 3] + m[c * 4 + i];
+				planes[i * 2 + 1][c] = m[c * 4 + 3] - m[c * 4 + i];
+			}
+		}
+		for (int p = 0; p < 6; p++) {
+			float length = sqrt(planes[p][0] * planes[p][0] + planes[p][1] * planes[p][1] + planes[p][2] * planes[p][2]);
+			for (int c = 0; c < 4; c++) planes[p][c] /= length;
+		}
+	}
 
-		displayWinScreen();  // Display win screen if game is won
-		glFlush();
+	bool intersectsSphere(const Vector3f& center, float radius) const {
+		for (int p = 0; p < 6; p++) {
+			if (planes[p][0] * center.x + planes[p][1] * center.y + planes[p][2] * center.z + planes[p][3] < -radius) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+// GL 1.3/1.4 and framebuffer object entry points and tokens for the shadow maps
+#ifndef GL_TEXTURE0
+#define GL_TEXTURE0 0x84C0
+#endif
+#ifndef GL_CLAMP_TO_BORDER
+#define GL_CLAMP_TO_BORDER 0x812D
+#endif
+#ifndef GL_DEPTH_COMPONENT24
+#define GL_DEPTH_COMPONENT24 0x81A6
+#endif
+#ifndef GL_DEPTH_TEXTURE_MODE
+#define GL_DEPTH_TEXTURE_MODE 0x884B
+#endif
+#ifndef GL_TEXTURE_COMPARE_MODE
+#define GL_TEXTURE_COMPARE_MODE 0x884C
+#endif
+#ifndef GL_TEXTURE_COMPARE_FUNC
+#define GL_TEXTURE_COMPARE_FUNC 0x884D
+#endif
+#ifndef GL_COMPARE_R_TO_TEXTURE
+#define GL_COMPARE_R_TO_TEXTURE 0x884E
+#endif
+#ifndef GL_COMBINE
+#define GL_COMBINE 0x8570
+#define GL_COMBINE_RGB 0x8571
+#define GL_INTERPOLATE 0x8575
+#define GL_CONSTANT 0x8576
+#define GL_PRIMARY_COLOR 0x8577
+#define GL_PREVIOUS 0x8578
+#define GL_SOURCE0_RGB 0x8580
+#define GL_SOURCE1_RGB 0x8581
+#define GL_SOURCE2_RGB 0x8582
+#define GL_OPERAND0_RGB 0x8590
+#define GL_OPERAND1_RGB 0x8591
+#define GL_OPERAND2_RGB 0x8592
+#endif
+#ifndef GL_FRAMEBUFFER
+#define GL_FRAMEBUFFER 0x8D40
+#define GL_DEPTH_ATTACHMENT 0x8D00
+#define GL_FRAMEBUFFER_COMPLETE 0x8CD5
+#endif
+
+typedef void (APIENTRY* ActiveTextureProc)(GLenum texture);
+typedef void (APIENTRY* GenFramebuffersProc)(GLsizei n, GLuint* ids);
+typedef void (APIENTRY* BindFramebufferProc)(GLenum target, GLuint framebuffer);
+typedef void (APIENTRY* FramebufferTexture2DProc)(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
+typedef GLenum(APIENTRY* CheckFramebufferStatusProc)(GLenum target);
+
+ActiveTextureProc pglActiveTexture = NULL;
+GenFramebuffersProc pglGenFramebuffers = NULL;
+BindFramebufferProc pglBindFramebuffer = NULL;
+FramebufferTexture2DProc pglFramebufferTexture2D = NULL;
+CheckFramebufferStatusProc pglCheckFramebufferStatus = NULL;
+
+// Depth map of the directional light. matrix takes world space to shadow map texture space.
+struct ShadowMap {
+	GLuint texture, framebuffer;
+	int size;
+	GLfloat matrix[16];
+	GLfloat projection[16], modelview[16];
+};
+
+// Shadows for the light in setupLights(). Static items are rendered into a large
+// map that is cached until the light or the layout changes; animated items go into
+// a small cascade fitted around them every frame. Both are applied with
+// fixed-function depth compares, so receivers need no shaders.
+class ShadowRenderer {
+public:
+	bool supported = false;
+	bool staticDirty = true;
+	float shadowDarkness = 0.5f;  // Fraction of the lit color kept in shadow
+
+	void init() {
+		pglActiveTexture = (ActiveTextureProc)getGLProc("glActiveTexture");
+		pglGenFramebuffers = (GenFramebuffersProc)getGLProc("glGenFramebuffers");
+		pglBindFramebuffer = (BindFramebufferProc)getGLProc("glBindFramebuffer");
+		pglFramebufferTexture2D = (FramebufferTexture2DProc)getGLProc("glFramebufferTexture2D");
+		pglCheckFramebufferStatus = (CheckFramebufferStatusProc)getGLProc("glCheckFramebufferStatus");
+		GLint units = 0;
+		glGetIntegerv(0x84E2 /* GL_MAX_TEXTURE_UNITS */, &units);
+		supported = pglActiveTexture && pglGenFramebuffers && pglBindFramebuffer && pglFramebufferTexture2D
+			&& pglCheckFramebufferStatus && units >= 3
+			&& glutExtensionSupported("GL_ARB_depth_texture") && glutExtensionSupported("GL_ARB_shadow");
+		if (supported) {
+			supported = createMap(staticMap, 2048) && createMap(dynamicMap, 512);
+		}
+		if (!supported) {
+			std::cerr << "Shadow mapping not supported, drawing without shadows." << std::endl;
+			return;
+		}
 
+		unsigned char white[4] = { 255, 255, 255, 255 };
+		glGenTextures(1, &whiteTexture);
+		glBindTexture(GL_TEXTURE_2D, whiteTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
+		glBindTexture(GL_TEXTURE_2D, 0);
 	}
-	else if (gameState == ACTIVE) {
 
-		setupCamera();
-		setupLights();
+	// Call when the light moves or static equipment is added, moved or removed
+	void invalidateStatic() {
+		staticDirty = true;
+	}
 
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		displayTimer();
-		updateTimer();
-		updateDeadliftAnimation(0.001);
-		updateDumbbellColor(0.005);
-		updateTreadmillAnimation(0.001);
-		updateBenchPressAnimation(0.001);
-		updateChinUpAnimation(0.001);
-		glutSwapBuffers();
-		//Player
+	void render(const SceneItem* items, int count) {
+		if (!supported) return;
+		ProfileScope pass(PASS_SHADOWS);
+		glPushAttrib(GL_ENABLE_BIT | GL_VIEWPORT_BIT | GL_COLOR_BUFFER_BIT | GL_POLYGON_BIT);
+		glDisable(GL_LIGHTING);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glEnable(GL_POLYGON_OFFSET_FILL);
+		glPolygonOffset(2.0f, 4.0f);
+		glMatrixMode(GL_PROJECTION);
 		glPushMatrix();
-		glTranslated(2.5, 0.5, 2.0);
-		drawPlayer();
-		glPopMatrix();
-		//Chin up machine
+		glMatrixMode(GL_MODELVIEW);
 		glPushMatrix();
-		glTranslated(-0.5, 0.1, 2.0);
-		glRotated(90, 0.0, 1.0, 0.0);
-		drawChinUpDipMachine();
 
-		glPopMatrix();
-		//Dumbell Rack
-		glPushMatrix();
-		glRotatef(90, 0.0f, 1.0f, 0.0f);
-		glTranslated(-2.5, 0.1, 4.5);
+		if (staticDirty) {
+			renderMap(staticMap, Vector3f(2.0f, 1.0f, 1.0f), 6.0f, items, count, CAST_STATIC);
+			staticDirty = false;
+		}
 
-		drawDumbbellRack();
-		glPopMatrix();
-		//Treadmill 1
-		glPushMatrix();
-		glTranslated(4.1, 0.1, -1.0);
-		drawBase();       // Draw the base of the treadmill
-		drawBelt();       // Draw the running belt
-		drawSideRails();  // Draw side rails on both sides
-		drawHandles();
-		drawHandleArms();
-		drawConsole();
+		// Fit the cascade around the animated items
+		Vector3f low(1e9f, 1e9f, 1e9f), high(-1e9f, -1e9f, -1e9f);
+		for (int i = 0; i < count; i++) {
+			if (items[i].shadow != CAST_DYNAMIC) continue;
+			const Vector3f& c = items[i].center;
+			float r = items[i].radius;
+			if (c.x - r < low.x) low.x = c.x - r;
+			if (c.y - r < low.y) low.y = c.y - r;
+			if (c.z - r < low.z) low.z = c.z - r;
+			if (c.x + r > high.x) high.x = c.x + r;
+			if (c.y + r > high.y) high.y = c.y + r;
+			if (c.z + r > high.z) high.z = c.z + r;
+		}
+		Vector3f center((low.x + high.x) / 2, (low.y + high.y) / 2, (low.z + high.z) / 2);
+		Vector3f extent = high - center;
+		float radius = sqrt(extent.x * extent.x + extent.y * extent.y + extent.z * extent.z);
+		renderMap(dynamicMap, center, radius, items, count, CAST_DYNAMIC);
+
+		pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glMatrixMode(GL_PROJECTION);
 		glPopMatrix();
-		//Treadmill 2
-		glPushMatrix();
-		glTranslated(4.1, 0.1, -0.2);
-		drawBase();       // Draw the base of the treadmill
-		drawBelt();       // Draw the running belt
-		drawSideRails();  // Draw side rails on both sides
-		drawHandles();
-		drawHandleArms();
-		drawConsole();
+		glMatrixMode(GL_MODELVIEW);
 		glPopMatrix();
-		//Treadmill 3
-		glPushMatrix();
+		glPopAttrib();
+	}
 
-		glTranslated(4.1, 0.1, 0.6);
-		drawBase();       // Draw the base of the treadmill
-		drawBelt();       // Draw the running belt
-		drawSideRails();  // Draw side rails on both sides
-		drawHandles();
-		drawHandleArms();
-		drawConsole();
-		glPopMatrix();
+	// Start applying the shadow maps; the camera's view matrix must be the current modelview
+	void beginReceive() {
+		if (!supported) return;
+		GLfloat darkness[4] = { shadowDarkness, shadowDarkness, shadowDarkness, 1.0f };
+
+		// Unit 0: static compare result lifted to darkness..1
+		bindMap(0, staticMap);
+		glTexEnvfv(GL_TEXTURE_ENV, GL_TEXTURE_ENV_COLOR, darkness);
+		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_COMBINE);
+		glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_RGB, GL_ADD);
+		glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_RGB, GL_TEXTURE);
+		glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND0_RGB, GL_SRC_COLOR);
+		glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE1_RGB, GL_CONSTANT);
+		glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND1_RGB, GL_SRC_COLOR);
+
+		// Unit 1: dynamic compare result picks between that and darkness
+		bindMap(1, dynamicMap);
+		glTexEnvfv(GL_TEXTURE_ENV, GL_TEXTURE_ENV_COLOR, darkness);
+		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_COMBINE);
+		glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_RGB, GL_INTERPOLATE);
+		glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_RGB, GL_PREVIOUS);
+		glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND0_RGB, GL_SRC_COLOR);
+		glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE1_RGB, GL_CONSTANT);
+		glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND1_RGB, GL_SRC_COLOR);
+		glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE2_RGB, GL_TEXTURE);
+		glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND2_RGB, GL_SRC_COLOR);
+
+		// Unit 2: scale the lit vertex color by the shadow factor
+		pglActiveTexture(GL_TEXTURE0 + 2);
+		glBindTexture(GL_TEXTURE_2D, whiteTexture);
+		glEnable(GL_TEXTURE_2D);
+		glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_COMBINE);
+		glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_RGB, GL_MODULATE);
+		glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_RGB, GL_PRIMARY_COLOR);
+		glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND0_RGB, GL_SRC_COLOR);
+		glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE1_RGB, GL_PREVIOUS);
+		glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND1_RGB, GL_SRC_COLOR);
+		pglActiveTexture(GL_TEXTURE0);
+	}
 
-		//Deadlift Bar
-		glPushMatrix();
-		glTranslated(2.0, barHeight, 1.8);  // Position the bar
-		glRotatef(deadliftRotationAngle, 0.0f, 1.0f, 0.0f);  // Rotate around the Y-axis
-		drawDeadliftBar();
-		drawDumbbell(0.4, 0.4);
-		glPopMatrix();
+	void endReceive() {
+		if (!supported) return;
+		for (int unit = 2; unit >= 0; unit--) {
+			pglActiveTexture(GL_TEXTURE0 + unit);
+			glDisable(GL_TEXTURE_2D);
+			glDisable(GL_TEXTURE_GEN_S);
+			glDisable(GL_TEXTURE_GEN_T);
+			glDisable(GL_TEXTURE_GEN_R);
+			glDisable(GL_TEXTURE_GEN_Q);
+			glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
+	}
 
-		//Bench press
-		glPushMatrix();
-		glTranslated(-1.3, 0.0, -0.4);  // Center in the larger room
-		drawBenchPressSeat();
-		drawSeatLeg1();
-		drawSeatLeg2();
-		drawVerticalSupport1();
-		drawVerticalSupport2();
-		drawBar();
-		drawLeftWeight();
-		drawRightWeight();
-		glPopMatrix();
+private:
+	ShadowMap staticMap, dynamicMap;
+	GLuint whiteTexture = 0;
+
+	bool createMap(ShadowMap& map, int size) {
+		map.size = size;
+		glGenTextures(1, &map.texture);
+		glBindTexture(GL_TEXTURE_2D, map.texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		// Everything outside the map compares as lit
+		GLfloat border[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+		glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+		glTexParameteri(GL_TEXTURE_2D, GL_DEPTH_TEXTURE_MODE, GL_LUMINANCE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		pglGenFramebuffers(1, &map.framebuffer);
+		pglBindFramebuffer(GL_FRAMEBUFFER, map.framebuffer);
+		pglFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, map.texture, 0);
+		glDrawBuffer(GL_NONE);
+		glReadBuffer(GL_NONE);
+		bool complete = pglCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+		pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return complete;
+	}
 
-		//Smith Machine
-		glPushMatrix();
-		glTranslated(1.8, 0.0, -0.7);
-		drawBaseSupport();
-		drawLeftVerticalFrame();
-		drawRightVerticalFrame();
-		drawTopBar();
-		drawBarbell();
-		drawLeftCounterweight();
-		drawRightCounterweight();
-		drawLeftFrameSupport();
-		drawRightFrameSupport();
-		drawBottomSupport();
-		glPopMatrix();
+	// Orthographic depth render of the static or dynamic casters inside a sphere
+	void renderMap(ShadowMap& map, Vector3f center, float radius, const SceneItem* items, int count, ShadowCasting casters) {
+		Vector3f toLight = Vector3f(lightPosition[0], lightPosition[1], lightPosition[2]).unit();
+		Vector3f offset = toLight * (radius + 1.0f);
+		Vector3f eye = center + offset;
+
+		glMatrixMode(GL_PROJECTION);
+		glLoadIdentity();
+		glOrtho(-radius, radius, -radius, radius, 0.1, 2.0 * radius + 2.0);
+		glGetFloatv(GL_PROJECTION_MATRIX, map.projection);
+		glMatrixMode(GL_MODELVIEW);
+		glLoadIdentity();
+		gluLookAt(eye.x, eye.y, eye.z, center.x, center.y, center.z, 0.0, 1.0, 0.0);
+		glGetFloatv(GL_MODELVIEW_MATRIX, map.modelview);
+
+		pglBindFramebuffer(GL_FRAMEBUFFER, map.framebuffer);
+		glViewport(0, 0, map.size, map.size);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		for (int i = 0; i < count; i++) {
+			if (items[i].shadow == casters) items[i].commands.submit();
+		}
 
-		// Ground wall (floor) - light brown
+		// Bias from clip space [-1, 1] into texture space [0, 1]
 		glPushMatrix();
-		glColor3f(0.76f, 0.6f, 0.42f); // Light brown color
-		glTranslated(2.0, 0.0, 1.0);    // Centered on ground level
-		drawWall(0.02, 6.0, 6.0);       // Increased width significantly
+		glLoadIdentity();
+		glTranslatef(0.5f, 0.5f, 0.5f);
+		glScalef(0.5f, 0.5f, 0.5f);
+		glMultMatrixf(map.projection);
+		glMultMatrixf(map.modelview);
+		glGetFloatv(GL_MODELVIEW_MATRIX, map.matrix);
 		glPopMatrix();
+	}
 
-		// Left wall - light gray with window frame
-		glPushMatrix();
-		glColor3f(WallColor[0], WallColor[1], WallColor[2]); // Light gray color
-		glTranslated(-1.0, 2.0, 1.0);   // Move to the left side
-		glRotated(90, 0, 0, 1.0);
-		drawWall(0.02, 4.0, 6.0);       // Adjusted height to match back wall
-		glTranslated(0.0, -0.2, 0.5);    // Slightly offset frame outward
-		glRotated(-90, 1.0, 0, 0);
-		drawWindowFrame(1.5, 1.0, 0.05); // Window frame with width, height, thickness
+	// Eye-linear texgen with world-space planes, valid while the modelview is the view matrix
+	void bindMap(int unit, const ShadowMap& map) {
+		pglActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(GL_TEXTURE_2D, map.texture);
+		glEnable(GL_TEXTURE_2D);
+		GLenum coords[4] = { GL_S, GL_T, GL_R, GL_Q };
+		GLenum gens[4] = { GL_TEXTURE_GEN_S, GL_TEXTURE_GEN_T, GL_TEXTURE_GEN_R, GL_TEXTURE_GEN_Q };
+		for (int row = 0; row < 4; row++) {
+			GLfloat plane[4] = { map.matrix[row], map.matrix[4 + row], map.matrix[8 + row], map.matrix[12 + row] };
+			glTexGeni(coords[row], GL_TEXTURE_GEN_MODE, GL_EYE_LINEAR);
+			glTexGenfv(coords[row], GL_EYE_PLANE, plane);
+			glEnable(gens[row]);
+		}
+	}
+};
 
-		glPopMatrix();
+ShadowRenderer shadows;
 
-		// Back wall - light gray with window frame
-		glPushMatrix();
+// A camera drawn into a rectangle of the window
+struct View {
+	Camera* camera;
+	float x, y, width, height;  // Fraction of the window
+	int viewport[4];
+	GLfloat projection[16], modelview[16];
+	Frustum frustum;
+};
 
+const int MAX_VIEWS = 4;
 
-		glTranslated(2.0, 2.0, -1.5);   // Centered back, made wider
-		drawWindowFrame(4.0, 2.0, 0.05); // Window frame with width, height, thickness
-		glRotated(-90, 1.0, 0.0, 0.0);
-		glColor3f(WallColor[0], WallColor[1], WallColor[2]); // Light gray color
-		drawWall(0.02, 6.0, 4.0);       // Increased width significantly
-		glPopMatrix();
+View views[MAX_VIEWS];
+int viewCount = 0;
+int sceneDrawOrder[SCENE_ITEM_COUNT];  // Item indices grouped by pass, shared by all views
+unsigned int sceneVisibility[SCENE_ITEM_COUNT];  // Bit v is set when the item is inside view v
 
-		// Right wall - light gray with window frame
-		glPushMatrix();
+void layoutViews() {
+	View full = { &frame.camera, 0.0f, 0.0f, 1.0f, 1.0f };
+	viewCount = 0;
+	switch (viewLayout) {
+	case LAYOUT_SINGLE:
+		views[viewCount++] = full;
+		break;
+	case LAYOUT_PICTURE_IN_PICTURE: {
+		View inset = { &broadcastCamera, 0.68f, 0.68f, 0.3f, 0.3f };
+		views[viewCount++] = full;
+		views[viewCount++] = inset;
+		break;
+	}
+	case LAYOUT_SPLIT: {
+		View left = { &frame.camera, 0.0f, 0.0f, 0.5f, 1.0f };
+		View right = { &broadcastCamera, 0.5f, 0.0f, 0.5f, 1.0f };
+		views[viewCount++] = left;
+		views[viewCount++] = right;
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void applyView(const View& view) {
+	glViewport(view.viewport[0], view.viewport[1], view.viewport[2], view.viewport[3]);
+	glMatrixMode(GL_PROJECTION);
+	glLoadMatrixf(view.projection);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadMatrixf(view.modelview);
+}
+
+// Record every item's command list, one job per item. The draw functions only read
+// the frame snapshot, which stays fixed until the next Display().
+void recordScene() {
+	renderWorkers.parallelFor(SCENE_ITEM_COUNT, [](int i) {
+		TraceScope trace(sceneItems[i].name);
+		CommandList& list = sceneItems[i].commands;
+		list.clear();
+		recordingList = &list;
+		sceneItems[i].draw();
+		recordingList = NULL;
+	});
+}
 
-		glTranslated(5.0, 2.0, 1.0);    // Move to the right side
+// Draw the scene once per view. Updates, culling and the draw order are done once
+// for all views, and drawing is pass-major so each profiler pass covers every view.
+void renderViews() {
+	static bool orderBuilt = false;
+	if (!orderBuilt) {
+		int n = 0;
+		for (int pass = 0; pass < PASS_COUNT; pass++) {
+			for (int i = 0; i < SCENE_ITEM_COUNT; i++) {
+				if (sceneItems[i].pass == pass) sceneDrawOrder[n++] = i;
+			}
+		}
+		orderBuilt = true;
+	}
 
-		glRotated(90, 0, 0, 1.0);
+	layoutViews();
+	int windowWidth = glutGet(GLUT_WINDOW_WIDTH);
+	int windowHeight = glutGet(GLUT_WINDOW_HEIGHT);
+	for (int v = 0; v < viewCount; v++) {
+		View& view = views[v];
+		view.viewport[0] = (int)(view.x * windowWidth);
+		view.viewport[1] = (int)(view.y * windowHeight);
+		view.viewport[2] = (int)(view.width * windowWidth);
+		view.viewport[3] = (int)(view.height * windowHeight);
+		// Keep the full-window projection of setupCamera() and stretch it by the view's shape
+		double aspect = (640 / 480) * (view.width / view.height);
+		setupCamera(*view.camera, aspect);
+		glGetFloatv(GL_PROJECTION_MATRIX, view.projection);
+		glGetFloatv(GL_MODELVIEW_MATRIX, view.modelview);
+		view.frustum.extract(view.projection, view.modelview);
+	}
 
-		glColor3f(WallColor[0], WallColor[1], WallColor[2]); // Light gray color
-		drawWall(0.02, 4.0, 6.0);       // Adjusted height to match back wall
-		glTranslated(0.0, 0.0, 0.5);    // Slightly offset frame outward
-		glRotated(-90, 1.0, 0, 0);
-		drawWindowFrame(1.5, 1.0, 0.05); // Window frame with width, height, thickness
+	recordScene();
+	shadows.render(sceneItems, SCENE_ITEM_COUNT);
+	for (int i = 0; i < SCENE_ITEM_COUNT; i++) {
+		unsigned int mask = 0;
+		for (int v = 0; v < viewCount; v++) {
+			if (views[v].frustum.intersectsSphere(sceneItems[i].center, sceneItems[i].radius)) mask |= 1u << v;
+		}
+		sceneVisibility[i] = mask;
+	}
 
-		glPopMatrix();
+	// A view at a time, so an inset's passes all land on its own cleared rectangle
+	// and nothing of the main view is drawn over it afterwards
+	for (int v = 0; v < viewCount; v++) {
+		View& view = views[v];
+		if (v > 0) {  // The first view was cleared with the window
+			glEnable(GL_SCISSOR_TEST);
+			glScissor(view.viewport[0], view.viewport[1], view.viewport[2], view.viewport[3]);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			glDisable(GL_SCISSOR_TEST);
+		}
+		applyView(view);
+		setupLights();
+		shadows.beginReceive();
+		int next = 0;
+		while (next < SCENE_ITEM_COUNT) {
+			ProfilePass pass = sceneItems[sceneDrawOrder[next]].pass;
+			int end = next;
+			while (end < SCENE_ITEM_COUNT && sceneItems[sceneDrawOrder[end]].pass == pass) end++;
+
+			profiler.beginPass(pass);
+			for (int k = next; k < end; k++) {
+				int item = sceneDrawOrder[k];
+				if (sceneVisibility[item] & (1u << v)) sceneItems[item].commands.submit();
+			}
+			profiler.endPass(pass);
+			next = end;
+		}
+		shadows.endReceive();
+	}
+
+	// Leave the main camera current for the HUD
+	glViewport(0, 0, windowWidth, windowHeight);
+	setupCamera();
+}
+
+// A left click on the floor of any view sends the player walking there. The ray is
+// unprojected with the matrices the view was last drawn with.
+void onMouse(int button, int state, int x, int y) {
+	if (button != GLUT_LEFT_BUTTON || state != GLUT_DOWN) return;
+	int windowY = glutGet(GLUT_WINDOW_HEIGHT) - y;
+	for (int v = viewCount - 1; v >= 0; v--) {  // Insets are on top
+		const View& view = views[v];
+		if (x < view.viewport[0] || x >= view.viewport[0] + view.viewport[2] ||
+			windowY < view.viewport[1] || windowY >= view.viewport[1] + view.viewport[3]) continue;
+		GLdouble projection[16], modelview[16], nearPoint[3], farPoint[3];
+		for (int i = 0; i < 16; i++) {
+			projection[i] = view.projection[i];
+			modelview[i] = view.modelview[i];
+		}
+		gluUnProject(x, windowY, 0.0, modelview, projection, view.viewport, &nearPoint[0], &nearPoint[1], &nearPoint[2]);
+		gluUnProject(x, windowY, 1.0, modelview, projection, view.viewport, &farPoint[0], &farPoint[1], &farPoint[2]);
+		if ((nearPoint[1] > 0.0) == (farPoint[1] > 0.0)) return;  // Doesn't reach the floor
+		double t = nearPoint[1] / (nearPoint[1] - farPoint[1]);
+		InputEvent input = { INPUT_CLICK, 0 };
+		input.time = inputClock();
+		input.x = (float)(nearPoint[0] + t * (farPoint[0] - nearPoint[0])) - 2.5f;  // Undo drawScenePlayer()'s offset
+		input.z = (float)(nearPoint[2] + t * (farPoint[2] - nearPoint[2])) - 2.0f;
+		inputQueue.push(input);
+		return;
+	}
+}
+
+void Display() {
+	if (!fontAtlas.ready) {
+		fontAtlas.build();
+	}
+	frame = snapshots.latest();
+
+	if (frame.gameState == WIN) {
+		setupCamera();
+		setupLights();
+		glColor3f(0.0, 0.0, 0.0);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glutSwapBuffers();
 
+		displayWinScreen();  // Display win screen if game is won
 		glFlush();
+
 	}
-	else {
-		stopBackgroundMusic();
+	else if (frame.gameState == ACTIVE) {
 
+		setupCamera();
+		setupLights();
 
-		// Play lose sound once
-		if (!loseSoundPlayed) {
-			playYouDiedSound();
-			loseSoundPlayed = true;
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		profiler.beginFrame();
+		profiler.beginPass(PASS_UPDATE);
+		updateSceneBounds();
+		profiler.endPass(PASS_UPDATE);
+		glutSwapBuffers();
+		renderViews();
+
+		{
+			ProfileScope hudPass(PASS_HUD);
+			displayTimer();
+			displayPrompt();
+			displayLatency();
+			hud.composite();
+			displayProfilerOverlay();
 		}
+		profiler.endFrame();
+
+		glFlush();
+	}
+	else {
 		setupCamera();
 		setupLights();
 		glColor3f(0.0, 0.0, 0.0);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 		glutSwapBuffers();
-		camera.setFrontView();
 		displayLoseScreen();  // Display win screen if game is won
 
 		glFlush();
 
 	}
+	if (inputLatency.enabled) {  // Single buffered, so the frame is out once the GPU is done
+		glFinish();
+		inputLatency.presented(frame.tick);
+	}
 }
 
 
@@ -2040,7 +7852,66 @@ void Display() {
 
 
 void main(int argc, char** argv) {
+	traceSetThreadName("main");
 	glutInit(&argc, argv);
+	initNavigation();
+	initZones();
+	subscribeGymEvents();
+	int workers = (int)std::thread::hardware_concurrency() - 1;
+	workers = workers < 1 ? 1 : (workers > 7 ? 7 : workers);
+	const char* journalFile = "gym_session.journal";
+	const char* serverAddress = NULL;
+	int serverPort = 0;
+	float netLoss = 0.0f;
+	const char* inputScript = NULL;
+	bool rawInput = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-rawinput") == 0) rawInput = true;  // Read keyboards and gamepads from evdev
+		if (strcmp(argv[i], "-latency") == 0) inputLatency.enabled = true;  // Measure input to photon
+	}
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "-trace") == 0) {  // Write the event trace here at exit
+			traceFile = argv[i + 1];
+			atexit(writeTraceAtExit);
+		}
+		if (strcmp(argv[i], "-crowd") == 0) {  // Start with N AI gym-goers
+			crowdSize = atoi(argv[i + 1]);
+			spawnCrowd(crowdSize);
+		}
+		if (strcmp(argv[i], "-resume") == 0) {  // Continue a kiosk session and keep it saved
+			resumeFile = argv[i + 1];
+			readGymState(resumeFile);
+			playerKeys = 0;
+		}
+		if (strcmp(argv[i], "-rewind") == 0) {  // Megabytes of rewind history
+			rewindBudget = (size_t)atoi(argv[i + 1]) << 20;
+		}
+		if (strcmp(argv[i], "-journal") == 0) {  // Where to record this session's input
+			journalFile = argv[i + 1];
+		}
+		if (strcmp(argv[i], "-replay") == 0) {  // Replay a journal without a window and exit
+			initAnimationClips("gym_animations.clips");
+			simulationWorkers.start(workers, simulationWorkerNames);
+			exit(replayJournal(argv[i + 1]));
+		}
+		if (strcmp(argv[i], "-server") == 0) {  // Host a multiplayer gym on this UDP port, without a window
+			serverPort = atoi(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "-connect") == 0) {  // Join a gym server, host or host:port
+			serverAddress = argv[i + 1];
+		}
+		if (strcmp(argv[i], "-netloss") == 0) {  // Drop this fraction of outgoing packets
+			netLoss = (float)atof(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "-inputscript") == 0) {  // Play timed input from a file instead of the devices
+			inputScript = argv[i + 1];
+		}
+	}
+	if (serverPort > 0) {
+		initAnimationClips("gym_animations.clips");
+		simulationWorkers.start(workers, simulationWorkerNames);
+		exit(runServer((unsigned short)serverPort, netLoss));
+	}
 	initOpenAL();
 	std::thread soundThread(loadSoundInBackground);
 	soundThread.join();
@@ -2050,14 +7921,23 @@ void main(int argc, char** argv) {
 		playBackgroundMusic();
 	else
 		playYouDiedSound();
+	refreshFromGymState();  // After -resume, and with the sound up
 	glutInitWindowSize(640, 480);
 	glutInitWindowPosition(50, 50);
 
 	glutCreateWindow("Roblox el 8alaba");
+	profiler.init();
+	initAnimationClips("gym_animations.clips");
+	shadows.init();
+	playerMesh.init();
+	renderWorkers.start(workers, renderWorkerNames);
+	simulationWorkers.start(workers, simulationWorkerNames);
 	glutDisplayFunc(Display);
 	glutIdleFunc(idle);
-	glutSpecialFunc(handleSpecialKeyboard);
-	glutKeyboardFunc(handleKeyboard);
+	glutSpecialFunc(onSpecialKeyboard);
+	glutSpecialUpFunc(onSpecialKeyboardUp);
+	glutKeyboardFunc(onKeyboard);
+	glutMouseFunc(onMouse);
 
 	glutInitDisplayMode(GLUT_SINGLE | GLUT_RGB | GLUT_DEPTH);
 	glClearColor(1.0f, 1.0f, 1.0f, 0.0f);
@@ -2070,7 +7950,93 @@ void main(int argc, char** argv) {
 
 	glShadeModel(GL_SMOOTH);
 
+	rewindHistory.init(rewindBudget);
+	inputJournal.open(journalFile);
+	atexit(closeJournal);
+	if (serverAddress) {
+		std::string host = serverAddress;
+		size_t colon = host.find(':');
+		unsigned short port = colon == std::string::npos ? NET_DEFAULT_PORT : (unsigned short)atoi(host.c_str() + colon + 1);
+		if (netClient.connect(host.substr(0, colon).c_str(), port)) netClient.transport().dropRate = netLoss;
+	}
+	atexit(saveResumeFile);
+	startSimulation();
+	atexit(stopSimulation);
+	if ((rawInput || inputScript) && startRawInput(inputScript)) atexit(stopRawInput);
+	if (inputLatency.enabled) {
+		inputLatency.openLog("latency.log");
+		atexit(finishLatency);
+	}
 	glutMainLoop();
 
 	cleanupOpenAL();
-}
\ No newline at end of file
+}
+#else
+// Dedicated server build (GymServer.vcxproj): the simulation with no window or sound.
+// -sessions N ticks N bot-played games for capacity planning, -batch N plays N reduced
+// games for tuning (-policy random or nearest, -time seconds on the clock), -server
+// PORT hosts a multiplayer gym, -replay FILE checks a journal.
+int main(int argc, char** argv) {
+	traceSetThreadName("main");
+	initNavigation();
+	initZones();
+	subscribeGymEvents();
+	initAnimationClips("gym_animations.clips");
+	int workers = (int)std::thread::hardware_concurrency() - 1;
+	workers = workers < 1 ? 1 : (workers > 7 ? 7 : workers);
+	simulationWorkers.start(workers, simulationWorkerNames);
+	int sessions = 1000;
+	float seconds = 10.0f, netLoss = 0.0f, timeLimit = timeRemaining;
+	BatchPolicy policy = POLICY_RANDOM;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "-trace") == 0) {  // Write the event trace here at exit
+			traceFile = argv[i + 1];
+			atexit(writeTraceAtExit);
+		}
+		if (strcmp(argv[i], "-crowd") == 0) {  // AI gym-goers on the multiplayer server
+			crowdSize = atoi(argv[i + 1]);
+			spawnCrowd(crowdSize);
+		}
+		if (strcmp(argv[i], "-sessions") == 0) {
+			sessions = atoi(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "-seconds") == 0) {
+			seconds = (float)atof(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "-netloss") == 0) {  // Drop this fraction of outgoing packets
+			netLoss = (float)atof(argv[i + 1]);
+		}
+		if (strcmp(argv[i], "-policy") == 0) {
+			policy = strcmp(argv[i + 1], "nearest") == 0 ? POLICY_NEAREST : POLICY_RANDOM;
+		}
+		if (strcmp(argv[i], "-time") == 0) {
+			timeLimit = (float)atof(argv[i + 1]);
+		}
+	}
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "-batch") == 0) {
+			long long games = atoll(argv[i + 1]);
+			if (games < 1 || !(timeLimit > 0.0f)) {
+				std::cerr << "Usage: -batch GAMES [-policy random|nearest] [-time SECONDS], with at least one game and a positive time" << std::endl;
+				return 1;
+			}
+			return runBatch(games, policy, timeLimit);
+		}
+		if (strcmp(argv[i], "-server") == 0) {
+			return runServer((unsigned short)atoi(argv[i + 1]), netLoss);
+		}
+		if (strcmp(argv[i], "-replay") == 0) {
+			return replayJournal(argv[i + 1]);
+		}
+	}
+	const char* inputScript = NULL;
+	bool latency = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-latency") == 0) latency = true;
+		if (strcmp(argv[i], "-inputscript") == 0 && i + 1 < argc) inputScript = argv[i + 1];
+	}
+	if (latency) inputLatency.openLog("latency.log");
+	if (latency || inputScript) return runScriptedSession(inputScript, seconds, latency);
+	return runSessions(sessions, seconds);
+}
+#endif